@@ -0,0 +1,332 @@
+#include "distances.h"
+
+#include <cmath>
+#include <stdexcept>
+
+#ifdef HNSW_DISTANCE_X86
+#include <immintrin.h>
+#endif
+
+// --- Metric names ---
+
+std::string metricToString(Metric metric) {
+    switch (metric) {
+        case Metric::InnerProduct: return "ip";
+        case Metric::Cosine: return "cosine";
+        default: return "l2";
+    }
+}
+
+Metric metricFromString(const std::string& name) {
+    if (name == "l2") return Metric::L2;
+    if (name == "ip") return Metric::InnerProduct;
+    if (name == "cosine") return Metric::Cosine;
+    throw std::runtime_error("Unknown metric '" + name + "'. Expected l2, ip or cosine.");
+}
+
+// --- CPU feature detection ---
+
+enum class SimdLevel { Scalar, SSE, AVX2, AVX512 };
+
+static SimdLevel detectSimdLevel() {
+#ifdef HNSW_DISTANCE_X86
+    // __builtin_cpu_supports also checks (via XGETBV) that the OS saves
+    // the wider registers, so a "yes" here means we can really use them.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return SimdLevel::AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return SimdLevel::SSE;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+static SimdLevel getSimdLevel() {
+    static const SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+// --- Scalar ---
+
+float L2SqrScalar(const float* a, const float* b, int dim) {
+    float sum = 0;
+    for (int i = 0; i < dim; ++i) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+float InnerProductDistanceScalar(const float* a, const float* b, int dim) {
+    float dot = 0;
+    for (int i = 0; i < dim; ++i) {
+        dot += a[i] * b[i];
+    }
+    return 1.0f - dot;
+}
+
+#ifdef HNSW_DISTANCE_X86
+
+// --- SSE4.2 (4 floats per step) ---
+
+__attribute__((target("sse4.2")))
+static inline float horizontalSum(__m128 v) {
+    __m128 shuf = _mm_movehdup_ps(v);
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse4.2")))
+float L2SqrSSE(const float* a, const float* b, int dim) {
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+    }
+    for (; i + 4 <= dim; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(d, d));
+    }
+    float sum = horizontalSum(_mm_add_ps(sum0, sum1));
+    for (; i < dim; ++i) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+__attribute__((target("sse4.2")))
+float InnerProductDistanceSSE(const float* a, const float* b, int dim) {
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= dim; i += 8) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    for (; i + 4 <= dim; i += 4) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float dot = horizontalSum(_mm_add_ps(sum0, sum1));
+    for (; i < dim; ++i) {
+        dot += a[i] * b[i];
+    }
+    return 1.0f - dot;
+}
+
+// --- AVX2 + FMA (8 floats per step) ---
+
+__attribute__((target("avx2,fma")))
+static inline float horizontalSum(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    __m128 shuf = _mm_movehdup_ps(lo);
+    __m128 sums = _mm_add_ps(lo, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("avx2,fma")))
+float L2SqrAVX2(const float* a, const float* b, int dim) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        sum0 = _mm256_fmadd_ps(d, d, sum0);
+    }
+    float sum = horizontalSum(_mm256_add_ps(sum0, sum1));
+    for (; i < dim; ++i) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+float InnerProductDistanceAVX2(const float* a, const float* b, int dim) {
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= dim; i += 16) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+    }
+    for (; i + 8 <= dim; i += 8) {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+    }
+    float dot = horizontalSum(_mm256_add_ps(sum0, sum1));
+    for (; i < dim; ++i) {
+        dot += a[i] * b[i];
+    }
+    return 1.0f - dot;
+}
+
+// --- AVX-512 (16 floats per step, masked tail) ---
+
+// _mm512_reduce_add_ps() with full-mask shuffles: the unmasked ones pass an
+// undefined source, which trips -Wuninitialized in GCC 12's headers
+__attribute__((target("avx512f")))
+static inline float horizontalSum(__m512 v) {
+    const __mmask16 all = 0xFFFF;
+    v = _mm512_add_ps(v, _mm512_mask_shuffle_f32x4(v, all, v, v, _MM_SHUFFLE(1, 0, 3, 2))); // 256-bit halves
+    v = _mm512_add_ps(v, _mm512_mask_shuffle_f32x4(v, all, v, v, _MM_SHUFFLE(2, 3, 0, 1))); // 128-bit lanes
+    v = _mm512_add_ps(v, _mm512_mask_permute_ps(v, all, v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm512_add_ps(v, _mm512_mask_permute_ps(v, all, v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm512_cvtss_f32(v);
+}
+
+__attribute__((target("avx512f")))
+float L2SqrAVX512(const float* a, const float* b, int dim) {
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+        sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+    }
+    for (; i + 16 <= dim; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        sum0 = _mm512_fmadd_ps(d, d, sum0);
+    }
+    if (i < dim) {
+        // The masked load never touches memory past the end of the vectors
+        __mmask16 mask = (__mmask16)((1u << (dim - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        sum1 = _mm512_fmadd_ps(d, d, sum1);
+    }
+    return horizontalSum(_mm512_add_ps(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+float InnerProductDistanceAVX512(const float* a, const float* b, int dim) {
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= dim; i += 32) {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+        sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+    }
+    for (; i + 16 <= dim; i += 16) {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+    }
+    if (i < dim) {
+        __mmask16 mask = (__mmask16)((1u << (dim - i)) - 1);
+        sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum1);
+    }
+    return 1.0f - horizontalSum(_mm512_add_ps(sum0, sum1));
+}
+
+#endif // HNSW_DISTANCE_X86
+
+// --- Dispatch ---
+
+DistanceFunc getL2SqrFunc(int dim) {
+    if (dim > 0 && dim < 8) {
+        return L2SqrScalar;
+    }
+    static const DistanceFunc func = []() -> DistanceFunc {
+        switch (getSimdLevel()) {
+#ifdef HNSW_DISTANCE_X86
+            case SimdLevel::AVX512: return L2SqrAVX512;
+            case SimdLevel::AVX2: return L2SqrAVX2;
+            case SimdLevel::SSE: return L2SqrSSE;
+#endif
+            default: return L2SqrScalar;
+        }
+    }();
+    return func;
+}
+
+DistanceFunc getInnerProductFunc(int dim) {
+    if (dim > 0 && dim < 8) {
+        return InnerProductDistanceScalar;
+    }
+    static const DistanceFunc func = []() -> DistanceFunc {
+        switch (getSimdLevel()) {
+#ifdef HNSW_DISTANCE_X86
+            case SimdLevel::AVX512: return InnerProductDistanceAVX512;
+            case SimdLevel::AVX2: return InnerProductDistanceAVX2;
+            case SimdLevel::SSE: return InnerProductDistanceSSE;
+#endif
+            default: return InnerProductDistanceScalar;
+        }
+    }();
+    return func;
+}
+
+DistanceFunc getDistanceFunc(Metric metric, int dim) {
+    if (metric == Metric::L2) {
+        return getL2SqrFunc(dim);
+    }
+    // Cosine vectors are unit length, so 1 - cos == 1 - dot
+    return getInnerProductFunc(dim);
+}
+
+std::vector<DistanceKernel> getAvailableL2SqrKernels() {
+    std::vector<DistanceKernel> kernels;
+    kernels.push_back({"scalar", L2SqrScalar});
+#ifdef HNSW_DISTANCE_X86
+    SimdLevel level = getSimdLevel();
+    if (level >= SimdLevel::SSE) kernels.push_back({"sse4.2", L2SqrSSE});
+    if (level >= SimdLevel::AVX2) kernels.push_back({"avx2", L2SqrAVX2});
+    if (level >= SimdLevel::AVX512) kernels.push_back({"avx512", L2SqrAVX512});
+#endif
+    return kernels;
+}
+
+std::vector<DistanceKernel> getAvailableInnerProductKernels() {
+    std::vector<DistanceKernel> kernels;
+    kernels.push_back({"scalar", InnerProductDistanceScalar});
+#ifdef HNSW_DISTANCE_X86
+    SimdLevel level = getSimdLevel();
+    if (level >= SimdLevel::SSE) kernels.push_back({"sse4.2", InnerProductDistanceSSE});
+    if (level >= SimdLevel::AVX2) kernels.push_back({"avx2", InnerProductDistanceAVX2});
+    if (level >= SimdLevel::AVX512) kernels.push_back({"avx512", InnerProductDistanceAVX512});
+#endif
+    return kernels;
+}
+
+void normalizeVector(float* v, int dim) {
+    float norm_sq = 0;
+    for (int i = 0; i < dim; ++i) {
+        norm_sq += v[i] * v[i];
+    }
+    if (norm_sq <= 0.0f) {
+        return;
+    }
+    float inv = 1.0f / std::sqrt(norm_sq);
+    for (int i = 0; i < dim; ++i) {
+        v[i] *= inv;
+    }
+}
+
+const char* getDistanceSimdLevel() {
+    switch (getSimdLevel()) {
+        case SimdLevel::AVX512: return "avx512";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::SSE: return "sse4.2";
+        default: return "scalar";
+    }
+}
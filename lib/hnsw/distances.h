@@ -0,0 +1,76 @@
+#ifndef DISTANCES_H
+#define DISTANCES_H
+
+#include <vector>
+#include <string>
+
+/*
+Distance kernels used by HNSW.
+
+Every kernel has a plain scalar version plus SSE4.2 / AVX2 / AVX-512 variants.
+The SIMD variants are compiled with per-function target attributes, so the
+library itself is built without any -m flags and one binary runs everywhere.
+The best variant for the current CPU is picked once at runtime (CPUID).
+*/
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HNSW_DISTANCE_X86 1
+#endif
+
+// Distance spaces HNSW can be built on.
+// - L2:           squared euclidean distance
+// - InnerProduct: 1 - dot(a, b)
+// - Cosine:       1 - cos(a, b). Vectors are normalized when they are added
+//                 (and queries when they are searched), then the inner
+//                 product kernel is used.
+enum class Metric { L2, InnerProduct, Cosine };
+
+// "l2", "ip", "cosine" <-> Metric (used by the DB file and the CLI)
+std::string metricToString(Metric metric);
+Metric metricFromString(const std::string& name);
+
+// Same signature HNSW has always used for dist_func_
+typedef float (*DistanceFunc)(const float*, const float*, int);
+
+// A named kernel, used by the benchmark and the tests to compare variants
+struct DistanceKernel {
+    const char* name;
+    DistanceFunc func;
+};
+
+// --- Scalar reference ---
+float L2SqrScalar(const float* a, const float* b, int dim);
+float InnerProductDistanceScalar(const float* a, const float* b, int dim);
+
+#ifdef HNSW_DISTANCE_X86
+// --- SIMD variants (only call these if the CPU supports them) ---
+float L2SqrSSE(const float* a, const float* b, int dim);
+float L2SqrAVX2(const float* a, const float* b, int dim);
+float L2SqrAVX512(const float* a, const float* b, int dim);
+float InnerProductDistanceSSE(const float* a, const float* b, int dim);
+float InnerProductDistanceAVX2(const float* a, const float* b, int dim);
+float InnerProductDistanceAVX512(const float* a, const float* b, int dim);
+#endif
+
+// The fastest L2 kernel supported by this CPU. Resolved once, then cached.
+// For tiny vectors (dim < 8) the SIMD setup costs more than it saves,
+// so pass the dimension to get the scalar loop there.
+DistanceFunc getL2SqrFunc(int dim = 0);
+
+// Same, for the inner product distance (1 - dot)
+DistanceFunc getInnerProductFunc(int dim = 0);
+
+// The kernel HNSW should use for a metric (Cosine uses the inner product)
+DistanceFunc getDistanceFunc(Metric metric, int dim = 0);
+
+// All kernels this CPU can run, scalar first.
+std::vector<DistanceKernel> getAvailableL2SqrKernels();
+std::vector<DistanceKernel> getAvailableInnerProductKernels();
+
+// Scales v to unit length in place (zero vectors are left alone)
+void normalizeVector(float* v, int dim);
+
+// Name of the instruction set the dispatcher picked ("scalar", "sse4.2", "avx2", "avx512")
+const char* getDistanceSimdLevel();
+
+#endif // DISTANCES_H
@@ -8,245 +8,1576 @@
 #include <map>
 #include <set>
 #include <mutex>
+#include <shared_mutex>
+#include <atomic>
 #include <thread>
 #include <random>
 #include <stdexcept>
+#include <string>
 #include <cmath> // For std::sqrt
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <limits>
+#include <deque>
+
+#include "distances.h" // SIMD distance kernels
+#include "visited_list_pool.h" // Epoch-tagged visited lists for searchLayer
+#include "aligned_allocator.h" // Cache-line aligned storage blocks
+#include "mapped_file.h" // Read-only mmap of a saved index
+#include "parallel_for.h" // Multi-threaded bulk insert
+#include "thread_pool.h" // Persistent workers for batch searches
+#include "roaring_bitmap.h" // Compressed label sets for filters
 
 /*
 This is a C++ implementation of HNSW,
 based on the paper "Efficient and robust approximate nearest neighbor search using Hierarchical Navigable Small World graphs" (Yu. A. Malkov, D. A. Yashunin).
 The implementation is from https://github.com/xinranhe/HNSW
 It has been slightly modified to fix compilation errors and C++ correctness.
+
+Storage layout (all sized for max_elements up front, indexed by internal id):
+- vectors_:      one aligned block, dim floats per node, unless the vectors
+                 are external (see the constructor): then node id's vector
+                 is row labels_[id] of the caller's matrix and nothing is copied
+- level0_links_: one aligned block, (1 + M_max0) ints per node: [count, n1, n2, ...]
+- upper_links_:  only for nodes above layer 0, level * (1 + M) ints each,
+                 same [count, n1, ...] format per layer
+- labels_, levels_: one int each per node
+- deleted_:      one tombstone flag per node (see markDelete())
+
+The hot paths read through the *_view_ pointers. They point into the blocks
+above, or, for an index opened with openMapped(), straight into the mapped
+index file (same layout as saveIndex() writes), which is then read-only.
+External vectors are not part of the index file: the caller saves its matrix
+itself and passes it back to loadIndex() or openMapped().
 */
 
+// --- Binary index file ---
+// A fixed header followed by the storage blocks, each starting on a 64-byte
+// boundary (relative to the start of the header). Offsets are in bytes.
+// Values are written in native byte order; endian_check catches a mismatch.
+struct HNSWFileHeader {
+    char magic[8];             // "HNSWIDX"
+    uint32_t version;
+    uint32_t endian_check;     // HNSW_ENDIAN_CHECK as written by the saving host
+    int32_t dim;
+    int32_t max_elements;
+    int32_t element_count;
+    int32_t M;
+    int32_t M_max0;
+    int32_t ef_construction;
+    int32_t metric;
+    int32_t max_level;
+    int32_t enter_point;
+    int32_t build_options;      // HNSW_BUILD_* bits; 0 (simple selection) in older files
+    uint64_t offset_vectors;       // element_count * dim floats, 0 = external (not in the file)
+    uint64_t offset_level0_links;  // element_count * (1 + M_max0) ints
+    uint64_t offset_labels;        // element_count ints
+    uint64_t offset_levels;        // element_count ints
+    uint64_t offset_upper_offsets; // element_count + 1 uint64, index into upper links (in ints)
+    uint64_t offset_upper_links;   // all upper_links_ lists back to back
+    uint64_t offset_deleted;       // element_count bytes, 1 = tombstone
+    uint64_t total_size;
+};
+
+static const char HNSW_FILE_MAGIC[8] = {'H', 'N', 'S', 'W', 'I', 'D', 'X', '\0'};
+static const uint32_t HNSW_FILE_VERSION = 3; // 2: tombstones, 3: external vectors left out
+static const uint32_t HNSW_FILE_MIN_VERSION = 2;
+static const uint32_t HNSW_ENDIAN_CHECK = 0x01020304;
+
+// Layer-0 beam width used by searchKnn() unless set otherwise
+static const int HNSW_DEFAULT_EF_SEARCH = 50;
+// Highest layer a node is given; a file with more is corrupted
+static const int HNSW_MAX_LEVEL = 16;
+
+// How addPoint picks a new node's neighbors (and how full lists are pruned)
+enum class NeighborSelection {
+    Simple,   // The M nearest candidates
+    Heuristic // Nearest candidates that are not closer to an already kept one
+};
+
+// Restricts which labels a search may return (see searchKnn()). Nodes that
+// are not allowed are still walked through, so the graph stays navigable.
+class LabelFilter {
+public:
+    virtual ~LabelFilter() = default;
+    virtual bool allow(int label) const = 0;
+};
+
+// Allows the labels in a RoaringBitmap, which must outlive the search
+class RoaringLabelFilter : public LabelFilter {
+public:
+    explicit RoaringLabelFilter(const RoaringBitmap& allowed) : allowed_(allowed) {}
+    bool allow(int label) const override {
+        return allowed_.contains((uint32_t)label);
+    }
+
+private:
+    const RoaringBitmap& allowed_;
+};
+
+// HNSWFileHeader::build_options bits
+static const int32_t HNSW_BUILD_HEURISTIC = 1;
+static const int32_t HNSW_BUILD_EXTEND_CANDIDATES = 2;
+static const int32_t HNSW_BUILD_KEEP_PRUNED = 4;
+
 class HNSW {
 public:
     // M, M_max, M_max0, ef_construction, L, ml
-    HNSW(int dim, int max_elements, int M = 16, int M_max0 = 32, int ef_construction = 200) :
-        dim_(dim), max_elements_(max_elements), M_(M), M_max0_(M_max0), ef_construction_(ef_construction) {
+    // With external_vectors, the index keeps no copy of the vectors: the one
+    // of label L is read from external_vectors + L * dim (see
+    // setExternalVectors()).
+    HNSW(int dim, int max_elements, int M = 16, int M_max0 = 32, int ef_construction = 200, Metric metric = Metric::L2,
+         const float* external_vectors = nullptr) :
+        dim_(dim), max_elements_(max_elements), M_(M), M_max0_(M_max0), ef_construction_(ef_construction), ef_search_(HNSW_DEFAULT_EF_SEARCH),
+        neighbor_selection_(NeighborSelection::Heuristic), extend_candidates_(false), keep_pruned_(false), metric_(metric),
+        external_vectors_(external_vectors) {
         
         // ml = 1/log(M)
         ml = 1.0 / log(1.0 * M_); 
         L_ = 0; // Current max layer
-        
-        // Initialize layers. We reserve space.
-        // We use max_elements_ as an estimate.
-        nodes_.reserve(max_elements_);
+        cur_element_count_ = 0;
+        published_count_ = 0;
+
+        // Fixed strides: one count slot followed by the neighbor slots
+        size_links_level0_ = 1 + M_max0_;
+        size_links_upper_ = 1 + M_;
+
+        // Allocate every per-node block once, so memory per node is known up front
+        if (!external_vectors_) {
+            vectors_.resize((size_t)max_elements_ * dim_);
+        }
+        level0_links_.resize((size_t)max_elements_ * size_links_level0_, 0);
+        upper_links_.resize(max_elements_);
+        labels_.resize(max_elements_);
+        levels_.resize(max_elements_);
+        deleted_ = std::make_unique<std::atomic<uint8_t>[]>(std::max(max_elements_, 1));
+        link_locks_ = std::make_unique<std::mutex[]>(std::max(max_elements_, 1));
+        setOwnedViews();
         
         // Initialize the enter point
         enter_point_ = -1;
+        deleted_count_ = 0;
+
+        // One visited list to start with, the pool grows with concurrent searches
+        visited_list_pool_ = std::make_unique<VisitedListPool>(1, max_elements_);
+
+        // Pick the best kernel this CPU supports for the metric
+        dist_func_ = getDistanceFunc(metric_, dim_);
+    }
+
+    Metric getMetric() const {
+        return metric_;
+    }
+
+    int getDim() const {
+        return dim_;
+    }
+
+    int getMaxElements() const {
+        return max_elements_;
+    }
+
+    int getCurrentElementCount() const {
+        return cur_element_count_;
+    }
+
+    // Label and stored vector of a node (internal id in [0, getCurrentElementCount())).
+    // For cosine, the stored vector is the normalized one.
+    int getLabel(int internal_id) const {
+        return labels_view_[internal_id];
+    }
+
+    const float* getDataByInternalId(int internal_id) const {
+        return getData(internal_id);
+    }
+
+    // Bytes every node costs at layer 0 (vector unless external + links +
+    // label + level + tombstone). Nodes above layer 0 add (1 + M) ints per
+    // extra layer.
+    size_t getMemoryPerElement() const {
+        size_t vector_bytes = external_vectors_ ? 0 : dim_ * sizeof(float);
+        return vector_bytes + size_links_level0_ * sizeof(int) + 2 * sizeof(int) + 1 + sizeof(std::vector<int>);
+    }
+
+    // Number of tombstoned nodes (see markDelete())
+    int getDeletedCount() const {
+        return deleted_count_;
+    }
 
-        // Default to L2 distance
-        dist_func_ = L2Sqr;
+    // Share of the nodes that are tombstones, i.e. what compact() would
+    // reclaim. Dead nodes still cost memory and hops on every search.
+    double getDeletedRatio() const {
+        int count = cur_element_count_;
+        return count > 0 ? (double)deleted_count_ / count : 0.0;
     }
 
-    // L2 Distance function
+    bool isMarkedDeleted(int internal_id) const {
+        return isDeleted(internal_id);
+    }
+
+    // L2 Distance function (runtime-dispatched, see distances.h)
     static float L2Sqr(const float *a, const float *b, int dim) {
-        float sum = 0;
-        for (int i = 0; i < dim; ++i) {
-            float diff = a[i] - b[i];
-            sum += diff * diff;
+        return getL2SqrFunc()(a, b, dim);
+    }
+
+    bool isReadOnly() const {
+        return mapping_ != nullptr;
+    }
+
+    bool hasExternalVectors() const {
+        return external_vectors_ != nullptr;
+    }
+
+    // Switches to (or moves) external vectors: from now on the vector of
+    // label L is read from base + L * dim, and any owned copy is freed. The
+    // rows must hold what was added (normalized, for cosine) and stay valid
+    // until the next call. addPoint() and updatePoint() then expect the
+    // caller to have written the label's row already, and copy nothing.
+    // Waits for running searches and inserts, so the caller can free the
+    // old rows once it returns.
+    void setExternalVectors(const float* base) {
+        std::unique_lock<std::shared_mutex> lock(index_lock_);
+        if (mapping_) {
+            throw std::runtime_error("HNSW index is memory-mapped read-only.");
         }
-        return sum;
+        external_vectors_ = base;
+        AlignedVector<float>().swap(vectors_);
+        vectors_view_ = nullptr;
     }
 
+    // Safe to call from many threads at once (see the locking notes below).
+    // Reuses the slot of a deleted node when there is one, preferably the
+    // one that had the same label (with external vectors, that node still
+    // reads the label's row, which now holds the new vector).
     void addPoint(const float* p, int label) {
-        std::unique_lock<std::mutex> lock(mutex_);
+        // Inserts and searches share the index; saveIndex() keeps inserts
+        // out.
+        std::shared_lock<std::shared_mutex> write_lock(write_lock_);
+        std::shared_lock<std::shared_mutex> index_lock(index_lock_);
+
+        if (mapping_) {
+            throw std::runtime_error("HNSW index is memory-mapped read-only.");
+        }
+
+        int reused = -1;
+        {
+            std::unique_lock<std::mutex> lock(deleted_lock_);
+            auto same_label = deleted_labels_.find(label);
+            if (same_label != deleted_labels_.end()) {
+                reused = same_label->second;
+            } else if (!free_slots_.empty()) {
+                reused = *free_slots_.rbegin();
+            }
+            if (reused != -1) {
+                free_slots_.erase(reused);
+                auto old_label = deleted_labels_.find(labels_view_[reused]);
+                if (old_label != deleted_labels_.end() && old_label->second == reused) {
+                    deleted_labels_.erase(old_label);
+                }
+            }
+        }
+        if (reused != -1) {
+            replaceDeleted(reused, p, label);
+            return;
+        }
+
+        // Claim an internal id
+        int id = cur_element_count_.load();
+        do {
+            if (id >= max_elements_) {
+                throw std::runtime_error("HNSW index is full (max_elements = " + std::to_string(max_elements_) + ").");
+            }
+        } while (!cur_element_count_.compare_exchange_weak(id, id + 1));
         
-        int id = nodes_.size();
-        nodes_.push_back(Node(p, label, dim_));
+        // Nothing links to 'id' yet, so its slots can be filled without locks
+        labels_[id] = label;
+        if (!external_vectors_) {
+            float* data = vectors_view_ + (size_t)id * dim_;
+            std::copy(p, p + dim_, data);
+            if (metric_ == Metric::Cosine) {
+                // Normalize at ingest, the stored copy is what we search with
+                normalizeVector(data, dim_);
+            }
+        }
+        // Publish in id order, for the scans of searchKnnBruteForce(). The
+        // inserts that claimed the ids before are as far along as this one.
+        while (published_count_.load(std::memory_order_acquire) != id) {
+            std::this_thread::yield();
+        }
+        published_count_.store(id + 1, std::memory_order_release);
+        p = getData(id);
+        setLabelLookup(label, id);
         
         int l = getRandomLayer();
-        if (l > L_) L_ = l;
+        levels_[id] = l;
+        if (l > 0) {
+            upper_links_[id].assign((size_t)l * size_links_upper_, 0);
+        }
 
+        // Inserts that raise the top layer hold global_ to the end, so two
+        // of them cannot both raise it. Searches don't take global_.
+        std::unique_lock<std::mutex> global_lock(global_);
+        int max_level = L_;
         int ep = enter_point_;
 
         if (ep == -1) {
             enter_point_ = id;
+            L_ = l;
             return;
         }
+        if (l <= max_level) {
+            global_lock.unlock();
+        }
 
-        for (int lc = L_; lc > l; --lc) {
+        for (int lc = max_level; lc > l; --lc) {
             ep = searchLayer(p, ep, 1, lc).top().second;
         }
 
-        for (int lc = std::min(l, L_); lc >= 0; --lc) {
-            int M_max = (lc == 0) ? M_max0_ : M_;
+        for (int lc = std::min(l, max_level); lc >= 0; --lc) {
             std::priority_queue<std::pair<float, int>> W = searchLayer(p, ep, ef_construction_, lc);
-            
-            // This is SELECT-NEIGHBORS-SIMPLE from the paper
-            std::priority_queue<std::pair<float, int>> neighbors;
-            while (neighbors.size() < (unsigned int)M_ && !W.empty()) {
-                neighbors.push(W.top());
+
+            // Nearest first. 'id' itself can show up if a concurrent insert
+            // has already linked to it on this layer.
+            std::vector<std::pair<float, int>> candidates;
+            candidates.reserve(W.size());
+            while (!W.empty()) {
+                if (W.top().second != id) {
+                    candidates.push_back(W.top());
+                }
                 W.pop();
             }
+            std::reverse(candidates.begin(), candidates.end());
+            if (candidates.empty()) {
+                continue;
+            }
+            // The next layer down starts from the nearest node found here
+            ep = candidates.front().second;
 
-            // Add connections
-            int ep_label = ep; // Save ep before it's potentially updated
-            while (!neighbors.empty()) {
-                int neighbor_id = neighbors.top().second;
-                neighbors.pop();
-                
-                nodes_[id].addNeighbor(lc, neighbor_id);
-                nodes_[neighbor_id].addNeighbor(lc, id);
+            std::vector<int> selected = selectNeighbors(p, candidates, M_, lc, id, true);
 
-                // Check for over-connection (pruning)
-                if (nodes_[neighbor_id].friends[lc].size() > (unsigned int)M_max) {
-                    pruneConnections(neighbor_id, lc, M_max);
+            // Our own list first: once a neighbor links back, other
+            // threads can reach 'id' and read it. It may not be empty:
+            // a concurrent insert that found 'id' on a higher layer can
+            // already have linked to it here, so this can prune too.
+            {
+                std::unique_lock<std::mutex> lock(link_locks_[id]);
+                for (int neighbor_id : selected) {
+                    connectNeighbor(id, neighbor_id, lc);
                 }
             }
-            ep = ep_label; // Use the original ep for the next layer down
+
+            // Then the reverse links, one neighbor lock at a time (never
+            // two at once, so inserts cannot deadlock each other)
+            for (int neighbor_id : selected) {
+                std::unique_lock<std::mutex> lock(link_locks_[neighbor_id]);
+                // Appends, or prunes the neighbor back to M_max if it is full
+                connectNeighbor(neighbor_id, id, lc);
+            }
+        }
+
+        // Every layer above the old top now starts (and ends) at this node.
+        // Without this, search would enter upper layers through a node that
+        // has no links there.
+        // The entry point goes first: a search that sees the new L_ then
+        // also sees the new entry point.
+        if (l > max_level) {
+            enter_point_ = id;
+            L_ = l;
         }
     }
 
 
-    std::priority_queue<std::pair<float, int>> searchKnn(const float* q, int k) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        
-        int ep = enter_point_;
-        if (ep == -1) {
-            return std::priority_queue<std::pair<float, int>>();
+    // Tombstone the node with this label: O(1), nothing is unlinked. It is
+    // still traversed (so the graph stays connected) but never returned,
+    // and the next addPoint reuses its slot. Throws if the label is unknown.
+    void markDelete(int label) {
+        std::shared_lock<std::shared_mutex> write_lock(write_lock_);
+        std::shared_lock<std::shared_mutex> index_lock(index_lock_);
+        if (mapping_) {
+            throw std::runtime_error("HNSW index is memory-mapped read-only.");
+        }
+        int id;
+        {
+            std::unique_lock<std::mutex> lock(label_lock_);
+            auto it = label_lookup_.find(label);
+            if (it == label_lookup_.end()) {
+                throw std::runtime_error("Label " + std::to_string(label) + " is not in the HNSW index.");
+            }
+            id = it->second;
+            label_lookup_.erase(it);
         }
+        deleted_[id] = 1;
+        deleted_count_++;
+        std::unique_lock<std::mutex> lock(deleted_lock_);
+        free_slots_.insert(id);
+        deleted_labels_[label] = id;
+    }
 
-        for (int lc = L_; lc >= 1; --lc) {
-            ep = searchLayer(q, ep, 1, lc).top().second;
+    // Replace the vector of the node with this label and repair its links
+    // on every layer it is on (see repairNode()), instead of a rebuild.
+    // With external vectors, p is ignored: the row already holds it.
+    // Throws if the label is unknown.
+    void updatePoint(int label, const float* p) {
+        std::shared_lock<std::shared_mutex> write_lock(write_lock_);
+        std::shared_lock<std::shared_mutex> index_lock(index_lock_);
+        if (mapping_) {
+            throw std::runtime_error("HNSW index is memory-mapped read-only.");
         }
-        
-        // W is a max-heap of (distance, internal_id) for the k-closest items
-        std::priority_queue<std::pair<float, int>> W = searchLayer(q, ep, k, 0);
+        int id;
+        {
+            std::unique_lock<std::mutex> lock(label_lock_);
+            auto it = label_lookup_.find(label);
+            if (it == label_lookup_.end()) {
+                throw std::runtime_error("Label " + std::to_string(label) + " is not in the HNSW index.");
+            }
+            id = it->second;
+        }
+        // Concurrent searches may read the vector mid-copy and rank this
+        // one node with a mixed-up distance; the links they follow stay valid.
+        if (!external_vectors_) {
+            float* data = vectors_view_ + (size_t)id * dim_;
+            std::copy(p, p + dim_, data);
+            if (metric_ == Metric::Cosine) {
+                normalizeVector(data, dim_);
+            }
+        }
+        repairNode(id);
+    }
 
-        // --- THIS IS THE FIX ---
-        // We must convert internal_id to external label.
-        std::priority_queue<std::pair<float, int>> results;
-        while (!W.empty()) {
-            std::pair<float, int> top = W.top(); // (dist, internal_id)
-            W.pop();
-            
-            // Find the external label and push (dist, external_label)
-            results.push(std::make_pair(top.first, nodes_[top.second].label));
+    // Drop all tombstoned nodes. Their live neighbors are re-linked through
+    // them (the dead node's live neighbors become candidates), and the
+    // survivors get dense new internal ids in BFS order over layer 0, so
+    // nodes that are linked sit close together in memory. Capacity shrinks
+    // to half again the live count (never grows), so the adds that follow
+    // don't have to resize right away; labels are unchanged.
+    // Meant to run in the background: searches keep using the old graph
+    // while the new one is built and only wait for the final swap. Inserts,
+    // deletes and updates wait for the whole compaction.
+    void compact() {
+        std::unique_lock<std::shared_mutex> write_lock(write_lock_);
+        std::shared_lock<std::shared_mutex> index_lock(index_lock_);
+        if (mapping_) {
+            throw std::runtime_error("HNSW index is memory-mapped read-only.");
         }
-        // --- END FIX ---
-        
-        return results; // Return the new heap with external labels
+        int count = cur_element_count_;
+        if (deleted_count_ == 0) {
+            return;
+        }
+
+        // New ids: BFS from the entry point, passing through dead nodes but
+        // numbering only live ones. Parts BFS can't reach go at the end.
+        std::vector<int> new_id(count, -1);
+        std::vector<int> order;
+        order.reserve(count - deleted_count_);
+        std::vector<char> seen(count, 0);
+        std::vector<int> queue;
+        auto bfs = [&](int start) {
+            queue.assign(1, start);
+            seen[start] = 1;
+            for (size_t head = 0; head < queue.size(); ++head) {
+                int u = queue[head];
+                if (!isDeleted(u)) {
+                    new_id[u] = (int)order.size();
+                    order.push_back(u);
+                }
+                const int* links = getLinks(u, 0);
+                for (int i = 1; i <= links[0]; ++i) {
+                    if (!seen[links[i]]) {
+                        seen[links[i]] = 1;
+                        queue.push_back(links[i]);
+                    }
+                }
+            }
+        };
+        if (enter_point_ >= 0) {
+            bfs(enter_point_);
+        }
+        for (int u = 0; u < count; ++u) {
+            if (!seen[u]) {
+                bfs(u);
+            }
+        }
+        int live = (int)order.size();
+        int capacity = std::max(std::min(max_elements_, live + live / 2), 1);
+
+        AlignedVector<float> vectors(external_vectors_ ? 0 : (size_t)capacity * dim_);
+        AlignedVector<int> level0_links((size_t)capacity * size_links_level0_, 0);
+        std::vector<std::vector<int>> upper_links(capacity);
+        std::vector<int> labels(capacity);
+        std::vector<int> levels(capacity);
+        std::unordered_map<int, int> label_lookup;
+        label_lookup.reserve(live);
+
+        int new_ep = -1;
+        int new_max_level = 0;
+        std::vector<std::pair<float, int>> candidates;
+        std::vector<int> selected;
+        for (int n = 0; n < live; ++n) {
+            int u = order[n];
+            const float* u_data = getData(u);
+            if (!external_vectors_) {
+                std::copy(u_data, u_data + dim_, vectors.data() + (size_t)n * dim_);
+            }
+            labels[n] = labels_view_[u];
+            levels[n] = levels_view_[u];
+            label_lookup[labels[n]] = n;
+            if (levels[n] > 0) {
+                upper_links[n].assign((size_t)levels[n] * size_links_upper_, 0);
+            }
+            if (new_ep == -1 || levels[n] > new_max_level) {
+                new_ep = n;
+                new_max_level = levels[n];
+            }
+
+            for (int lc = 0; lc <= levels[n]; ++lc) {
+                const int* links = getLinks(u, lc);
+                bool lost_neighbor = false;
+                selected.clear();
+                for (int i = 1; i <= links[0]; ++i) {
+                    if (isDeleted(links[i])) {
+                        lost_neighbor = true;
+                    } else {
+                        selected.push_back(links[i]);
+                    }
+                }
+                if (lost_neighbor) {
+                    // Candidates: the live neighbors plus the live neighbors
+                    // of every dead one, chosen again with the usual rule
+                    std::vector<int> area(selected);
+                    for (int i = 1; i <= links[0]; ++i) {
+                        if (isDeleted(links[i])) {
+                            const int* dead_links = getLinks(links[i], lc);
+                            for (int j = 1; j <= dead_links[0]; ++j) {
+                                if (dead_links[j] != u && !isDeleted(dead_links[j])) {
+                                    area.push_back(dead_links[j]);
+                                }
+                            }
+                        }
+                    }
+                    std::sort(area.begin(), area.end());
+                    area.erase(std::unique(area.begin(), area.end()), area.end());
+                    candidates.clear();
+                    for (int a : area) {
+                        candidates.push_back(std::make_pair(dist_func_(u_data, getData(a), dim_), a));
+                    }
+                    std::sort(candidates.begin(), candidates.end());
+                    selected = selectNeighbors(u_data, candidates, (lc == 0) ? M_max0_ : M_, lc, u, false);
+                }
+
+                int* out = (lc == 0) ? level0_links.data() + (size_t)n * size_links_level0_
+                                     : upper_links[n].data() + (size_t)(lc - 1) * size_links_upper_;
+                out[0] = 0;
+                for (int neighbor_id : selected) {
+                    out[1 + out[0]] = new_id[neighbor_id];
+                    out[0]++;
+                }
+            }
+        }
+        // Keep the old entry point if it survived, it already routes well
+        if (enter_point_ >= 0 && !isDeleted(enter_point_)) {
+            new_ep = new_id[enter_point_];
+            new_max_level = levels_view_[enter_point_];
+        }
+
+        // Swap it in. Searches are held up only for these moves.
+        index_lock.unlock();
+        std::unique_lock<std::shared_mutex> exclusive(index_lock_);
+        vectors_.swap(vectors);
+        level0_links_.swap(level0_links);
+        upper_links_.swap(upper_links);
+        labels_.swap(labels);
+        levels_.swap(levels);
+        label_lookup_.swap(label_lookup);
+        deleted_ = std::make_unique<std::atomic<uint8_t>[]>(capacity);
+        link_locks_ = std::make_unique<std::mutex[]>(capacity);
+        free_slots_.clear();
+        deleted_labels_.clear();
+        max_elements_ = capacity;
+        cur_element_count_ = live;
+        published_count_ = live;
+        deleted_count_ = 0;
+        enter_point_ = new_ep;
+        L_ = (new_ep == -1) ? 0 : new_max_level;
+        setOwnedViews();
+    }
+
+    // Change the capacity (it can grow, or shrink down to the current
+    // count). Takes the index to itself, so running searches and inserts
+    // finish first and the next ones see the new storage.
+    void resizeIndex(int new_max_elements) {
+        std::unique_lock<std::shared_mutex> lock(index_lock_);
+        if (mapping_) {
+            throw std::runtime_error("HNSW index is memory-mapped read-only.");
+        }
+        if (new_max_elements < cur_element_count_) {
+            throw std::runtime_error("Cannot resize HNSW index below its element count.");
+        }
+
+        if (!external_vectors_) {
+            vectors_.resize((size_t)new_max_elements * dim_);
+        }
+        level0_links_.resize((size_t)new_max_elements * size_links_level0_, 0);
+        upper_links_.resize(new_max_elements);
+        labels_.resize(new_max_elements);
+        levels_.resize(new_max_elements);
+        auto deleted = std::make_unique<std::atomic<uint8_t>[]>(std::max(new_max_elements, 1));
+        for (int i = 0; i < cur_element_count_; ++i) {
+            deleted[i] = deleted_[i].load();
+        }
+        deleted_ = std::move(deleted);
+        // No one holds a node lock while we have the index exclusively
+        link_locks_ = std::make_unique<std::mutex[]>(std::max(new_max_elements, 1));
+        max_elements_ = new_max_elements;
+        setOwnedViews();
+        // Visited lists grow on their next use (see getFreeVisitedList)
+    }
+
+    // Bulk insert: point i is data + i * dim with label labels[i].
+    // Runs on num_threads threads (0 = one per core).
+    void addPoints(const float* data, const int* labels, size_t n, int num_threads = 0) {
+        parallelFor(0, n, num_threads, [&](size_t i, int) {
+            addPoint(data + i * dim_, labels[i]);
+        });
+    }
+
+
+    // Neighbor selection for the inserts that follow. The heuristic (the
+    // default) gives a better connected graph, so the same recall needs a
+    // smaller ef_search. extend_candidates also considers the candidates'
+    // neighbors (helps on very clustered data, slower build); keep_pruned
+    // fills free slots with candidates the heuristic rejected.
+    void setNeighborSelection(NeighborSelection selection, bool extend_candidates = false, bool keep_pruned = false) {
+        neighbor_selection_ = selection;
+        extend_candidates_ = extend_candidates;
+        keep_pruned_ = keep_pruned;
+    }
+
+    NeighborSelection getNeighborSelection() const {
+        return neighbor_selection_;
+    }
+
+    // Beam width of the layer-0 search when searchKnn() is not given one.
+    // Larger is slower but finds more of the true nearest neighbors.
+    void setEfSearch(int ef_search) {
+        if (ef_search < 1) {
+            throw std::invalid_argument("ef_search must be at least 1.");
+        }
+        ef_search_ = ef_search;
+    }
+
+    int getEfSearch() const {
+        return ef_search_;
+    }
+
+    // Returns up to k (distance, label) pairs. ef_search overrides the
+    // index default for this query (0 = use the default); the beam is
+    // never narrower than k. With a filter, only allowed labels are
+    // returned; a very selective filter makes the search walk much of the
+    // graph, searchKnnBruteForce() is cheaper then.
+    // Safe to call from many threads, also while inserts are running: it
+    // reads links through the per-node locks and never takes global_.
+    std::priority_queue<std::pair<float, int>> searchKnn(const float* q, int k, int ef_search = 0, const LabelFilter* filter = nullptr) {
+        SearchScratch scratch;
+        searchKnn(q, k, ef_search, filter, scratch);
+        visited_list_pool_->releaseVisitedList(std::move(scratch.visited));
+        return std::priority_queue<std::pair<float, int>>(std::less<std::pair<float, int>>(), std::move(scratch.results));
+    }
+
+    // searchKnn() for the nq queries in the rows of 'queries', on at most
+    // max_threads of the pool's workers (0 = all of them). Row q of
+    // 'distances' and of 'labels' (k entries each) gets the results of
+    // query q, nearest first, padded with label -1 and distance +infinity if
+    // there are fewer than k.
+    // The index keeps a visited list and the heaps' storage for each worker
+    // of the pool and reuses them from one query and one batch to the next,
+    // so a query costs no pool round trip and, once the buffers have grown,
+    // no allocation. Safe to call from many threads, as long as the batches
+    // that run at the same time share one pool.
+    void searchKnnBatch(ThreadPool& pool, const float* queries, size_t nq, int k, float* distances, int* labels,
+                        int ef_search = 0, int max_threads = 0) {
+        if (k <= 0 || nq == 0) {
+            return;
+        }
+        std::vector<SearchScratch*> scratch = workerScratch(pool.size());
+        pool.parallelFor(0, nq, max_threads, [&](size_t i, int worker) {
+            std::vector<std::pair<float, int>>& results = scratch[worker]->results;
+            searchKnn(queries + i * dim_, k, ef_search, nullptr, *scratch[worker]);
+            std::sort_heap(results.begin(), results.end());
+            float* row_distances = distances + i * k;
+            int* row_labels = labels + i * k;
+            for (size_t j = 0; j < (size_t)k; ++j) {
+                bool found = j < results.size();
+                row_distances[j] = found ? results[j].first : std::numeric_limits<float>::infinity();
+                row_labels[j] = found ? results[j].second : -1;
+            }
+        });
+    }
+
+    // Exact top k by scanning every node (the filter is checked before the
+    // distance, so the cost is mostly one distance per allowed node).
+    // Safe alongside inserts, like searchKnn(): it skips nodes still being
+    // written.
+    std::priority_queue<std::pair<float, int>> searchKnnBruteForce(const float* q, int k, const LabelFilter* filter = nullptr) {
+        std::shared_lock<std::shared_mutex> lock(index_lock_);
+
+        std::vector<float> normalized_query;
+        if (metric_ == Metric::Cosine) {
+            normalized_query.assign(q, q + dim_);
+            normalizeVector(normalized_query.data(), dim_);
+            q = normalized_query.data();
+        }
+
+        std::priority_queue<std::pair<float, int>> W;
+        // Not cur_element_count_: an insert claims its id before it writes
+        // the node's label and vector
+        int count = published_count_.load(std::memory_order_acquire);
+        bool has_deleted = deleted_count_ > 0;
+        for (int id = 0; id < count; ++id) {
+            if ((has_deleted && isDeleted(id)) || (filter && !filter->allow(labels_view_[id]))) {
+                continue;
+            }
+            float d = dist_func_(q, getData(id), dim_);
+            if ((int)W.size() < k || d < W.top().first) {
+                W.push(std::make_pair(d, id));
+                if ((int)W.size() > k) {
+                    W.pop();
+                }
+            }
+        }
+        return toLabels(W);
+    }
+
+    // --- Persistence ---
+
+
+    // Bytes saveIndex() writes
+    size_t savedSize() {
+        std::shared_lock<std::shared_mutex> lock(index_lock_);
+        std::vector<uint64_t> upper_offsets;
+        return fileHeader(upper_offsets).total_size;
+    }
+
+    // Write the whole graph (params, vectors, links, labels) to a stream.
+    // External vectors are left out (offset_vectors is 0); whoever loads
+    // the file passes them in again. Inserts, deletes and updates wait;
+    // searches go on.
+    void saveIndex(std::ostream& out) {
+        std::unique_lock<std::shared_mutex> write_lock(write_lock_);
+        std::shared_lock<std::shared_mutex> index_lock(index_lock_);
+
+        size_t count = cur_element_count_;
+        std::vector<uint64_t> upper_offsets;
+        HNSWFileHeader header = fileHeader(upper_offsets);
+
+        std::vector<uint8_t> deleted(count);
+        for (size_t i = 0; i < count; ++i) {
+            deleted[i] = isDeleted(i) ? 1 : 0;
+        }
+
+        uint64_t pos = 0;
+        writeBlock(out, pos, 0, &header, sizeof(header));
+        if (!external_vectors_) {
+            writeBlock(out, pos, header.offset_vectors, vectors_view_, count * dim_ * sizeof(float));
+        }
+        writeBlock(out, pos, header.offset_level0_links, level0_view_, count * size_links_level0_ * sizeof(int));
+        writeBlock(out, pos, header.offset_labels, labels_view_, count * sizeof(int));
+        writeBlock(out, pos, header.offset_levels, levels_view_, count * sizeof(int));
+        writeBlock(out, pos, header.offset_upper_offsets, upper_offsets.data(), upper_offsets.size() * sizeof(uint64_t));
+        for (size_t i = 0; i < count; ++i) {
+            if (levels_view_[i] > 0) {
+                size_t size = upper_offsets[i + 1] - upper_offsets[i];
+                writeBlock(out, pos, header.offset_upper_links + upper_offsets[i] * sizeof(int), getLinks(i, 1), size * sizeof(int));
+            }
+        }
+        writeBlock(out, pos, header.offset_deleted, deleted.data(), count);
+        if (!out) {
+            throw std::runtime_error("Failed to write HNSW index.");
+        }
+    }
+
+    // Read a graph written by saveIndex(). The stream must be positioned at
+    // the header. Throws std::runtime_error if the data is not a valid index:
+    // the header, the entry point, every level, link count and neighbor are
+    // checked, so a search never leaves the graph. Labels are only checked
+    // to be non-negative; with external vectors, the caller makes sure it
+    // has a row for each (see getLabel()).
+    // With external_vectors, the vectors in the file are skipped and read
+    // from the caller's matrix instead (see setExternalVectors()). A file
+    // saved with external vectors needs them.
+    static std::unique_ptr<HNSW> loadIndex(std::istream& in, const float* external_vectors = nullptr) {
+        HNSWFileHeader header;
+        uint64_t pos = 0;
+        readBlock(in, pos, 0, &header, sizeof(header));
+        checkHeader(header);
+        if (header.offset_vectors == 0 && !external_vectors) {
+            throw std::runtime_error("HNSW index was saved without its vectors.");
+        }
+
+        size_t count = header.element_count;
+        int capacity = std::max(std::max(header.max_elements, header.element_count), 1);
+        auto index = std::make_unique<HNSW>(header.dim, capacity, header.M, header.M_max0, header.ef_construction, (Metric)header.metric,
+                                            external_vectors);
+
+        if (!external_vectors) {
+            readBlock(in, pos, header.offset_vectors, index->vectors_.data(), count * header.dim * sizeof(float));
+        }
+        readBlock(in, pos, header.offset_level0_links, index->level0_links_.data(), count * index->size_links_level0_ * sizeof(int));
+        readBlock(in, pos, header.offset_labels, index->labels_.data(), count * sizeof(int));
+        readBlock(in, pos, header.offset_levels, index->levels_.data(), count * sizeof(int));
+        index->cur_element_count_ = header.element_count;
+        index->published_count_ = header.element_count;
+        index->L_ = header.max_level;
+        index->enter_point_ = header.enter_point;
+        index->checkLevels();
+        std::vector<uint64_t> upper_offsets(count + 1);
+        readBlock(in, pos, header.offset_upper_offsets, upper_offsets.data(), upper_offsets.size() * sizeof(uint64_t));
+        for (size_t i = 0; i < count; ++i) {
+            size_t size = upper_offsets[i + 1] - upper_offsets[i];
+            if (size != (size_t)index->levels_[i] * index->size_links_upper_) {
+                throw std::runtime_error("HNSW index is corrupted (bad upper layer links).");
+            }
+            if (size > 0) {
+                index->upper_links_[i].resize(size);
+                readBlock(in, pos, header.offset_upper_links + upper_offsets[i] * sizeof(int), index->upper_links_[i].data(), size * sizeof(int));
+            }
+        }
+        index->checkLinks();
+        std::vector<uint8_t> deleted(count);
+        readBlock(in, pos, header.offset_deleted, deleted.data(), count);
+        for (size_t i = 0; i < count; ++i) {
+            if (deleted[i]) {
+                index->deleted_[i] = 1;
+                index->deleted_count_++;
+                index->free_slots_.insert(i);
+                index->deleted_labels_[index->labels_[i]] = i;
+            } else {
+                index->label_lookup_[index->labels_[i]] = i;
+            }
+        }
+
+        index->setBuildOptions(header.build_options);
+        return index;
+    }
+
+    // Open a graph written by saveIndex() in place, 'offset' bytes into a
+    // mapped file. Nothing is copied: searches read the mapped pages
+    // directly, and the index is read-only (addPoint throws). As with
+    // loadIndex(), external_vectors (e.g. mapped as well) replace the
+    // vectors in the file, and are required if it has none.
+    // Checks the entry point, levels, labels and upper-layer offsets on
+    // open, but not the links: that would read every page of the graph.
+    static std::unique_ptr<HNSW> openMapped(std::shared_ptr<MappedFile> file, size_t offset,
+                                            const float* external_vectors = nullptr) {
+        if (offset + sizeof(HNSWFileHeader) > file->size() || offset % 64 != 0) {
+            throw std::runtime_error("HNSW index is truncated.");
+        }
+        const char* base = file->data() + offset;
+        HNSWFileHeader header;
+        std::memcpy(&header, base, sizeof(header));
+        checkHeader(header);
+        if (offset + header.total_size > file->size()) {
+            throw std::runtime_error("HNSW index is truncated.");
+        }
+        uint64_t count = header.element_count;
+        if (header.offset_vectors == 0 && !external_vectors) {
+            throw std::runtime_error("HNSW index was saved without its vectors.");
+        }
+        uint64_t vectors_end = header.offset_vectors ? header.offset_vectors + count * header.dim * sizeof(float)
+                                                     : sizeof(HNSWFileHeader);
+        if (header.offset_level0_links < vectors_end ||
+            header.offset_labels < header.offset_level0_links + count * (1 + header.M_max0) * sizeof(int) ||
+            header.offset_levels < header.offset_labels + count * sizeof(int) ||
+            header.offset_upper_offsets < header.offset_levels + count * sizeof(int) ||
+            header.offset_upper_links < header.offset_upper_offsets + (count + 1) * sizeof(uint64_t) ||
+            header.offset_deleted < header.offset_upper_links ||
+            header.total_size < header.offset_deleted + count) {
+            throw std::runtime_error("HNSW index header is corrupted.");
+        }
+
+        // Capacity 0: no owned blocks, everything points into the mapping
+        auto index = std::make_unique<HNSW>(header.dim, 0, header.M, header.M_max0, header.ef_construction, (Metric)header.metric,
+                                            external_vectors);
+        char* data = const_cast<char*>(base); // PROT_READ mapping, never written
+        index->mapping_ = file;
+        index->vectors_view_ = external_vectors ? nullptr : reinterpret_cast<float*>(data + header.offset_vectors);
+        index->level0_view_ = reinterpret_cast<int*>(data + header.offset_level0_links);
+        index->labels_view_ = reinterpret_cast<int*>(data + header.offset_labels);
+        index->levels_view_ = reinterpret_cast<int*>(data + header.offset_levels);
+        index->upper_offsets_view_ = reinterpret_cast<const uint64_t*>(data + header.offset_upper_offsets);
+        index->upper_links_view_ = reinterpret_cast<int*>(data + header.offset_upper_links);
+        index->deleted_view_ = reinterpret_cast<const uint8_t*>(data + header.offset_deleted);
+        for (uint64_t i = 0; i < count; ++i) {
+            index->deleted_count_ += index->deleted_view_[i] ? 1 : 0;
+        }
+        index->max_elements_ = header.element_count;
+        index->cur_element_count_ = header.element_count;
+        index->published_count_ = header.element_count;
+        index->L_ = header.max_level;
+        index->enter_point_ = header.enter_point;
+        index->checkLevels();
+        const uint64_t* upper_offsets = index->upper_offsets_view_;
+        for (uint64_t i = 0; i < count; ++i) {
+            if (upper_offsets[i + 1] < upper_offsets[i] ||
+                upper_offsets[i + 1] - upper_offsets[i] != (uint64_t)index->levels_view_[i] * index->size_links_upper_) {
+                throw std::runtime_error("HNSW index is corrupted (bad upper layer links).");
+            }
+        }
+        if (upper_offsets[0] != 0 ||
+            header.offset_upper_links + upper_offsets[count] * sizeof(int) > header.offset_deleted) {
+            throw std::runtime_error("HNSW index is corrupted (bad upper layer links).");
+        }
+        index->setBuildOptions(header.build_options);
+        return index;
     }
 
 
 private:
     int dim_;
     int max_elements_;
+    std::atomic<int> cur_element_count_;
+    std::atomic<int> published_count_; // Nodes whose label and vector are written, see addPoint()
     int M_;
     int M_max0_;
     int ef_construction_;
+    std::atomic<int> ef_search_;
+    NeighborSelection neighbor_selection_;
+    bool extend_candidates_;
+    bool keep_pruned_;
+    Metric metric_;
     double ml;
-    int L_; // Max layer
-    int enter_point_;
+    std::atomic<int> L_; // Max layer
+    std::atomic<int> enter_point_;
+    std::atomic<int> deleted_count_;
 
-    std::mutex mutex_;
+    // --- Locking ---
+    // index_lock_: shared by inserts and searches, exclusive for moving
+    //              the storage (resizeIndex, setExternalVectors, compact).
+    // link_locks_: one per node, guards that node's link lists (all layers).
+    // global_:     serializes inserts that raise enter_point_/L_.
+    // level_mutex_: guards the level generator.
+    // label_lock_: guards label_lookup_.
+    // deleted_lock_: guards free_slots_ and deleted_labels_.
+    // write_lock_: shared by inserts/deletes/updates, exclusive for compact()
+    //              and saveIndex().
+    std::shared_mutex write_lock_;
+    std::shared_mutex index_lock_;
+    std::unique_ptr<std::mutex[]> link_locks_;
+    std::mutex global_;
+    std::mutex level_mutex_;
+    std::mutex label_lock_;
+    std::mutex deleted_lock_;
     std::default_random_engine generator_;
+    std::unique_ptr<VisitedListPool> visited_list_pool_;
+
+    // What a search works in: a visited list (taken from the pool on first
+    // use, the owner gives it back), the storage of the heaps and the
+    // buffer for a node's links. Reused across the queries of one worker
+    // by searchKnnBatch().
+    struct SearchScratch {
+        std::unique_ptr<VisitedList> visited;
+        std::vector<std::pair<float, int>> candidates; // Min-heap C of searchLayer()
+        std::vector<std::pair<float, int>> results;    // Max-heap W of searchLayer()
+        std::vector<int> neighbors;
+        std::vector<float> query;                      // Normalized copy of a cosine query
+    };
+    // searchKnnBatch()'s scratch of worker w of its pool, at w. A deque, so
+    // growing it for a larger pool leaves the scratch in use where it is.
+    std::deque<SearchScratch> worker_scratch_;
+    std::mutex worker_scratch_lock_;
+
+    // The scratch of workers 0 to n-1, made on first use
+    std::vector<SearchScratch*> workerScratch(int n) {
+        std::unique_lock<std::mutex> lock(worker_scratch_lock_);
+        while ((int)worker_scratch_.size() < n) {
+            worker_scratch_.emplace_back();
+        }
+        std::vector<SearchScratch*> scratch(n);
+        for (int w = 0; w < n; ++w) {
+            scratch[w] = &worker_scratch_[w];
+        }
+        return scratch;
+    }
 
     // Distance function pointer
-    float (*dist_func_)(const float*, const float*, int);
+    DistanceFunc dist_func_;
+
+    // --- Flat node storage (see the layout note at the top of the file) ---
+    size_t size_links_level0_; // ints per node in level0_links_
+    size_t size_links_upper_;  // ints per layer in upper_links_[id]
+    AlignedVector<float> vectors_;
+    AlignedVector<int> level0_links_;
+    std::vector<std::vector<int>> upper_links_;
+    std::vector<int> labels_;
+    std::vector<int> levels_;
+    // Tombstones. Searches read them while markDelete() writes them, hence
+    // atomic. Not a view: a mapped index reads deleted_view_ instead.
+    std::unique_ptr<std::atomic<uint8_t>[]> deleted_;
+    std::set<int> free_slots_;                    // Tombstoned ids addPoint may reuse
+    std::unordered_map<int, int> deleted_labels_; // Their labels -> id, to reuse a label's own node
+    std::unordered_map<int, int> label_lookup_;   // Live label -> internal id (not kept when mapped)
 
-    struct Node {
-        std::vector<float> data;
-        int label;
-        std::vector<std::vector<int>> friends; // friends[layer][neighbor_id]
+    // What the rest of the class reads and writes through
+    float* vectors_view_;
+    int* level0_view_;
+    int* labels_view_;
+    int* levels_view_;
+    // Mapped mode only: upper links are one block plus an offset table
+    const uint64_t* upper_offsets_view_;
+    int* upper_links_view_;
+    const uint8_t* deleted_view_;
+    std::shared_ptr<MappedFile> mapping_; // Set when opened with openMapped()
+    const float* external_vectors_;       // Caller's matrix, row = label (see setExternalVectors())
 
-        Node(const float* p, int label, int dim) : label(label) {
-            data.resize(dim);
-            std::copy(p, p + dim, data.begin());
+    void setOwnedViews() {
+        vectors_view_ = vectors_.data();
+        level0_view_ = level0_links_.data();
+        labels_view_ = labels_.data();
+        levels_view_ = levels_.data();
+        upper_offsets_view_ = nullptr;
+        upper_links_view_ = nullptr;
+        deleted_view_ = nullptr;
+    }
+
+    // (dist, internal_id) heap -> (dist, label) heap
+    std::priority_queue<std::pair<float, int>> toLabels(std::priority_queue<std::pair<float, int>>& W) const {
+        std::priority_queue<std::pair<float, int>> results;
+        while (!W.empty()) {
+            results.push(std::make_pair(W.top().first, labels_view_[W.top().second]));
+            W.pop();
         }
+        return results;
+    }
 
-        void addNeighbor(int layer, int neighbor_id) {
-            if (layer >= (int)friends.size()) {
-                friends.resize(layer + 1);
-            }
-            friends[layer].push_back(neighbor_id);
+    bool isDeleted(int node_id) const {
+        if (mapping_) {
+            return deleted_view_[node_id] != 0;
         }
-    };
+        return deleted_[node_id].load(std::memory_order_relaxed) != 0;
+    }
+
+    void setLabelLookup(int label, int node_id) {
+        std::unique_lock<std::mutex> lock(label_lock_);
+        label_lookup_[label] = node_id;
+    }
 
-    std::vector<Node> nodes_; // All nodes
+    const float* getData(int node_id) const {
+        if (external_vectors_) {
+            return external_vectors_ + (size_t)labels_view_[node_id] * dim_;
+        }
+        return vectors_view_ + (size_t)node_id * dim_;
+    }
+
+    // [count, n1, n2, ...] for a node on a layer it is part of
+    int* getLinks(int node_id, int layer) {
+        if (layer == 0) {
+            return level0_view_ + (size_t)node_id * size_links_level0_;
+        }
+        if (mapping_) {
+            return upper_links_view_ + upper_offsets_view_[node_id] + (size_t)(layer - 1) * size_links_upper_;
+        }
+        return upper_links_[node_id].data() + (size_t)(layer - 1) * size_links_upper_;
+    }
+
+    // Copy a node's neighbors on a layer. Writable indexes take the node's
+    // lock so a concurrent insert never hands us a half-written list.
+    void copyLinks(int node_id, int layer, std::vector<int>& out) {
+        std::unique_lock<std::mutex> lock;
+        if (!mapping_) {
+            lock = std::unique_lock<std::mutex>(link_locks_[node_id]);
+        }
+        const int* links = getLinks(node_id, layer);
+        out.assign(links + 1, links + 1 + links[0]);
+    }
 
     float dist(const float* q, int node_id, int layer) {
-        return dist_func_(q, nodes_[node_id].data.data(), dim_);
+        return dist_func_(q, getData(node_id), dim_);
+    }
+
+    // After reading a file: throws std::runtime_error unless the entry
+    // point is a node on the top layer (or absent, for an empty graph) and
+    // every node has a level up to that layer and a non-negative label
+    void checkLevels() const {
+        int count = cur_element_count_;
+        int ep = enter_point_;
+        if (L_ < 0 || L_ > HNSW_MAX_LEVEL ||
+            (count == 0 ? ep != -1 : (ep < 0 || ep >= count || levels_view_[ep] != L_))) {
+            throw std::runtime_error("HNSW index is corrupted (bad entry point).");
+        }
+        for (int i = 0; i < count; ++i) {
+            if (levels_view_[i] < 0 || levels_view_[i] > L_) {
+                throw std::runtime_error("HNSW index is corrupted (bad level).");
+            }
+            if (labels_view_[i] < 0) {
+                throw std::runtime_error("HNSW index is corrupted (bad label).");
+            }
+        }
+    }
+
+    // After checkLevels(): throws std::runtime_error unless every link list
+    // holds at most M_max0 (layer 0) or M neighbors, all of them nodes
+    void checkLinks() {
+        int count = cur_element_count_;
+        for (int i = 0; i < count; ++i) {
+            for (int lc = 0; lc <= levels_view_[i]; ++lc) {
+                const int* links = getLinks(i, lc);
+                if (links[0] < 0 || links[0] > (lc == 0 ? M_max0_ : M_)) {
+                    throw std::runtime_error("HNSW index is corrupted (bad link count).");
+                }
+                for (int j = 1; j <= links[0]; ++j) {
+                    if (links[j] < 0 || links[j] >= count) {
+                        throw std::runtime_error("HNSW index is corrupted (bad neighbor).");
+                    }
+                }
+            }
+        }
+    }
+
+    static void checkHeader(const HNSWFileHeader& header) {
+        if (std::memcmp(header.magic, HNSW_FILE_MAGIC, sizeof(header.magic)) != 0) {
+            throw std::runtime_error("Not an HNSW index file.");
+        }
+        if (header.version < HNSW_FILE_MIN_VERSION || header.version > HNSW_FILE_VERSION) {
+            throw std::runtime_error("Unsupported HNSW index version " + std::to_string(header.version) + ".");
+        }
+        if (header.endian_check != HNSW_ENDIAN_CHECK) {
+            throw std::runtime_error("HNSW index was written on a machine with a different byte order.");
+        }
+        if (header.dim <= 0 || header.element_count < 0 || header.M <= 1 || header.M_max0 <= 0) {
+            throw std::runtime_error("HNSW index header is corrupted.");
+        }
+    }
+
+    // Header of the file saveIndex() writes; fills upper_offsets with the
+    // start of each node's upper-layer links. Needs index_lock_.
+    HNSWFileHeader fileHeader(std::vector<uint64_t>& upper_offsets) const {
+        size_t count = cur_element_count_;
+        upper_offsets.assign(count + 1, 0);
+        for (size_t i = 0; i < count; ++i) {
+            upper_offsets[i + 1] = upper_offsets[i] + (size_t)levels_view_[i] * size_links_upper_;
+        }
+
+        HNSWFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, HNSW_FILE_MAGIC, sizeof(header.magic));
+        header.version = HNSW_FILE_VERSION;
+        header.endian_check = HNSW_ENDIAN_CHECK;
+        header.dim = dim_;
+        header.max_elements = max_elements_;
+        header.element_count = cur_element_count_;
+        header.M = M_;
+        header.M_max0 = M_max0_;
+        header.ef_construction = ef_construction_;
+        header.metric = (int32_t)metric_;
+        header.max_level = L_;
+        header.enter_point = enter_point_;
+        header.build_options = buildOptions();
+        if (external_vectors_) {
+            header.offset_vectors = 0;
+            header.offset_level0_links = alignOffset(sizeof(HNSWFileHeader));
+        } else {
+            header.offset_vectors = alignOffset(sizeof(HNSWFileHeader));
+            header.offset_level0_links = alignOffset(header.offset_vectors + count * dim_ * sizeof(float));
+        }
+        header.offset_labels = alignOffset(header.offset_level0_links + count * size_links_level0_ * sizeof(int));
+        header.offset_levels = alignOffset(header.offset_labels + count * sizeof(int));
+        header.offset_upper_offsets = alignOffset(header.offset_levels + count * sizeof(int));
+        header.offset_upper_links = alignOffset(header.offset_upper_offsets + (count + 1) * sizeof(uint64_t));
+        header.offset_deleted = alignOffset(header.offset_upper_links + upper_offsets[count] * sizeof(int));
+        header.total_size = header.offset_deleted + count;
+        return header;
+    }
+
+    int32_t buildOptions() const {
+        int32_t options = 0;
+        if (neighbor_selection_ == NeighborSelection::Heuristic) options |= HNSW_BUILD_HEURISTIC;
+        if (extend_candidates_) options |= HNSW_BUILD_EXTEND_CANDIDATES;
+        if (keep_pruned_) options |= HNSW_BUILD_KEEP_PRUNED;
+        return options;
+    }
+
+    void setBuildOptions(int32_t options) {
+        setNeighborSelection((options & HNSW_BUILD_HEURISTIC) ? NeighborSelection::Heuristic : NeighborSelection::Simple,
+                             (options & HNSW_BUILD_EXTEND_CANDIDATES) != 0, (options & HNSW_BUILD_KEEP_PRUNED) != 0);
+    }
+
+    static uint64_t alignOffset(uint64_t offset) {
+        return (offset + 63) & ~(uint64_t)63;
+    }
+
+    // Write 'size' bytes at 'offset', zero-padding from the current position 'pos'
+    static void writeBlock(std::ostream& out, uint64_t& pos, uint64_t offset, const void* data, size_t size) {
+        static const char zeros[64] = {0};
+        while (pos < offset) {
+            size_t n = std::min<uint64_t>(sizeof(zeros), offset - pos);
+            out.write(zeros, n);
+            pos += n;
+        }
+        out.write(static_cast<const char*>(data), size);
+        pos += size;
+    }
+
+    // Read 'size' bytes at 'offset', skipping forward from the current position 'pos'
+    static void readBlock(std::istream& in, uint64_t& pos, uint64_t offset, void* data, size_t size) {
+        if (offset < pos) {
+            throw std::runtime_error("HNSW index is corrupted (overlapping blocks).");
+        }
+        in.ignore(offset - pos);
+        in.read(static_cast<char*>(data), size);
+        if (!in || (size_t)in.gcount() != size) {
+            throw std::runtime_error("HNSW index is truncated.");
+        }
+        pos = offset + size;
     }
 
     int getRandomLayer() {
+        std::unique_lock<std::mutex> lock(level_mutex_);
         std::uniform_real_distribution<double> distribution(0.0, 1.0);
         int l = 0;
-        while (distribution(generator_) < ml && l < 16) { // Cap at 16 layers
+        while (distribution(generator_) < ml && l < HNSW_MAX_LEVEL) {
             l++;
         }
         return l;
     }
 
-    void pruneConnections(int node_id, int layer, int M_max) {
-        // --- THIS IS THE FIX ---
-        // We must use a min-heap (std::greater) to find the *closest* neighbors to keep.
-        // The old code used a max-heap, which kept the *farthest* neighbors.
-        std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, std::greater<std::pair<float, int>>> connections;
-        // --- END FIX ---
-        
-        for (int neighbor_id : nodes_[node_id].friends[layer]) {
+    // Link node_id -> new_id on a layer. The slots are fixed, so when the
+    // list is already full we prune it instead of growing it.
+    void connectNeighbor(int node_id, int new_id, int layer) {
+        int M_max = (layer == 0) ? M_max0_ : M_;
+        int* links = getLinks(node_id, layer);
+        // Already there when both nodes were inserted at the same time
+        for (int i = 1; i <= links[0]; ++i) {
+            if (links[i] == new_id) {
+                return;
+            }
+        }
+        if (links[0] < M_max) {
+            links[1 + links[0]] = new_id;
+            links[0]++;
+            return;
+        }
+        pruneConnections(node_id, layer, M_max, new_id);
+    }
+
+    // Re-select node_id's neighbors from its current ones plus new_id,
+    // with the same rule addPoint uses (the caller holds node_id's lock)
+    void pruneConnections(int node_id, int layer, int M_max, int new_id) {
+        int* links = getLinks(node_id, layer);
+        const float* node_data = getData(node_id);
+
+        std::vector<std::pair<float, int>> candidates;
+        candidates.reserve(links[0] + 1);
+        for (int i = 1; i <= links[0]; ++i) {
             // Use dist_func_ directly for node-to-node distance
-            connections.push(std::make_pair(dist_func_(nodes_[node_id].data.data(), nodes_[neighbor_id].data.data(), dim_), neighbor_id));
+            candidates.push_back(std::make_pair(dist_func_(node_data, getData(links[i]), dim_), links[i]));
+        }
+        candidates.push_back(std::make_pair(dist_func_(node_data, getData(new_id), dim_), new_id));
+        std::sort(candidates.begin(), candidates.end());
+
+        // No extending here: that would read other nodes' links while we
+        // hold this node's lock
+        std::vector<int> selected = selectNeighbors(node_data, candidates, M_max, layer, node_id, false);
+        links[0] = 0;
+        for (int neighbor_id : selected) {
+            links[1 + links[0]] = neighbor_id;
+            links[0]++;
+        }
+    }
+
+    // SELECT-NEIGHBORS from the paper. candidates are (distance to q, id),
+    // nearest first; returns at most M ids.
+    // Simple: the M nearest.
+    // Heuristic: a candidate is kept only if it is closer to q than to every
+    // neighbor kept so far, so the links spread out in different directions
+    // instead of all pointing into one cluster. With extend_candidates_ the
+    // candidates' own neighbors are considered too (only when allow_extend),
+    // and with keep_pruned_ rejected candidates fill any remaining slots.
+    std::vector<int> selectNeighbors(const float* q, std::vector<std::pair<float, int>>& candidates, int M, int layer, int self_id, bool allow_extend) {
+        std::vector<int> selected;
+        selected.reserve(M);
+        if (neighbor_selection_ == NeighborSelection::Simple) {
+            for (size_t i = 0; i < candidates.size() && (int)selected.size() < M; ++i) {
+                selected.push_back(candidates[i].second);
+            }
+            return selected;
+        }
+
+        if (allow_extend && extend_candidates_) {
+            std::unique_ptr<VisitedList> seen = visited_list_pool_->getFreeVisitedList(max_elements_);
+            seen->markVisited(self_id);
+            for (const auto& candidate : candidates) {
+                seen->markVisited(candidate.second);
+            }
+            std::vector<int> neighbors;
+            size_t original = candidates.size();
+            for (size_t i = 0; i < original; ++i) {
+                copyLinks(candidates[i].second, layer, neighbors);
+                for (int e : neighbors) {
+                    if (!seen->isVisited(e)) {
+                        seen->markVisited(e);
+                        candidates.push_back(std::make_pair(dist_func_(q, getData(e), dim_), e));
+                    }
+                }
+            }
+            visited_list_pool_->releaseVisitedList(std::move(seen));
+            std::sort(candidates.begin(), candidates.end());
         }
 
-        nodes_[node_id].friends[layer].clear();
-        while (nodes_[node_id].friends[layer].size() < (unsigned int)M_max && !connections.empty()) {
-            nodes_[node_id].friends[layer].push_back(connections.top().second);
-            connections.pop();
+        std::vector<int> pruned;
+        for (const auto& candidate : candidates) {
+            if ((int)selected.size() >= M) {
+                break;
+            }
+            const float* candidate_data = getData(candidate.second);
+            bool diverse = true;
+            for (int kept : selected) {
+                if (dist_func_(candidate_data, getData(kept), dim_) < candidate.first) {
+                    diverse = false;
+                    break;
+                }
+            }
+            if (diverse) {
+                selected.push_back(candidate.second);
+            } else if (keep_pruned_) {
+                pruned.push_back(candidate.second);
+            }
+        }
+        for (size_t i = 0; i < pruned.size() && (int)selected.size() < M; ++i) {
+            selected.push_back(pruned[i]);
         }
+        return selected;
     }
 
-    std::priority_queue<std::pair<float, int>> searchLayer(const float* q, int ep, int ef, int l) {
-        std::priority_queue<std::pair<float, int>> W; // min-heap of (dist, id)
-        std::priority_queue<std::pair<float, int>, std::vector<std::pair<float, int>>, std::greater<std::pair<float, int>>> C; // max-heap of (dist, id)
+    // searchKnn() in 'scratch': leaves up to k (distance, label) pairs in
+    // scratch.results, as a max-heap.
+    void searchKnn(const float* q, int k, int ef_search, const LabelFilter* filter, SearchScratch& scratch) {
+        std::shared_lock<std::shared_mutex> lock(index_lock_);
+        std::vector<std::pair<float, int>>& W = scratch.results;
+        W.clear();
+
+        // L_ before the entry point (addPoint writes them the other way
+        // round), so the entry point is never below the layer we start on.
+        int max_level = L_;
+        int ep = enter_point_;
+        if (ep == -1) {
+            return;
+        }
+
+        if (metric_ == Metric::Cosine) {
+            scratch.query.assign(q, q + dim_);
+            normalizeVector(scratch.query.data(), dim_);
+            q = scratch.query.data();
+        }
+
+        for (int lc = max_level; lc >= 1; --lc) {
+            searchLayer(q, ep, 1, lc, scratch);
+            ep = W.front().second;
+        }
         
-        std::set<int> visited;
+        // W is a max-heap of (distance, internal_id) for the ef closest items
+        int ef = std::max(ef_search > 0 ? ef_search : ef_search_.load(), k);
+        searchLayer(q, ep, ef, 0, scratch, deleted_count_ > 0, filter);
+        while ((int)W.size() > k) {
+            std::pop_heap(W.begin(), W.end());
+            W.pop_back();
+        }
+        for (auto& result : W) {
+            result.second = labels_view_[result.second];
+        }
+        std::make_heap(W.begin(), W.end()); // Ties may order differently by label
+    }
+
+    // searchLayer() in scratch of its own, for the insert paths
+    std::priority_queue<std::pair<float, int>> searchLayer(const float* q, int ep, int ef, int l, bool skip_deleted = false, const LabelFilter* filter = nullptr) {
+        SearchScratch scratch;
+        searchLayer(q, ep, ef, l, scratch, skip_deleted, filter);
+        visited_list_pool_->releaseVisitedList(std::move(scratch.visited));
+        return std::priority_queue<std::pair<float, int>>(std::less<std::pair<float, int>>(), std::move(scratch.results));
+    }
 
-        // --- These are the corrected lines ---
-        C.push(std::make_pair(dist(q, ep, l), ep));
-        W.push(std::make_pair(dist(q, ep, l), ep));
-        // --- End corrected lines ---
+    // Best-first search of one layer from ep, leaves up to ef (distance, id)
+    // in scratch.results as a max-heap. With skip_deleted, tombstoned nodes
+    // are still expanded but never make it into the result; the same goes
+    // for labels the filter does not allow.
+    void searchLayer(const float* q, int ep, int ef, int l, SearchScratch& scratch, bool skip_deleted = false, const LabelFilter* filter = nullptr) {
+        bool filtering = skip_deleted || filter;
+        auto admit = [&](int id) {
+            return (!skip_deleted || !isDeleted(id)) && (!filter || filter->allow(labels_view_[id]));
+        };
+        std::vector<std::pair<float, int>>& W = scratch.results;    // max-heap of (dist, id): the ef best so far
+        std::vector<std::pair<float, int>>& C = scratch.candidates; // min-heap of (dist, id): still to expand
+        std::greater<std::pair<float, int>> nearer_first;
+        W.clear();
+        C.clear();
+        
+        // Reused across calls: marking a node is one store, no allocation.
+        // Sized for the capacity, concurrent inserts may link in new ids.
+        if (!scratch.visited) {
+            scratch.visited = visited_list_pool_->getFreeVisitedList(max_elements_);
+        } else {
+            scratch.visited->prepare(max_elements_);
+        }
+        VisitedList& visited = *scratch.visited;
 
-        visited.insert(ep);
+        // Snapshot of the current node's links, taken under its lock
+        std::vector<int>& neighbors = scratch.neighbors;
+        neighbors.reserve(std::max(M_max0_, M_));
+
+        float d_ep = dist(q, ep, l);
+        C.push_back(std::make_pair(d_ep, ep));
+        if (!filtering || admit(ep)) {
+            W.push_back(std::make_pair(d_ep, ep));
+        }
+        // Distance of the worst result kept so far
+        float bound = W.empty() ? std::numeric_limits<float>::max() : d_ep;
+
+        visited.markVisited(ep);
 
         while (!C.empty()) {
-            int c = C.top().second;
-            C.pop();
+            std::pop_heap(C.begin(), C.end(), nearer_first);
+            std::pair<float, int> current = C.back();
+            C.pop_back();
 
-            // --- Corrected line ---
-            if (c == -1 || W.top().first < dist(q, c, l)) {
+            // Nothing left that can improve W. While skipped nodes leave W
+            // short of ef, keep going.
+            if (current.first > bound && (W.size() >= (unsigned int)ef || !filtering)) {
                 break;
             }
-            // --- End corrected line ---
+            int c = current.second;
 
-            // --- THIS IS THE FIX ---
-            // Check if the node 'c' has a friends list for layer 'l' before accessing it
-            if (nodes_[c].friends.size() > (unsigned int)l) {
-                for (int e : nodes_[c].friends[l]) {
-                    if (visited.find(e) == visited.end()) {
-                        visited.insert(e);
-                        // --- Corrected lines ---
+            // Only nodes whose level reaches 'l' have links on it
+            if (levels_view_[c] >= l) {
+                copyLinks(c, l, neighbors);
+                for (int e : neighbors) {
+                    if (!visited.isVisited(e)) {
+                        visited.markVisited(e);
                         float d_e = dist(q, e, l);
-                        if (d_e < W.top().first || W.size() < (unsigned int)ef) {
-                            W.push(std::make_pair(d_e, e));
-                            C.push(std::make_pair(d_e, e));
-                            // --- End corrected lines ---
-                            if (W.size() > (unsigned int)ef) {
-                                W.pop();
+                        if (d_e < bound || W.size() < (unsigned int)ef) {
+                            C.push_back(std::make_pair(d_e, e));
+                            std::push_heap(C.begin(), C.end(), nearer_first);
+                            if (!filtering || admit(e)) {
+                                W.push_back(std::make_pair(d_e, e));
+                                std::push_heap(W.begin(), W.end());
+                                if (W.size() > (unsigned int)ef) {
+                                    std::pop_heap(W.begin(), W.end());
+                                    W.pop_back();
+                                }
+                            }
+                            if (!W.empty()) {
+                                bound = W.front().first;
                             }
                         }
                     }
                 }
             }
-            // --- END FIX ---
         }
-        return W;
+    }
+
+    // Put a new point into the slot of tombstoned node 'id'. The node keeps
+    // its level and link lists; repairNode() re-links it for the new vector.
+    // Readers may still be passing through the slot while the vector is
+    // overwritten; it is tombstoned, so they only use it for routing.
+    void replaceDeleted(int id, const float* p, int label) {
+        if (!external_vectors_) {
+            float* data = vectors_view_ + (size_t)id * dim_;
+            std::copy(p, p + dim_, data);
+            if (metric_ == Metric::Cosine) {
+                normalizeVector(data, dim_);
+            }
+        }
+        labels_[id] = label;
+        repairNode(id);
+        setLabelLookup(label, id);
+        // Only now can searches return it
+        deleted_[id] = 0;
+        deleted_count_--;
+    }
+
+    // The vector of 'id' changed: re-link the node and its neighborhood on
+    // every layer it is on. Same approach as hnswlib's updatePoint.
+    void repairNode(int id) {
+        const float* p = getData(id);
+        int level = levels_view_[id];
+        std::vector<int> one_hop, links;
+
+        // 1. Its neighbors choose their links again, from the old
+        //    neighborhood of 'id' (2 hops). That drops links that only made
+        //    sense for the old position.
+        for (int lc = 0; lc <= level; ++lc) {
+            copyLinks(id, lc, one_hop);
+            std::vector<int> area(one_hop);
+            area.push_back(id);
+            for (int n : one_hop) {
+                copyLinks(n, lc, links);
+                area.insert(area.end(), links.begin(), links.end());
+            }
+            std::sort(area.begin(), area.end());
+            area.erase(std::unique(area.begin(), area.end()), area.end());
+
+            int M_max = (lc == 0) ? M_max0_ : M_;
+            for (int n : one_hop) {
+                const float* n_data = getData(n);
+                std::vector<std::pair<float, int>> candidates;
+                candidates.reserve(area.size());
+                for (int a : area) {
+                    if (a != n) {
+                        candidates.push_back(std::make_pair(dist_func_(n_data, getData(a), dim_), a));
+                    }
+                }
+                std::sort(candidates.begin(), candidates.end());
+                if ((int)candidates.size() > ef_construction_) {
+                    candidates.resize(ef_construction_);
+                }
+                std::vector<int> selected = selectNeighbors(n_data, candidates, M_max, lc, n, false);
+                std::unique_lock<std::mutex> lock(link_locks_[n]);
+                int* n_links = getLinks(n, lc);
+                n_links[0] = 0;
+                for (int neighbor_id : selected) {
+                    n_links[1 + n_links[0]] = neighbor_id;
+                    n_links[0]++;
+                }
+            }
+        }
+
+        // 2. Its own links, found like an insert finds them
+        int max_level = L_;
+        int ep = enter_point_;
+        for (int lc = max_level; lc > level; --lc) {
+            ep = searchLayer(p, ep, 1, lc).top().second;
+        }
+        for (int lc = std::min(level, max_level); lc >= 0; --lc) {
+            std::priority_queue<std::pair<float, int>> W = searchLayer(p, ep, ef_construction_, lc);
+            std::vector<std::pair<float, int>> candidates;
+            candidates.reserve(W.size());
+            while (!W.empty()) {
+                if (W.top().second != id) {
+                    candidates.push_back(W.top());
+                }
+                W.pop();
+            }
+            std::reverse(candidates.begin(), candidates.end());
+            if (candidates.empty()) {
+                continue; // 'id' is the only node on this layer
+            }
+            ep = candidates.front().second;
+
+            std::vector<int> selected = selectNeighbors(p, candidates, M_, lc, id, true);
+            {
+                std::unique_lock<std::mutex> lock(link_locks_[id]);
+                int* own = getLinks(id, lc);
+                own[0] = 0;
+                for (int neighbor_id : selected) {
+                    own[1 + own[0]] = neighbor_id;
+                    own[0]++;
+                }
+            }
+            for (int neighbor_id : selected) {
+                std::unique_lock<std::mutex> lock(link_locks_[neighbor_id]);
+                connectNeighbor(neighbor_id, id, lc);
+            }
+        }
     }
 };
 
 #endif // HNSW_H
-
@@ -0,0 +1,108 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HNSW_HAVE_MMAP 1
+#endif
+
+/*
+A read-only, shared memory mapping of a whole file.
+
+Pages come straight from the OS page cache, so every process that maps the
+same index file shares one copy of it, and nothing is read until it is
+touched. Used by HNSW::openMapped() and VectorDB's read-only open mode.
+*/
+class MappedFile {
+public:
+    // How the pages are expected to be accessed
+    enum class Advice { Normal, Random, Sequential };
+
+    // Maps 'path' read-only. With prefault, all pages are read in up front
+    // (slower open, no page faults on the first queries).
+    MappedFile(const std::string& path, Advice advice = Advice::Random, bool prefault = false) : data_(nullptr), size_(0) {
+#ifdef HNSW_HAVE_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file for mapping: " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat file for mapping: " + path);
+        }
+        size_ = (size_t)st.st_size;
+        if (size_ == 0) {
+            ::close(fd);
+            throw std::runtime_error("Cannot map an empty file: " + path);
+        }
+
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if (prefault) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        void* p = ::mmap(nullptr, size_, PROT_READ, flags, fd, 0);
+        ::close(fd); // The mapping keeps the file alive
+        if (p == MAP_FAILED) {
+            throw std::runtime_error("Failed to mmap file: " + path);
+        }
+        data_ = static_cast<const char*>(p);
+
+        int madv = MADV_NORMAL;
+        if (advice == Advice::Random) madv = MADV_RANDOM;       // graph hops: no readahead
+        if (advice == Advice::Sequential) madv = MADV_SEQUENTIAL;
+        if (prefault) madv = MADV_WILLNEED;
+        ::madvise(const_cast<char*>(data_), size_, madv);
+
+#ifndef MAP_POPULATE
+        if (prefault) {
+            // Touch one byte per page so the first queries don't fault
+            volatile char sink = 0;
+            long page = ::sysconf(_SC_PAGESIZE);
+            for (size_t off = 0; off < size_; off += page) {
+                sink = sink + data_[off];
+            }
+        }
+#endif
+#else
+        (void)path;
+        (void)advice;
+        (void)prefault;
+        throw std::runtime_error("Memory-mapped files are not supported on this platform.");
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef HNSW_HAVE_MMAP
+        if (data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    const char* data_;
+    size_t size_;
+};
+
+#endif // MAPPED_FILE_H
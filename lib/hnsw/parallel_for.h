@@ -0,0 +1,70 @@
+#ifndef PARALLEL_FOR_H
+#define PARALLEL_FOR_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+
+// Number of worker threads to use when the caller asks for "0" (= auto)
+inline int resolveThreadCount(int num_threads) {
+    if (num_threads <= 0) {
+        num_threads = (int)std::thread::hardware_concurrency();
+    }
+    return std::max(num_threads, 1);
+}
+
+// Calls fn(i, thread_id) for every i in [start, end) on num_threads threads
+// (0 = one per core). Threads pull the next index from a shared counter, so
+// uneven work balances itself. The first exception thrown by fn stops the
+// remaining work and is rethrown on the calling thread.
+template <class Function>
+void parallelFor(size_t start, size_t end, int num_threads, Function fn) {
+    num_threads = resolveThreadCount(num_threads);
+    if (end <= start) {
+        return;
+    }
+    if (num_threads == 1 || end - start == 1) {
+        for (size_t i = start; i < end; ++i) {
+            fn(i, 0);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(start);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads);
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&, t]() {
+            while (true) {
+                size_t i = next.fetch_add(1);
+                if (i >= end) {
+                    break;
+                }
+                try {
+                    fn(i, t);
+                } catch (...) {
+                    std::unique_lock<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    next = end; // Stop handing out work
+                    break;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+#endif // PARALLEL_FOR_H
@@ -0,0 +1,494 @@
+#ifndef ROARING_BITMAP_H
+#define ROARING_BITMAP_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+
+/*
+A compressed set of 32-bit integers in the style of Roaring bitmaps.
+
+Values are split by their high 16 bits into chunks of 65536. Each non-empty
+chunk is stored in whichever container suits it:
+ - array:  sorted 16-bit values, for up to 4096 of them (2 bytes each)
+ - bitmap: 65536 bits (8 KiB), for dense chunks
+ - run:    sorted [start, start + length] ranges, only made by addRange()
+           and runOptimize(); turned back into an array or bitmap on change
+
+Lookups are a binary search over the chunk keys plus an O(1) or O(log n)
+test inside the container. Not thread-safe for writes; concurrent readers
+of an unchanging bitmap are fine.
+*/
+class RoaringBitmap {
+public:
+    void add(uint32_t x) {
+        containerFor(x >> 16).add(x & 0xFFFF);
+    }
+
+    // Adds every value in [lo, hi)
+    void addRange(uint32_t lo, uint32_t hi) {
+        while (lo < hi) {
+            uint32_t chunk_end = std::min<uint64_t>(hi, ((uint64_t)(lo >> 16) + 1) << 16);
+            Container& c = containerFor(lo >> 16);
+            c.addRange(lo & 0xFFFF, (chunk_end - 1) & 0xFFFF);
+            lo = chunk_end;
+        }
+    }
+
+    // Returns false if x was not in the set
+    bool remove(uint32_t x) {
+        size_t i = findKey(x >> 16);
+        if (i == npos || !containers_[i].remove(x & 0xFFFF)) {
+            return false;
+        }
+        if (containers_[i].cardinality == 0) {
+            keys_.erase(keys_.begin() + i);
+            containers_.erase(containers_.begin() + i);
+        }
+        return true;
+    }
+
+    bool contains(uint32_t x) const {
+        size_t i = findKey(x >> 16);
+        return i != npos && containers_[i].contains(x & 0xFFFF);
+    }
+
+    uint64_t cardinality() const {
+        uint64_t n = 0;
+        for (const Container& c : containers_) {
+            n += c.cardinality;
+        }
+        return n;
+    }
+
+    bool empty() const {
+        return containers_.empty();
+    }
+
+    void clear() {
+        keys_.clear();
+        containers_.clear();
+    }
+
+    RoaringBitmap& operator&=(const RoaringBitmap& other) {
+        std::vector<uint16_t> keys;
+        std::vector<Container> containers;
+        size_t i = 0, j = 0;
+        while (i < keys_.size() && j < other.keys_.size()) {
+            if (keys_[i] < other.keys_[j]) {
+                ++i;
+            } else if (keys_[i] > other.keys_[j]) {
+                ++j;
+            } else {
+                Container c = Container::intersect(containers_[i], other.containers_[j]);
+                if (c.cardinality > 0) {
+                    keys.push_back(keys_[i]);
+                    containers.push_back(std::move(c));
+                }
+                ++i;
+                ++j;
+            }
+        }
+        keys_ = std::move(keys);
+        containers_ = std::move(containers);
+        return *this;
+    }
+
+    RoaringBitmap& operator|=(const RoaringBitmap& other) {
+        size_t i = 0;
+        for (size_t j = 0; j < other.keys_.size(); ++j) {
+            while (i < keys_.size() && keys_[i] < other.keys_[j]) {
+                ++i;
+            }
+            if (i < keys_.size() && keys_[i] == other.keys_[j]) {
+                containers_[i].unite(other.containers_[j]);
+            } else {
+                keys_.insert(keys_.begin() + i, other.keys_[j]);
+                containers_.insert(containers_.begin() + i, other.containers_[j]);
+            }
+            ++i;
+        }
+        return *this;
+    }
+
+    // Union of many bitmaps at once. Chunks are collected in bitmap form and
+    // compressed once at the end, instead of re-merging arrays pairwise.
+    static RoaringBitmap unionOf(const std::vector<const RoaringBitmap*>& inputs) {
+        RoaringBitmap out;
+        for (const RoaringBitmap* input : inputs) {
+            for (size_t j = 0; j < input->keys_.size(); ++j) {
+                Container& c = out.containerFor(input->keys_[j]);
+                if (c.type != Container::Type::Bitmap) {
+                    c.toBitmap();
+                }
+                c.unite(input->containers_[j]);
+            }
+        }
+        for (Container& c : out.containers_) {
+            c.shrink();
+        }
+        return out;
+    }
+
+    friend RoaringBitmap operator&(RoaringBitmap a, const RoaringBitmap& b) {
+        return a &= b;
+    }
+
+    friend RoaringBitmap operator|(RoaringBitmap a, const RoaringBitmap& b) {
+        return a |= b;
+    }
+
+    bool operator==(const RoaringBitmap& other) const {
+        if (keys_ != other.keys_) {
+            return false;
+        }
+        for (size_t i = 0; i < containers_.size(); ++i) {
+            if (!Container::equal(containers_[i], other.containers_[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator!=(const RoaringBitmap& other) const {
+        return !(*this == other);
+    }
+
+    // Calls fn(x) for every value in the set, in increasing order
+    template <class Function>
+    void forEach(Function fn) const {
+        for (size_t i = 0; i < containers_.size(); ++i) {
+            containers_[i].forEach((uint32_t)keys_[i] << 16, fn);
+        }
+    }
+
+    // Stores every container in its smallest form, runs included. Worth it
+    // once a bitmap is built and about to be read many times.
+    void runOptimize() {
+        for (Container& c : containers_) {
+            c.optimize();
+        }
+    }
+
+    // Heap bytes held by the containers
+    size_t sizeInBytes() const {
+        size_t bytes = keys_.capacity() * sizeof(uint16_t) + containers_.capacity() * sizeof(Container);
+        for (const Container& c : containers_) {
+            bytes += c.values.capacity() * sizeof(uint16_t) + c.words.capacity() * sizeof(uint64_t);
+        }
+        return bytes;
+    }
+
+private:
+    static const size_t npos = (size_t)-1;
+
+    struct Container {
+        enum class Type : uint8_t { Array, Bitmap, Run };
+        static const uint32_t kMaxArray = 4096; // Above this a bitmap is smaller
+        static const size_t kWords = 1024;      // 65536 bits
+
+        Type type = Type::Array;
+        uint32_t cardinality = 0;
+        std::vector<uint16_t> values; // Array: sorted values; Run: start, length - 1 pairs
+        std::vector<uint64_t> words;  // Bitmap
+
+        bool contains(uint16_t v) const {
+            switch (type) {
+            case Type::Array:
+                return std::binary_search(values.begin(), values.end(), v);
+            case Type::Bitmap:
+                return (words[v >> 6] >> (v & 63)) & 1;
+            case Type::Run: {
+                // Last run starting at or before v
+                size_t lo = 0, hi = values.size() / 2;
+                while (lo < hi) {
+                    size_t mid = (lo + hi) / 2;
+                    if (values[2 * mid] <= v) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                return lo > 0 && v - values[2 * (lo - 1)] <= values[2 * (lo - 1) + 1];
+            }
+            }
+            return false;
+        }
+
+        void add(uint16_t v) {
+            if (type == Type::Run) {
+                materialize();
+            }
+            if (type == Type::Bitmap) {
+                uint64_t bit = uint64_t(1) << (v & 63);
+                cardinality += (words[v >> 6] & bit) == 0;
+                words[v >> 6] |= bit;
+                return;
+            }
+            auto pos = std::lower_bound(values.begin(), values.end(), v);
+            if (pos != values.end() && *pos == v) {
+                return;
+            }
+            values.insert(pos, v);
+            if (++cardinality > kMaxArray) {
+                toBitmap();
+            }
+        }
+
+        // Adds [lo, hi], both inclusive
+        void addRange(uint16_t lo, uint16_t hi) {
+            if (cardinality == 0) {
+                type = Type::Run;
+                values = {lo, (uint16_t)(hi - lo)};
+                cardinality = (uint32_t)(hi - lo) + 1;
+                return;
+            }
+            if (type != Type::Bitmap) {
+                toBitmap();
+            }
+            for (uint32_t v = lo; v <= hi; ++v) {
+                uint64_t bit = uint64_t(1) << (v & 63);
+                cardinality += (words[v >> 6] & bit) == 0;
+                words[v >> 6] |= bit;
+            }
+            shrink();
+        }
+
+        bool remove(uint16_t v) {
+            if (type == Type::Run) {
+                materialize();
+            }
+            if (type == Type::Bitmap) {
+                uint64_t bit = uint64_t(1) << (v & 63);
+                if ((words[v >> 6] & bit) == 0) {
+                    return false;
+                }
+                words[v >> 6] &= ~bit;
+                --cardinality;
+                shrink();
+                return true;
+            }
+            auto pos = std::lower_bound(values.begin(), values.end(), v);
+            if (pos == values.end() || *pos != v) {
+                return false;
+            }
+            values.erase(pos);
+            --cardinality;
+            return true;
+        }
+
+        template <class Function>
+        void forEach(uint32_t base, Function& fn) const {
+            switch (type) {
+            case Type::Array:
+                for (uint16_t v : values) {
+                    fn(base | v);
+                }
+                break;
+            case Type::Bitmap:
+                for (size_t w = 0; w < kWords; ++w) {
+                    for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+                        fn(base | (uint32_t)(w * 64 + __builtin_ctzll(bits)));
+                    }
+                }
+                break;
+            case Type::Run:
+                for (size_t r = 0; r < values.size(); r += 2) {
+                    for (uint32_t v = values[r]; v <= (uint32_t)values[r] + values[r + 1]; ++v) {
+                        fn(base | v);
+                    }
+                }
+                break;
+            }
+        }
+
+        void toBitmap() {
+            std::vector<uint64_t> bits(kWords, 0);
+            auto set = [&bits](uint32_t v) { bits[v >> 6] |= uint64_t(1) << (v & 63); };
+            forEach(0, set);
+            words = std::move(bits);
+            values.clear();
+            values.shrink_to_fit();
+            type = Type::Bitmap;
+        }
+
+        void toArray() {
+            std::vector<uint16_t> array;
+            array.reserve(cardinality);
+            auto append = [&array](uint32_t v) { array.push_back((uint16_t)v); };
+            forEach(0, append);
+            values = std::move(array);
+            words.clear();
+            words.shrink_to_fit();
+            type = Type::Array;
+        }
+
+        // Run -> array or bitmap, whichever fits the cardinality
+        void materialize() {
+            if (cardinality <= kMaxArray) {
+                toArray();
+            } else {
+                toBitmap();
+            }
+        }
+
+        // A bitmap that got sparse goes back to an array
+        void shrink() {
+            if (type == Type::Bitmap && cardinality <= kMaxArray) {
+                toArray();
+            }
+        }
+
+        void optimize() {
+            size_t runs = countRuns();
+            size_t run_bytes = runs * 4;
+            size_t other_bytes = cardinality <= kMaxArray ? cardinality * 2 : kWords * 8;
+            if (run_bytes < other_bytes) {
+                std::vector<uint16_t> pairs;
+                pairs.reserve(runs * 2);
+                auto extend = [&pairs](uint32_t v) {
+                    size_t n = pairs.size();
+                    if (n > 0 && (uint32_t)pairs[n - 2] + pairs[n - 1] + 1 == v) {
+                        pairs[n - 1]++;
+                    } else {
+                        pairs.push_back((uint16_t)v);
+                        pairs.push_back(0);
+                    }
+                };
+                forEach(0, extend);
+                values = std::move(pairs);
+                words.clear();
+                words.shrink_to_fit();
+                type = Type::Run;
+            } else if (type == Type::Run) {
+                materialize();
+            }
+            values.shrink_to_fit();
+        }
+
+        size_t countRuns() const {
+            switch (type) {
+            case Type::Run:
+                return values.size() / 2;
+            case Type::Array: {
+                size_t runs = 0;
+                for (size_t i = 0; i < values.size(); ++i) {
+                    runs += (i == 0 || values[i] != values[i - 1] + 1);
+                }
+                return runs;
+            }
+            case Type::Bitmap: {
+                // A run starts at every set bit whose predecessor is clear
+                size_t runs = 0;
+                for (size_t w = 0; w < kWords; ++w) {
+                    uint64_t prev = (words[w] << 1) | (w > 0 ? words[w - 1] >> 63 : 0);
+                    runs += __builtin_popcountll(words[w] & ~prev);
+                }
+                return runs;
+            }
+            }
+            return 0;
+        }
+
+        void unite(const Container& other) {
+            if (type == Type::Run) {
+                materialize();
+            }
+            if (type == Type::Array && other.type == Type::Array) {
+                std::vector<uint16_t> merged;
+                merged.reserve(values.size() + other.values.size());
+                std::set_union(values.begin(), values.end(), other.values.begin(), other.values.end(),
+                               std::back_inserter(merged));
+                values = std::move(merged);
+                cardinality = (uint32_t)values.size();
+                if (cardinality > kMaxArray) {
+                    toBitmap();
+                }
+                return;
+            }
+            if (type != Type::Bitmap) {
+                toBitmap();
+            }
+            if (other.type == Type::Bitmap) {
+                cardinality = 0;
+                for (size_t w = 0; w < kWords; ++w) {
+                    words[w] |= other.words[w];
+                    cardinality += __builtin_popcountll(words[w]);
+                }
+            } else {
+                auto set = [this](uint32_t v) {
+                    uint64_t bit = uint64_t(1) << (v & 63);
+                    cardinality += (words[v >> 6] & bit) == 0;
+                    words[v >> 6] |= bit;
+                };
+                other.forEach(0, set);
+            }
+        }
+
+        static Container intersect(const Container& a, const Container& b) {
+            Container out;
+            if (a.type == Type::Bitmap && b.type == Type::Bitmap) {
+                out.type = Type::Bitmap;
+                out.words.resize(kWords);
+                for (size_t w = 0; w < kWords; ++w) {
+                    out.words[w] = a.words[w] & b.words[w];
+                    out.cardinality += __builtin_popcountll(out.words[w]);
+                }
+                out.shrink();
+                return out;
+            }
+            if (a.type == Type::Array && b.type == Type::Array) {
+                std::set_intersection(a.values.begin(), a.values.end(), b.values.begin(), b.values.end(),
+                                      std::back_inserter(out.values));
+                out.cardinality = (uint32_t)out.values.size();
+                return out;
+            }
+            // Walk the smaller one, test against the other
+            const Container& small = a.cardinality <= b.cardinality ? a : b;
+            const Container& large = a.cardinality <= b.cardinality ? b : a;
+            auto keep = [&](uint32_t v) {
+                if (large.contains((uint16_t)v)) {
+                    out.values.push_back((uint16_t)v);
+                }
+            };
+            small.forEach(0, keep);
+            out.cardinality = (uint32_t)out.values.size();
+            if (out.cardinality > kMaxArray) {
+                out.toBitmap();
+            }
+            return out;
+        }
+
+        static bool equal(const Container& a, const Container& b) {
+            if (a.cardinality != b.cardinality) {
+                return false;
+            }
+            bool same = true;
+            auto check = [&](uint32_t v) { same = same && b.contains((uint16_t)v); };
+            a.forEach(0, check);
+            return same;
+        }
+    };
+
+    std::vector<uint16_t> keys_; // High 16 bits, sorted
+    std::vector<Container> containers_;
+
+    size_t findKey(uint16_t key) const {
+        auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+        return (it != keys_.end() && *it == key) ? (size_t)(it - keys_.begin()) : npos;
+    }
+
+    Container& containerFor(uint16_t key) {
+        auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+        size_t i = it - keys_.begin();
+        if (it == keys_.end() || *it != key) {
+            keys_.insert(it, key);
+            containers_.insert(containers_.begin() + i, Container());
+        }
+        return containers_[i];
+    }
+};
+
+#endif // ROARING_BITMAP_H
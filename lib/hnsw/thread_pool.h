@@ -0,0 +1,135 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+#include "parallel_for.h"
+
+/*
+A fixed set of worker threads for parallelFor() jobs that come often, such as
+batch searches: the threads are started once instead of for every job.
+
+Jobs from several callers share the workers. Each job is split into at most
+max_threads tasks, which queue up for the workers, so concurrent jobs never
+run on more threads than the pool has. A worker runs one task at a time, so
+a job may keep per-worker state indexed by the worker number.
+*/
+class ThreadPool {
+public:
+    // num_threads workers, 0 = one per core
+    explicit ThreadPool(int num_threads = 0) {
+        int n = resolveThreadCount(num_threads);
+        workers_.reserve(n);
+        for (int worker = 0; worker < n; ++worker) {
+            workers_.emplace_back([this, worker] { work(worker); });
+        }
+    }
+
+    // Runs the queued tasks, then joins the workers
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            stopping_ = true;
+        }
+        task_ready_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const {
+        return (int)workers_.size();
+    }
+
+    // Calls fn(i, worker) for every i in [start, end) on at most max_threads
+    // of the workers (0 = all), 'worker' being the worker's number in
+    // [0, size()). Blocks until all calls returned; the first exception
+    // thrown by fn stops the remaining work and is rethrown here, as with
+    // ::parallelFor(). Must not be called from inside a job.
+    template <class Function>
+    void parallelFor(size_t start, size_t end, int max_threads, Function fn) {
+        if (end <= start) {
+            return;
+        }
+        int tasks = (max_threads <= 0) ? size() : std::min(max_threads, size());
+        tasks = (int)std::min<size_t>(tasks, end - start);
+
+        std::atomic<size_t> next(start);
+        std::exception_ptr error;
+        std::mutex job_lock; // Guards error and running
+        std::condition_variable job_done;
+        int running = tasks;
+
+        auto task = [&](int worker) {
+            while (true) {
+                size_t i = next.fetch_add(1);
+                if (i >= end) {
+                    break;
+                }
+                try {
+                    fn(i, worker);
+                } catch (...) {
+                    std::unique_lock<std::mutex> lock(job_lock);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    next = end; // Stop handing out work
+                    break;
+                }
+            }
+            std::unique_lock<std::mutex> lock(job_lock);
+            if (--running == 0) {
+                job_done.notify_one();
+            }
+        };
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            for (int t = 0; t < tasks; ++t) {
+                tasks_.push_back(task);
+            }
+        }
+        task_ready_.notify_all();
+
+        std::unique_lock<std::mutex> lock(job_lock);
+        job_done.wait(lock, [&] { return running == 0; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    std::vector<std::thread> workers_;
+    std::mutex lock_; // Guards tasks_ and stopping_
+    std::condition_variable task_ready_;
+    std::deque<std::function<void(int)>> tasks_;
+    bool stopping_ = false;
+
+    void work(int worker) {
+        while (true) {
+            std::function<void(int)> task;
+            {
+                std::unique_lock<std::mutex> lock(lock_);
+                task_ready_.wait(lock, [&] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return; // Stopping
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task(worker);
+        }
+    }
+};
+
+#endif // THREAD_POOL_H
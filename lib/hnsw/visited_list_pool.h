@@ -0,0 +1,95 @@
+#ifndef VISITED_LIST_POOL_H
+#define VISITED_LIST_POOL_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+/*
+Visited-node tracking for HNSW::searchLayer.
+
+A VisitedList is a dense array with one "epoch tag" per node. A node counts
+as visited when its tag equals the list's current epoch, so clearing the list
+for the next search is just incrementing the epoch (the array is only wiped
+when the counter wraps around).
+
+The pool hands out one list per concurrently running search and takes it back
+afterwards, so a query does no heap allocation for visit tracking once the
+pool is warm.
+*/
+
+typedef unsigned short vl_type;
+
+class VisitedList {
+public:
+    vl_type curV;              // Current epoch
+    std::vector<vl_type> mass; // One tag per node
+
+    explicit VisitedList(size_t num_elements) : curV(0), mass(num_elements, 0) {}
+
+    // Start a new search: bump the epoch, wipe the tags only on wrap-around
+    void reset() {
+        ++curV;
+        if (curV == 0) {
+            std::fill(mass.begin(), mass.end(), 0);
+            ++curV;
+        }
+    }
+
+    // Start a new search over num_elements nodes, growing the tags if the
+    // graph has grown (new tags start at 0, which never equals a live epoch)
+    void prepare(size_t num_elements) {
+        if (mass.size() < num_elements) {
+            mass.resize(num_elements, 0);
+        }
+        reset();
+    }
+
+    bool isVisited(int id) const {
+        return mass[id] == curV;
+    }
+
+    void markVisited(int id) {
+        mass[id] = curV;
+    }
+};
+
+class VisitedListPool {
+public:
+    VisitedListPool(int initial_lists, size_t num_elements) {
+        for (int i = 0; i < initial_lists; ++i) {
+            pool_.push_back(std::make_unique<VisitedList>(num_elements));
+        }
+    }
+
+    // Get a list large enough for num_elements nodes, already reset.
+    // It only allocates when the pool is empty or the graph has grown.
+    std::unique_ptr<VisitedList> getFreeVisitedList(size_t num_elements) {
+        std::unique_ptr<VisitedList> list;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (!pool_.empty()) {
+                list = std::move(pool_.back());
+                pool_.pop_back();
+            }
+        }
+        if (!list) {
+            list = std::make_unique<VisitedList>(num_elements);
+        }
+        list->prepare(num_elements);
+        return list;
+    }
+
+    void releaseVisitedList(std::unique_ptr<VisitedList> list) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        pool_.push_back(std::move(list));
+    }
+
+private:
+    // Used as a stack: a vector keeps its capacity, so no allocation per query
+    std::vector<std::unique_ptr<VisitedList>> pool_;
+    std::mutex mutex_;
+};
+
+#endif // VISITED_LIST_POOL_H
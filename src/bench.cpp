@@ -0,0 +1,1292 @@
+#include "vectordb.h"
+#include "server.h"
+#include "client.h"
+#include "distances.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <queue>
+#include <tuple>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdio>
+#include <new>
+#include <fstream>
+#include <filesystem>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Simple microbenchmarks for the vector database.
+// Run with: vectordb_bench <benchmark> [args]
+
+using Clock = std::chrono::steady_clock;
+
+// --- Heap allocation counter ---
+// Replacing the global operator new lets us report allocations per query.
+// Every form is replaced, plain, array and aligned, so that each delete
+// frees what its new got from malloc.
+static std::atomic<long long> g_allocations{0};
+
+static void* countedAlloc(std::size_t size, std::size_t alignment) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = nullptr;
+    if (alignment <= alignof(std::max_align_t)) {
+        p = std::malloc(size ? size : 1);
+    } else if (posix_memalign(&p, alignment, size ? size : 1) != 0) {
+        p = nullptr;
+    }
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(std::size_t size) {
+    return countedAlloc(size, 0);
+}
+void* operator new[](std::size_t size) {
+    return countedAlloc(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return countedAlloc(size, (std::size_t)alignment);
+}
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return countedAlloc(size, (std::size_t)alignment);
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+// --- Process memory ---
+// A size line of /proc/self/status ("VmRSS", "VmHWM", ...) in bytes, 0
+// where there is no such file (non-Linux)
+size_t procStatusBytes(const std::string& key) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, key.size() + 1, key + ":") == 0) {
+            return std::stoull(line.substr(key.size() + 1)) * 1024; // In kB
+        }
+    }
+    return 0;
+}
+
+// Helper to fill a buffer with random floats in [-1, 1)
+std::vector<float> randomVectors(size_t count, int dim, unsigned seed = 42) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(count * dim);
+    for (auto& x : data) {
+        x = dist(rng);
+    }
+    return data;
+}
+
+// Exact k nearest labels (L2) of each query, by brute force
+std::vector<std::vector<int>> exactKnn(const std::vector<float>& data, int n, const std::vector<float>& queries, int num_queries, int dim, int k) {
+    std::vector<std::vector<int>> truth(num_queries);
+    for (int q = 0; q < num_queries; ++q) {
+        std::priority_queue<std::pair<float, int>> best;
+        for (int i = 0; i < n; ++i) {
+            best.push({L2SqrScalar(queries.data() + (size_t)q * dim, data.data() + (size_t)i * dim, dim), i});
+            if ((int)best.size() > k) {
+                best.pop();
+            }
+        }
+        while (!best.empty()) {
+            truth[q].push_back(best.top().second);
+            best.pop();
+        }
+    }
+    return truth;
+}
+
+// Fraction of the true k nearest neighbors found by the index
+double measureRecall(HNSW& index, const std::vector<std::vector<int>>& truth, const std::vector<float>& queries, int dim, int k, int ef) {
+    size_t found = 0, total = 0;
+    for (size_t q = 0; q < truth.size(); ++q) {
+        auto result = index.searchKnn(queries.data() + q * dim, k, ef);
+        std::vector<int> labels;
+        while (!result.empty()) {
+            labels.push_back(result.top().second);
+            result.pop();
+        }
+        for (int label : truth[q]) {
+            found += std::count(labels.begin(), labels.end(), label);
+        }
+        total += truth[q].size();
+    }
+    return total ? (double)found / total : 0.0;
+}
+
+// --- distance: every kernel vs the scalar loop, dims 2..4096 ---
+void benchKernels(const std::string& title, const std::vector<DistanceKernel>& kernels) {
+    const int pool = 64; // number of vectors we rotate through, stays in cache
+    std::vector<int> dims = {2, 3, 4, 7, 8, 15, 16, 31, 32, 64, 100, 128, 256, 512, 768, 1024, 1536, 2048, 4096};
+
+    std::cout << "\n" << title << std::endl;
+    std::cout << std::setw(6) << "dim";
+    for (const auto& kernel : kernels) {
+        std::cout << std::setw(22) << (std::string(kernel.name) + " ns (x)");
+    }
+    std::cout << std::endl;
+
+    for (int dim : dims) {
+        std::vector<float> data = randomVectors(pool, dim);
+        // Keep total work roughly constant across dims
+        long long calls = std::max(200000LL, 200000000LL / dim);
+
+        std::cout << std::setw(6) << dim;
+        double scalar_ns = 0;
+        for (const auto& kernel : kernels) {
+            volatile float sink = 0;
+            auto start = Clock::now();
+            for (long long i = 0; i < calls; ++i) {
+                const float* a = data.data() + (i % pool) * dim;
+                const float* b = data.data() + ((i + 1) % pool) * dim;
+                sink = sink + kernel.func(a, b, dim);
+            }
+            double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+            if (scalar_ns == 0) {
+                scalar_ns = ns;
+            }
+            std::ostringstream cell;
+            cell << std::fixed << std::setprecision(2) << ns << " (" << std::setprecision(1) << scalar_ns / ns << "x)";
+            std::cout << std::setw(22) << cell.str();
+        }
+        std::cout << std::endl;
+    }
+}
+
+void benchDistance() {
+    std::cout << "Dispatcher picked: " << getDistanceSimdLevel() << std::endl;
+    benchKernels("L2 squared", getAvailableL2SqrKernels());
+    benchKernels("Inner product (also used for cosine)", getAvailableInnerProductKernels());
+}
+
+// --- search: QPS and heap allocations per query on a synthetic set ---
+void benchSearch(int n, int dim, int num_queries, int k, int ef) {
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim << "..." << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<float> queries = randomVectors(num_queries, dim, 7);
+
+    HNSW index(dim, n);
+    auto build_start = Clock::now();
+    for (int i = 0; i < n; ++i) {
+        index.addPoint(data.data() + (size_t)i * dim, i);
+    }
+    double build_s = std::chrono::duration<double>(Clock::now() - build_start).count();
+    std::cout << "Build: " << build_s << " s (" << n / build_s << " inserts/s)" << std::endl;
+
+    // One warm-up query so pools and lazily created state exist
+    index.searchKnn(queries.data(), k, ef);
+
+    long long allocs_before = g_allocations.load();
+    auto start = Clock::now();
+    for (int q = 0; q < num_queries; ++q) {
+        auto result = index.searchKnn(queries.data() + (size_t)q * dim, k, ef);
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    long long allocs = g_allocations.load() - allocs_before;
+
+    std::cout << "Queries: " << num_queries << ", k = " << k << ", ef_search = " << (ef > 0 ? ef : index.getEfSearch()) << std::endl;
+    std::cout << "QPS: " << num_queries / seconds << std::endl;
+    std::cout << "Heap allocations per query: " << (double)allocs / num_queries << std::endl;
+
+    // Recall against brute force on a sample of the queries
+    int sample = std::min(num_queries, 200);
+    auto truth = exactKnn(data, n, queries, sample, dim, k);
+    std::cout << "Recall@" << k << " (" << sample << " queries): " << measureRecall(index, truth, queries, dim, k, ef) << std::endl;
+}
+
+// --- build: parallel insert throughput for 1, 2, 4, ... threads ---
+void benchBuild(int n, int dim, int max_threads) {
+    max_threads = resolveThreadCount(max_threads);
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim
+              << " (hardware threads: " << std::thread::hardware_concurrency() << ")" << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+
+    std::cout << std::setw(8) << "threads" << std::setw(12) << "seconds" << std::setw(14) << "inserts/s" << std::setw(10) << "speedup" << std::endl;
+    double base_s = 0;
+    for (int threads = 1; ; threads *= 2) {
+        threads = std::min(threads, max_threads);
+        HNSW index(dim, n);
+        auto start = Clock::now();
+        index.addPoints(data.data(), labels.data(), n, threads);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        if (base_s == 0) {
+            base_s = seconds;
+        }
+        std::cout << std::setw(8) << threads << std::setw(12) << std::fixed << std::setprecision(2) << seconds
+                  << std::setw(14) << std::setprecision(0) << n / seconds
+                  << std::setw(9) << std::setprecision(2) << base_s / seconds << "x" << std::endl;
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
+
+// --- concurrent: search QPS on 1, 2, 4, ... threads while one thread inserts ---
+void benchConcurrent(int n, int dim, int max_threads, double seconds_per_round, int k) {
+    max_threads = resolveThreadCount(max_threads);
+    std::vector<int> thread_counts;
+    for (int threads = 1; ; threads *= 2) {
+        threads = std::min(threads, max_threads);
+        thread_counts.push_back(threads);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+
+    // Half the points up front, the other half is inserted during the rounds
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<float> queries = randomVectors(10000, dim, 7);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+    int initial = n / 2;
+    std::cout << "Building HNSW with " << initial << " of " << n << " random vectors of dim " << dim
+              << " (hardware threads: " << std::thread::hardware_concurrency() << ")" << std::endl;
+    HNSW index(dim, n);
+    index.addPoints(data.data(), labels.data(), initial);
+
+    std::cout << std::setw(8) << "readers" << std::setw(14) << "search QPS" << std::setw(10) << "speedup"
+              << std::setw(14) << "inserts/s" << std::endl;
+    int next_insert = initial;
+    double base_qps = 0;
+    for (size_t round = 0; round < thread_counts.size(); ++round) {
+        int readers = thread_counts[round];
+        int insert_end = next_insert + (n - next_insert) / (int)(thread_counts.size() - round);
+        std::atomic<bool> stop{false};
+        std::atomic<long long> searches{0};
+        int inserted = 0;
+
+        auto start = Clock::now();
+        std::thread writer([&]() {
+            for (int i = next_insert; i < insert_end && !stop; ++i) {
+                index.addPoint(data.data() + (size_t)i * dim, i);
+                inserted++;
+            }
+        });
+        std::vector<std::thread> threads;
+        for (int t = 0; t < readers; ++t) {
+            threads.emplace_back([&, t]() {
+                long long count = 0;
+                for (size_t q = t; !stop; q = (q + 1) % 10000) {
+                    auto result = index.searchKnn(queries.data() + q * dim, k);
+                    count++;
+                }
+                searches += count;
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds_per_round));
+        stop = true;
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        writer.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        next_insert += inserted;
+
+        double qps = searches / seconds;
+        if (base_qps == 0) {
+            base_qps = qps;
+        }
+        std::cout << std::setw(8) << readers << std::setw(14) << std::fixed << std::setprecision(0) << qps
+                  << std::setw(9) << std::setprecision(2) << qps / base_qps << "x"
+                  << std::setw(14) << std::setprecision(0) << inserted / seconds << std::endl;
+    }
+    std::cout << "Index size at the end: " << index.getCurrentElementCount() << std::endl;
+}
+
+// --- selection: recall vs QPS for each neighbor selection mode ---
+void benchSelection(int n, int dim, int num_queries, int k) {
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim << " per mode" << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<float> queries = randomVectors(num_queries, dim, 7);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+    auto truth = exactKnn(data, n, queries, num_queries, dim, k);
+
+    struct Mode {
+        const char* name;
+        NeighborSelection selection;
+        bool extend_candidates;
+        bool keep_pruned;
+    };
+    std::vector<Mode> modes = {
+        {"simple", NeighborSelection::Simple, false, false},
+        {"heuristic", NeighborSelection::Heuristic, false, false},
+        {"heuristic+keep", NeighborSelection::Heuristic, false, true},
+        {"heuristic+extend", NeighborSelection::Heuristic, true, false},
+    };
+    std::vector<int> efs = {10, 20, 40, 80, 160};
+
+    std::cout << std::setw(18) << "mode" << std::setw(10) << "build s" << std::setw(6) << "ef"
+              << std::setw(10) << "recall" << std::setw(12) << "QPS" << std::endl;
+    for (const Mode& mode : modes) {
+        HNSW index(dim, n);
+        index.setNeighborSelection(mode.selection, mode.extend_candidates, mode.keep_pruned);
+        auto build_start = Clock::now();
+        index.addPoints(data.data(), labels.data(), n);
+        double build_s = std::chrono::duration<double>(Clock::now() - build_start).count();
+
+        for (int ef : efs) {
+            double recall = measureRecall(index, truth, queries, dim, k, ef);
+            auto start = Clock::now();
+            for (int q = 0; q < num_queries; ++q) {
+                auto result = index.searchKnn(queries.data() + (size_t)q * dim, k, ef);
+            }
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            std::cout << std::setw(18) << mode.name << std::setw(10) << std::fixed << std::setprecision(2) << build_s
+                      << std::setw(6) << ef << std::setw(10) << std::setprecision(4) << recall
+                      << std::setw(12) << std::setprecision(0) << num_queries / seconds << std::endl;
+        }
+    }
+}
+
+// --- ingest: VectorDB::addVector into the live index vs a full rebuild ---
+void benchIngest(int n, int dim) {
+    const std::string path = "./bench_ingest_db";
+    auto removeFiles = [&]() {
+        for (const char* ext : {".vdb", ".json", ".hnsw", ".wal"}) {
+            std::remove((path + ext).c_str());
+        }
+    };
+    removeFiles();
+    std::vector<float> data = randomVectors(n, dim);
+
+    VectorDB db(path);
+    db.init(dim);
+    size_t rss_before = procStatusBytes("VmRSS");
+    auto start = Clock::now();
+    for (int i = 0; i < n; ++i) {
+        db.addVector(std::vector<float>(data.begin() + (size_t)i * dim, data.begin() + (size_t)(i + 1) * dim), json::object());
+    }
+    double add_s = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "addVector (indexed): " << n << " vectors in " << add_s << " s (" << n / add_s << " adds/s)" << std::endl;
+    size_t rss_after = procStatusBytes("VmRSS");
+    if (rss_after > rss_before) {
+        // Vectors, IDs, metadata and graph; the floats alone are dim * 4
+        std::cout << "Resident memory: " << (double)(rss_after - rss_before) / n << " bytes/vector (vector data "
+                  << dim * sizeof(float) << ")" << std::endl;
+    }
+
+    start = Clock::now();
+    db.rebuildIndex();
+    double rebuild_s = std::chrono::duration<double>(Clock::now() - start).count();
+    std::cout << "One full rebuild of the same set: " << rebuild_s << " s" << std::endl;
+
+    // Search over the rebuilt index; IDs start at 1, row i holds ID i + 1
+    const int k = 10, num_queries = 200;
+    std::vector<float> queries = randomVectors(num_queries, dim, 7);
+    auto truth = exactKnn(data, n, queries, num_queries, dim, k);
+    for (int ef : {HNSW_DEFAULT_EF_SEARCH, 100, 200}) {
+        size_t hits = 0;
+        start = Clock::now();
+        for (int q = 0; q < num_queries; ++q) {
+            auto results = db.search(std::vector<float>(queries.begin() + (size_t)q * dim, queries.begin() + (size_t)(q + 1) * dim), k, ef);
+            for (const auto& result : results) {
+                hits += std::count(truth[q].begin(), truth[q].end(), (int)(result.first - 1));
+            }
+        }
+        double search_s = std::chrono::duration<double>(Clock::now() - start).count();
+        std::cout << "Search, ef " << ef << ": " << num_queries / search_s << " QPS, recall@" << k << " "
+                  << (double)hits / (num_queries * k) << std::endl;
+    }
+    removeFiles();
+}
+
+// --- storage: binary data file vs the JSON format, save and load ---
+void benchStorage(int n, int dim) {
+    const std::string path = "./bench_storage_db";
+    const std::string json_path = "./bench_storage.json";
+    auto removeFiles = [&]() {
+        for (const char* ext : {".vdb", ".json", ".hnsw"}) {
+            std::remove((path + ext).c_str());
+        }
+        std::remove(json_path.c_str());
+    };
+    auto seconds = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    auto mib = [](const std::string& file) {
+        return (double)std::filesystem::file_size(file) / (1 << 20);
+    };
+    removeFiles();
+
+    std::cout << "Writing " << n << " vectors of dim " << dim << " as JSON..." << std::endl;
+    {
+        std::vector<float> data = randomVectors(n, dim);
+        json j = {{"dim", dim}, {"metric", "l2"}, {"nextId", n + 1}, {"vectors", json::array()}};
+        for (int i = 0; i < n; ++i) {
+            j["vectors"].push_back({{"id", i + 1},
+                                    {"metadata", {{"tenant", "t" + std::to_string(i % 100)}, {"price", i % 1000}}},
+                                    {"vec", std::vector<float>(data.begin() + (size_t)i * dim, data.begin() + (size_t)(i + 1) * dim)}});
+        }
+        std::ofstream(json_path) << j.dump(2);
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    auto start = Clock::now();
+    {
+        std::ifstream in(json_path);
+        json j = json::parse(in);
+    }
+    std::cout << "JSON parse:    " << seconds(start) << " s (" << mib(json_path) << " MiB, what every load of the old format cost)" << std::endl;
+
+    VectorDB db(path);
+    start = Clock::now();
+    db.importJson(json_path);
+    std::cout << "JSON import:   " << seconds(start) << " s (parse + index build)" << std::endl;
+
+    start = Clock::now();
+    db.exportJson(json_path);
+    std::cout << "JSON export:   " << seconds(start) << " s" << std::endl;
+
+    start = Clock::now();
+    db.save();
+    std::cout << "Binary save:   " << seconds(start) << " s (data " << mib(path + ".vdb") << " MiB, index "
+              << mib(path + ".hnsw") << " MiB)" << std::endl;
+
+    start = Clock::now();
+    VectorDB loaded(path);
+    loaded.load();
+    std::cout << "Binary load:   " << seconds(start) << " s (data + index file, no rebuild)" << std::endl;
+
+    removeFiles();
+}
+
+// --- jsonload: legacy JSON into the store, streaming (SAX) vs DOM ---
+void benchJsonLoad(int n, int dim) {
+    const std::string json_path = "./bench_jsonload.json";
+    auto seconds = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    auto mib = [](size_t bytes) {
+        return (double)bytes / (1 << 20);
+    };
+    std::cout << "Writing " << n << " vectors of dim " << dim << " as JSON..." << std::endl;
+    {
+        std::vector<float> data = randomVectors(n, dim);
+        std::ofstream out(json_path);
+        out << "{\"dim\": " << dim << ", \"metric\": \"l2\", \"nextId\": " << n + 1 << ", \"vectors\": [";
+        for (int i = 0; i < n; ++i) {
+            out << (i ? ",\n" : "\n") << "{\"id\": " << i + 1 << ", \"metadata\": {\"tenant\": \"t" << i % 100
+                << "\", \"price\": " << i % 1000 << "}, \"vec\": [";
+            for (int d = 0; d < dim; ++d) {
+                out << (d ? ", " : "") << data[(size_t)i * dim + d];
+            }
+            out << "]}";
+        }
+        out << "\n]}\n";
+    }
+    std::cout << "File: " << std::fixed << std::setprecision(1) << mib(std::filesystem::file_size(json_path)) << " MiB, "
+              << mib((size_t)n * dim * sizeof(float)) << " MiB of floats" << std::endl;
+
+    // The store itself takes what the SAX loader peaks at
+    std::cout << std::setw(8) << "loader" << std::setw(12) << "seconds" << std::setw(18) << "peak RSS MiB" << std::endl;
+    // Each loader in a child process of its own, so neither inherits the
+    // other's peak or the heap it freed
+    auto run = [&](const char* name, const std::function<void(VectorStore&)>& load) {
+        std::cout.flush();
+        pid_t pid = fork();
+        if (pid != 0) {
+            waitpid(pid, nullptr, 0);
+            return;
+        }
+        size_t before = procStatusBytes("VmRSS");
+        std::ofstream("/proc/self/clear_refs") << "5"; // Reset VmHWM to VmRSS
+        auto start = Clock::now();
+        VectorStore store;
+        load(store);
+        double s = seconds(start);
+        size_t peak = procStatusBytes("VmHWM");
+        std::cout << std::setw(8) << name << std::setw(12) << std::setprecision(2) << s << std::setw(18)
+                  << std::setprecision(1) << mib(peak - std::min(peak, before)) << std::endl;
+        if ((int)store.size() != n) {
+            std::cerr << "Loaded " << store.size() << " vectors, expected " << n << std::endl;
+        }
+        std::cout.flush();
+        _exit(0);
+    };
+
+    run("sax", [&](VectorStore& store) {
+        std::ifstream in(json_path);
+        readJsonDatabase(in, [&](const json& header) {
+            store.reset(header.at("dim").get<int>(), false);
+        }, [&](long long id, const std::vector<float>& vec, json metadata) {
+            store.insert(id, vec.data(), std::move(metadata));
+        });
+    });
+    // What loading the JSON format did before: the whole file as a DOM first
+    run("dom", [&](VectorStore& store) {
+        std::ifstream in(json_path);
+        json j;
+        in >> j;
+        store.reset(j.at("dim").get<int>(), false);
+        std::vector<float> vec;
+        for (const auto& j_vec : j["vectors"]) {
+            j_vec.at("vec").get_to(vec);
+            store.insert(j_vec.at("id").get<long long>(), vec.data(), j_vec.at("metadata"));
+        }
+    });
+    std::remove(json_path.c_str());
+}
+
+// --- wal: cost of one write, save() per write vs the write-ahead log ---
+void benchWal(int n, int dim, int max_threads) {
+    const std::string path = "./bench_wal_db";
+    auto removeFiles = [&]() {
+        for (const char* ext : {".vdb", ".json", ".hnsw", ".wal"}) {
+            std::remove((path + ext).c_str());
+        }
+    };
+    auto perWriteUs = [](Clock::time_point start, int writes) {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count() / writes;
+    };
+    removeFiles();
+    std::vector<float> data = randomVectors(n + 2100, dim);
+    auto vec = [&](int i) {
+        return std::vector<float>(data.begin() + (size_t)i * dim, data.begin() + (size_t)(i + 1) * dim);
+    };
+
+    std::cout << "Database of " << n << " vectors of dim " << dim << "..." << std::endl;
+    VectorDB db(path);
+    db.init(dim);
+    db.setSyncWrites(false);
+    for (int i = 0; i < n; ++i) {
+        db.addVector(vec(i), {{"i", i}});
+    }
+    db.save();
+    db.setSyncWrites(true);
+
+    std::cout << std::fixed << std::setprecision(1);
+    const int saved_writes = 20, logged_writes = 1000;
+    auto start = Clock::now();
+    for (int i = 0; i < saved_writes; ++i) {
+        db.addVector(vec(n + i), {{"i", n + i}});
+        db.save();
+    }
+    std::cout << "add + save():             " << std::setw(10) << perWriteUs(start, saved_writes) << " us/write" << std::endl;
+
+    start = Clock::now();
+    for (int i = 0; i < logged_writes; ++i) {
+        db.addVector(vec(n + saved_writes + i), {{"i", i}});
+    }
+    std::cout << "add, log fsynced:         " << std::setw(10) << perWriteUs(start, logged_writes) << " us/write" << std::endl;
+
+    db.setSyncWrites(false);
+    start = Clock::now();
+    for (int i = 0; i < logged_writes; ++i) {
+        db.addVector(vec(n + saved_writes + logged_writes + i), {{"i", i}});
+    }
+    db.flush();
+    std::cout << "add, log not fsynced:     " << std::setw(10) << perWriteUs(start, logged_writes) << " us/write" << std::endl;
+    removeFiles();
+
+    // Group commit: writers that each wait for their fsync share them
+    if (max_threads <= 0) {
+        max_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    std::cout << "\nCommits/s with concurrent writers, each waiting for its record to be on disk:" << std::endl;
+    const std::string log_path = "./bench_wal.wal";
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        std::remove(log_path.c_str());
+        WriteAheadLog log;
+        log.open(log_path, 1);
+        std::atomic<long long> commits{0};
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> writers;
+        start = Clock::now();
+        for (int t = 0; t < threads; ++t) {
+            writers.emplace_back([&, t]() {
+                WriteAheadLog::Record record{WriteAheadLog::RecordType::Add, t, vec(t), json::object()};
+                while (!stop.load(std::memory_order_relaxed)) {
+                    log.sync(log.append(record));
+                    commits.fetch_add(1, std::memory_order_relaxed);
+                }
+            });
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        stop = true;
+        for (auto& w : writers) w.join();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::cout << std::setw(4) << threads << " threads: " << std::setw(10) << commits / seconds << " commits/s" << std::endl;
+    }
+    std::remove(log_path.c_str());
+}
+
+// --- checkpoint: write latency during a background checkpoint, and load() time ---
+void benchCheckpoint(int n, int dim) {
+    const std::string path = "./bench_checkpoint_db";
+    auto removeFiles = [&]() {
+        for (const char* ext : {".vdb", ".json", ".hnsw", ".wal"}) {
+            std::remove((path + ext).c_str());
+        }
+    };
+    auto seconds = [](Clock::time_point start) {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    removeFiles();
+    const int writes = 2000;
+    std::vector<float> data = randomVectors((size_t)n + 3 * writes, dim);
+    auto vec = [&](int i) {
+        return std::vector<float>(data.begin() + (size_t)i * dim, data.begin() + (size_t)(i + 1) * dim);
+    };
+
+    std::cout << "Database of " << n << " vectors of dim " << dim << "..." << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    VectorDB db(path);
+    db.init(dim);
+    db.setSyncWrites(false); // Keep fsync noise out of the latencies
+    db.setCheckpointBytes(0);
+    for (int i = 0; i < n; ++i) {
+        db.addVector(vec(i), {{"i", i}});
+    }
+    auto start = Clock::now();
+    db.save();
+    std::cout << "save(), blocking:            " << std::setw(10) << seconds(start) * 1e3 << " ms" << std::endl;
+
+    // Latency of single adds (percentiles in us), optionally with a
+    // checkpoint running from the first one on
+    int next = n;
+    auto measure = [&](const char* label, bool checkpoint) {
+        std::vector<double> us;
+        double pause_ms = 0;
+        if (checkpoint) {
+            auto t = Clock::now();
+            db.checkpoint();
+            pause_ms = seconds(t) * 1e3;
+        }
+        auto begin = Clock::now();
+        for (int w = 0; w < writes; ++w, ++next) {
+            auto t = Clock::now();
+            db.addVector(vec(next), {{"i", next}});
+            us.push_back(seconds(t) * 1e6);
+        }
+        double write_ms = seconds(begin) * 1e3;
+        start = Clock::now();
+        db.waitForCheckpoint();
+        double rest_ms = seconds(start) * 1e3;
+        std::sort(us.begin(), us.end());
+        std::cout << label << " add p50 " << std::setw(7) << us[us.size() / 2] << " us, p99 " << std::setw(7)
+                  << us[us.size() * 99 / 100] << " us, max " << std::setw(8) << us.back() << " us" << std::endl;
+        if (checkpoint) {
+            std::cout << "    checkpoint: " << pause_ms << " ms in the caller, " << write_ms + rest_ms
+                      << " ms in the background (" << writes << " adds meanwhile)" << std::endl;
+        }
+    };
+    measure("no checkpoint:  ", false);
+    measure("checkpointing:  ", true);
+
+    // Recovery: load() replays whatever the log holds
+    for (int w = 0; w < writes; ++w, ++next) {
+        db.addVector(vec(next), {{"i", next}});
+    }
+    db.flush();
+    auto timeLoad = [&](const char* label) {
+        uintmax_t log_bytes = std::filesystem::file_size(path + ".wal");
+        VectorDB reopened(path);
+        auto t = Clock::now();
+        reopened.load();
+        std::cout << label << std::setw(10) << seconds(t) * 1e3 << " ms (log " << log_bytes / 1024 << " KiB)" << std::endl;
+    };
+    timeLoad("load(), log since the checkpoint:");
+    db.checkpoint();
+    db.waitForCheckpoint();
+    timeLoad("load(), right after a checkpoint:");
+    removeFiles();
+}
+
+// --- server: query latency through a running server vs opening the database per command ---
+void benchServer(int n, int dim, int num_queries, int k) {
+    const std::string path = "./bench_server_db";
+    auto removeFiles = [&]() {
+        for (const char* ext : {".vdb", ".json", ".hnsw", ".wal", ".sock"}) {
+            std::remove((path + ext).c_str());
+        }
+    };
+    auto micros = [](Clock::time_point start) {
+        return std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    };
+    auto report = [](const char* label, std::vector<double> us) {
+        std::sort(us.begin(), us.end());
+        std::cout << label << " p50 " << std::setw(9) << us[us.size() / 2] << " us, p99 " << std::setw(9)
+                  << us[us.size() * 99 / 100] << " us" << std::endl;
+    };
+    removeFiles();
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<float> queries = randomVectors(num_queries, dim, 7);
+    auto query = [&](int q) {
+        return std::vector<float>(queries.begin() + (size_t)q * dim, queries.begin() + (size_t)(q + 1) * dim);
+    };
+
+    std::cout << "Database of " << n << " vectors of dim " << dim << ", k = " << k << "..." << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    VectorDB db(path);
+    db.init(dim);
+    db.setSyncWrites(false);
+    for (int i = 0; i < n; ++i) {
+        db.addVector(std::vector<float>(data.begin() + (size_t)i * dim, data.begin() + (size_t)(i + 1) * dim), {{"i", i}});
+    }
+    db.save();
+
+    // What a CLI command pays before and for its one search (without
+    // starting the process)
+    const int commands = 20;
+    for (OpenMode mode : {OpenMode::ReadOnlyMapped, OpenMode::ReadWrite}) {
+        std::vector<double> us;
+        for (int c = 0; c < commands; ++c) {
+            auto t = Clock::now();
+            VectorDB opened(path, mode);
+            opened.load();
+            opened.search(query(c), k);
+            us.push_back(micros(t));
+        }
+        report(mode == OpenMode::ReadOnlyMapped ? "open (mapped) + search:" : "open (heap) + search:  ", us);
+    }
+
+    std::vector<double> us;
+    for (int q = 0; q < num_queries; ++q) {
+        std::vector<float> v = query(q);
+        auto t = Clock::now();
+        db.search(v, k);
+        us.push_back(micros(t));
+    }
+    report("in-process search:     ", us);
+
+    VectorDBServer server(db, VectorDBServer::socketPath(path));
+    std::thread serving([&] { server.run(); });
+    std::unique_ptr<VectorDBClient> client;
+    while (!(client = VectorDBClient::tryConnect(VectorDBServer::socketPath(path)))) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    us.clear();
+    for (int q = 0; q < num_queries; ++q) {
+        std::vector<float> v = query(q);
+        auto t = Clock::now();
+        client->search(v, k);
+        us.push_back(micros(t));
+    }
+    report("search via the server: ", us);
+    us.clear();
+    for (int q = 0; q < num_queries; ++q) {
+        auto t = Clock::now();
+        client->getVector(q);
+        us.push_back(micros(t));
+    }
+    report("get via the server:    ", us);
+    us.clear();
+    for (int w = 0; w < std::min(num_queries, 200); ++w) {
+        auto t = Clock::now();
+        client->addVector(query(w), {{"w", w}});
+        us.push_back(micros(t));
+    }
+    report("add via the server:    ", us);
+    std::cout << "    (adds are fsynced before the reply)" << std::endl;
+    client->shutdown();
+    serving.join();
+    removeFiles();
+}
+
+// --- batch: searchKnnBatch() on 1, 2, 4, ... workers vs one searchKnn() per query ---
+void benchBatch(int n, int dim, int batch_size, int k, int max_threads) {
+    max_threads = resolveThreadCount(max_threads);
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim
+              << " (hardware threads: " << std::thread::hardware_concurrency() << ")" << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+    HNSW index(dim, n);
+    index.addPoints(data.data(), labels.data(), n);
+
+    const int batches = std::max(1, 20000 / batch_size);
+    const size_t total = (size_t)batches * batch_size;
+    std::vector<float> queries = randomVectors(total, dim, 7);
+    std::vector<float> distances((size_t)batch_size * k);
+    std::vector<int> found((size_t)batch_size * k);
+    index.searchKnn(queries.data(), k); // Warm-up
+
+    std::cout << total << " queries in batches of " << batch_size << ", k = " << k << std::endl;
+    std::cout << std::setw(22) << "" << std::setw(12) << "QPS" << std::setw(16) << "allocs/query" << std::endl;
+    auto report = [&](const std::string& label, Clock::time_point start, long long allocs_before) {
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        std::cout << std::setw(22) << label << std::setw(12) << std::fixed << std::setprecision(0) << total / seconds
+                  << std::setw(16) << std::setprecision(2) << (double)(g_allocations.load() - allocs_before) / total << std::endl;
+    };
+
+    long long allocs_before = g_allocations.load();
+    auto start = Clock::now();
+    for (size_t q = 0; q < total; ++q) {
+        auto result = index.searchKnn(queries.data() + q * dim, k);
+    }
+    report("searchKnn() loop", start, allocs_before);
+
+    ThreadPool pool(max_threads);
+    for (int threads = 1; ; threads *= 2) {
+        threads = std::min(threads, max_threads);
+        allocs_before = g_allocations.load();
+        start = Clock::now();
+        for (int b = 0; b < batches; ++b) {
+            index.searchKnnBatch(pool, queries.data() + (size_t)b * batch_size * dim, batch_size, k, distances.data(),
+                                 found.data(), 0, threads);
+        }
+        report("batch, " + std::to_string(threads) + " thread(s)", start, allocs_before);
+        if (threads == max_threads) {
+            break;
+        }
+    }
+}
+
+// --- update: re-embed a fraction of the set in place vs a full rebuild ---
+void benchUpdate(int n, int dim, double fraction, int k) {
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim << "..." << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+    HNSW index(dim, n);
+    auto start = Clock::now();
+    index.addPoints(data.data(), labels.data(), n);
+    double build_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+    int updates = std::max(1, (int)(n * fraction));
+    std::vector<float> fresh = randomVectors(updates, dim, 99);
+    std::mt19937 rng(3);
+    start = Clock::now();
+    for (int u = 0; u < updates; ++u) {
+        int label = rng() % n;
+        std::copy(fresh.begin() + (size_t)u * dim, fresh.begin() + (size_t)(u + 1) * dim, data.begin() + (size_t)label * dim);
+        index.updatePoint(label, data.data() + (size_t)label * dim);
+    }
+    double update_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::vector<float> queries = randomVectors(200, dim, 7);
+    auto truth = exactKnn(data, n, queries, 200, dim, k);
+    std::cout << "Updated " << updates << " vectors in " << update_s << " s (" << updates / update_s << " updates/s)" << std::endl;
+    std::cout << "Full build of the set: " << build_s << " s" << std::endl;
+    std::cout << "Recall@" << k << " after updates (ef 100): " << measureRecall(index, truth, queries, dim, k, 100) << std::endl;
+}
+
+// --- compact: search QPS with tombstones, during compaction, and after ---
+void benchCompact(int n, int dim, double delete_fraction, int k) {
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim << "..." << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<float> queries = randomVectors(1000, dim, 7);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+    HNSW index(dim, n);
+    index.addPoints(data.data(), labels.data(), n);
+    std::mt19937 rng(5);
+    std::vector<int> order(labels);
+    std::shuffle(order.begin(), order.end(), rng);
+    for (int i = 0; i < (int)(n * delete_fraction); ++i) {
+        index.markDelete(order[i]);
+    }
+
+    auto measureQps = [&]() {
+        auto start = Clock::now();
+        for (int q = 0; q < 1000; ++q) {
+            auto result = index.searchKnn(queries.data() + (size_t)q * dim, k);
+        }
+        return 1000 / std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    auto printState = [&](const char* when) {
+        std::cout << std::setw(8) << when << ": " << index.getCurrentElementCount() << " nodes, dead ratio "
+                  << std::fixed << std::setprecision(2) << index.getDeletedRatio() << ", "
+                  << (double)index.getMaxElements() * index.getMemoryPerElement() / (1 << 20) << " MiB, "
+                  << std::setprecision(0) << measureQps() << " QPS" << std::endl;
+    };
+    printState("before");
+
+    // One thread keeps searching while another compacts
+    std::atomic<bool> done{false};
+    long long searches = 0;
+    std::thread reader([&]() {
+        for (size_t q = 0; !done; q = (q + 1) % 1000) {
+            auto result = index.searchKnn(queries.data() + q * dim, k);
+            searches++;
+        }
+    });
+    auto start = Clock::now();
+    index.compact();
+    double compact_s = std::chrono::duration<double>(Clock::now() - start).count();
+    done = true;
+    reader.join();
+    std::cout << "compact(): " << std::setprecision(2) << compact_s << " s, " << std::setprecision(0)
+              << searches / compact_s << " QPS on the reader meanwhile" << std::endl;
+    printState("after");
+}
+
+// --- filter: filtered graph search vs an exact scan of the matches ---
+void benchFilter(int n, int dim, int num_queries, int k, int ef) {
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim << "..." << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<float> queries = randomVectors(num_queries, dim, 7);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+    HNSW index(dim, n);
+    index.addPoints(data.data(), labels.data(), n);
+
+    struct EveryNth : LabelFilter {
+        int step;
+        explicit EveryNth(int step) : step(step) {}
+        bool allow(int label) const override { return label % step == 0; }
+    };
+
+    std::cout << std::setw(10) << "allowed" << std::setw(14) << "graph QPS" << std::setw(14) << "graph recall"
+              << std::setw(14) << "scan QPS" << std::endl;
+    for (int step : {2, 10, 20, 100, 1000}) {
+        EveryNth filter(step);
+        // Ground truth is the exact top k among the allowed labels
+        std::vector<std::vector<int>> truth(num_queries);
+        for (int q = 0; q < num_queries; ++q) {
+            auto result = index.searchKnnBruteForce(queries.data() + (size_t)q * dim, k, &filter);
+            while (!result.empty()) {
+                truth[q].push_back(result.top().second);
+                result.pop();
+            }
+        }
+
+        int found = 0, total = 0;
+        auto start = Clock::now();
+        for (int q = 0; q < num_queries; ++q) {
+            auto result = index.searchKnn(queries.data() + (size_t)q * dim, k, ef, &filter);
+            while (!result.empty()) {
+                found += std::count(truth[q].begin(), truth[q].end(), result.top().second);
+                result.pop();
+            }
+            total += (int)truth[q].size();
+        }
+        double graph_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+        start = Clock::now();
+        for (int q = 0; q < num_queries; ++q) {
+            auto result = index.searchKnnBruteForce(queries.data() + (size_t)q * dim, k, &filter);
+        }
+        double scan_s = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::cout << std::setw(9) << std::fixed << std::setprecision(1) << 100.0 / step << "%"
+                  << std::setw(14) << std::setprecision(0) << num_queries / graph_s
+                  << std::setw(14) << std::setprecision(4) << (double)found / total
+                  << std::setw(14) << std::setprecision(0) << num_queries / scan_s << std::endl;
+    }
+}
+
+// --- metadata: filter evaluation from postings vs reading every metadata object ---
+void benchMetadata(int n) {
+    std::cout << "Indexing metadata of " << n << " vectors (tenant: 100 values, lang: 5, price: 0..9999)" << std::endl;
+    std::mt19937 rng(3);
+    const char* langs[] = {"en", "de", "fr", "es", "it"};
+    std::vector<json> metadata(n);
+    MetadataIndex index;
+    index.addField("tenant");
+    index.addField("lang");
+    index.addField("price");
+    for (int i = 0; i < n; ++i) {
+        metadata[i] = {{"tenant", "t" + std::to_string(rng() % 100)}, {"lang", langs[rng() % 5]}, {"price", (int)(rng() % 10000)}};
+        index.insert(i, metadata[i]);
+    }
+
+    std::vector<std::pair<const char*, json>> filters = {
+        {"tenant = t7", {{"tenant", "t7"}}},
+        {"lang in (en, de)", {{"lang", {"en", "de"}}}},
+        {"price in [100, 200)", {{"price", {{"gte", 100}, {"lt", 200}}}}},
+        {"tenant = t7 and lang = en", {{"tenant", "t7"}, {"lang", "en"}}},
+    };
+    std::cout << std::setw(28) << "filter" << std::setw(10) << "matches" << std::setw(14) << "postings us"
+              << std::setw(14) << "scan us" << std::endl;
+    for (const auto& [name, filter] : filters) {
+        const int rounds = 20;
+        size_t matches = 0;
+        auto start = Clock::now();
+        for (int r = 0; r < rounds; ++r) {
+            RoaringBitmap allowed;
+            bool first = true;
+            for (const auto& [field, condition] : filter.items()) {
+                if (first) {
+                    index.lookup(field, condition, allowed);
+                    first = false;
+                } else {
+                    RoaringBitmap matching;
+                    index.lookup(field, condition, matching);
+                    allowed &= matching;
+                }
+            }
+            matches = allowed.cardinality();
+        }
+        double postings_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / rounds;
+
+        size_t scanned = 0;
+        start = Clock::now();
+        for (int r = 0; r < rounds; ++r) {
+            scanned = 0;
+            for (int i = 0; i < n; ++i) {
+                scanned += matchesFilter(metadata[i], filter);
+            }
+        }
+        double scan_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / rounds;
+        if (scanned != matches) {
+            std::cerr << "Mismatch for " << name << ": " << matches << " vs " << scanned << std::endl;
+        }
+        std::cout << std::setw(28) << name << std::setw(10) << matches << std::setw(14) << std::fixed
+                  << std::setprecision(0) << postings_us << std::setw(14) << scan_us << std::endl;
+    }
+}
+
+// --- membership: cost of the allowed-label check inside searchLayer per set representation ---
+void benchMembership(int n, int dim, int num_queries, int k) {
+    std::cout << "Building HNSW with " << n << " random vectors of dim " << dim << "..." << std::endl;
+    std::vector<float> data = randomVectors(n, dim);
+    std::vector<float> queries = randomVectors(num_queries, dim, 7);
+    std::vector<int> labels(n);
+    for (int i = 0; i < n; ++i) {
+        labels[i] = i;
+    }
+    HNSW index(dim, n);
+    index.addPoints(data.data(), labels.data(), n);
+
+    struct ByteFilter : LabelFilter {
+        const std::vector<char>& allowed;
+        explicit ByteFilter(const std::vector<char>& allowed) : allowed(allowed) {}
+        bool allow(int label) const override { return allowed[label]; }
+    };
+    struct CountingFilter : LabelFilter {
+        const LabelFilter& inner;
+        mutable long long checks = 0;
+        explicit CountingFilter(const LabelFilter& inner) : inner(inner) {}
+        bool allow(int label) const override { checks++; return inner.allow(label); }
+    };
+
+    // 20% of the labels: scattered at random, or as one tenant's contiguous block
+    std::mt19937 rng(11);
+    std::vector<std::pair<const char*, std::vector<char>>> patterns = {{"random 20%", {}}, {"block 20%", {}}};
+    for (int i = 0; i < n; ++i) {
+        patterns[0].second.push_back(rng() % 5 == 0);
+        patterns[1].second.push_back(i >= n / 2 && i < n / 2 + n / 5);
+    }
+
+    auto timeQueries = [&](const LabelFilter* filter) {
+        auto start = Clock::now();
+        for (int q = 0; q < num_queries; ++q) {
+            auto result = index.searchKnn(queries.data() + (size_t)q * dim, k, 0, filter);
+        }
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+    double unfiltered_s = timeQueries(nullptr);
+    std::cout << "Unfiltered: " << std::fixed << std::setprecision(0) << num_queries / unfiltered_s << " QPS" << std::endl;
+
+    std::cout << std::setw(12) << "allowed" << std::setw(16) << "set" << std::setw(12) << "KiB"
+              << std::setw(10) << "QPS" << std::setw(14) << "checks/query" << std::setw(14) << "ns/probe" << std::endl;
+    for (const auto& [name, bytes] : patterns) {
+        RoaringBitmap roaring;
+        for (int i = 0; i < n; ++i) {
+            if (bytes[i]) roaring.add(i);
+        }
+        RoaringBitmap optimized = roaring;
+        optimized.runOptimize();
+
+        ByteFilter byte_filter(bytes);
+        RoaringLabelFilter roaring_filter(roaring), optimized_filter(optimized);
+        std::vector<std::tuple<const char*, const LabelFilter*, size_t>> sets = {
+            {"byte array", &byte_filter, bytes.size()},
+            {"roaring", &roaring_filter, roaring.sizeInBytes()},
+            {"roaring+runs", &optimized_filter, optimized.sizeInBytes()},
+        };
+
+        // Raw probe cost on random labels, outside the search
+        std::vector<int> probes(1 << 20);
+        for (int& p : probes) p = rng() % n;
+
+        for (const auto& [set_name, filter, set_bytes] : sets) {
+            CountingFilter counting(*filter);
+            timeQueries(&counting);
+            double seconds = timeQueries(filter);
+
+            auto start = Clock::now();
+            long long hits = 0;
+            for (int p : probes) hits += filter->allow(p);
+            double probe_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count() / probes.size();
+            if (hits < 0) std::cout << hits; // Keep the loop
+
+            std::cout << std::setw(12) << name << std::setw(16) << set_name << std::setw(12) << std::setprecision(1)
+                      << set_bytes / 1024.0 << std::setw(10) << std::setprecision(0) << num_queries / seconds
+                      << std::setw(14) << counting.checks / num_queries << std::setw(14) << std::setprecision(2)
+                      << probe_ns << std::endl;
+        }
+    }
+}
+
+void printBenchUsage(const std::string& progName) {
+    std::cerr << "Usage: " << progName << " <benchmark>" << std::endl;
+    std::cerr << "Benchmarks:" << std::endl;
+    std::cerr << "  distance                          - L2/IP kernels (scalar/SSE/AVX2/AVX-512) across dims 2..4096." << std::endl;
+    std::cerr << "  search [n] [dim] [queries] [k] [ef]" << std::endl;
+    std::cerr << "                                    - Build + query a synthetic set (default 1000000 x 32), QPS, allocations/query and recall." << std::endl;
+    std::cerr << "  batch [n] [dim] [batch] [k] [max_threads]" << std::endl;
+    std::cerr << "                                    - Batched search on 1, 2, 4, ... threads vs one query at a time: QPS and allocations/query (default 100000 x 32, 256 per batch)." << std::endl;
+    std::cerr << "  build [n] [dim] [max_threads]     - Parallel build throughput for 1, 2, 4, ... threads (default 200000 x 32, all cores)." << std::endl;
+    std::cerr << "  ingest [n] [dim]                  - VectorDB::addVector into the live index vs one rebuild, and bytes per vector (default 100000 x 32)." << std::endl;
+    std::cerr << "  storage [n] [dim]                 - Binary data file save/load vs JSON import/export (default 100000 x 64)." << std::endl;
+    std::cerr << "  jsonload [n] [dim]                - Legacy JSON into the store, streaming SAX reader vs a DOM of the file: time and peak RSS (default 100000 x 64)." << std::endl;
+    std::cerr << "  wal [n] [dim] [max_threads]       - One write with save() vs through the write-ahead log, and group commit (default 20000 x 32)." << std::endl;
+    std::cerr << "  checkpoint [n] [dim]              - Add latency while a background checkpoint runs, and load() time before/after one (default 100000 x 32)." << std::endl;
+    std::cerr << "  server [n] [dim] [queries] [k]    - Query latency through 'serve' (socket round trip) vs opening the database per command (default 100000 x 32)." << std::endl;
+    std::cerr << "  update [n] [dim] [fraction] [k]   - Re-embed a fraction of the set in place (default 100000 x 32, 0.05), updates/s and recall." << std::endl;
+    std::cerr << "  compact [n] [dim] [deleted] [k]   - QPS and memory with a share of tombstones (default 100000 x 32, 0.3), during and after compact()." << std::endl;
+    std::cerr << "  selection [n] [dim] [queries] [k] - Recall and QPS per ef for each neighbor selection mode (default 100000 x 32)." << std::endl;
+    std::cerr << "  filter [n] [dim] [queries] [k] [ef]" << std::endl;
+    std::cerr << "                                    - Filtered graph search vs an exact scan of the matches, 50% .. 0.1% allowed (default 100000 x 32)." << std::endl;
+    std::cerr << "  metadata [n]                      - Filter evaluation from metadata postings vs a scan of the JSON metadata (default 1000000)." << std::endl;
+    std::cerr << "  membership [n] [dim] [queries] [k]" << std::endl;
+    std::cerr << "                                    - Allowed-label checks in filtered searches: byte array vs roaring bitmap (default 100000 x 32)." << std::endl;
+    std::cerr << "  concurrent [n] [dim] [max_threads] [seconds] [k]" << std::endl;
+    std::cerr << "                                    - Search QPS on 1, 2, 4, ... threads while one thread inserts (default 200000 x 32, 2 s per round)." << std::endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        printBenchUsage(argv[0]);
+        return 1;
+    }
+
+    std::string bench = argv[1];
+    if (bench == "distance") {
+        benchDistance();
+    } else if (bench == "search") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 1000000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int queries = (argc > 4) ? std::stoi(argv[4]) : 10000;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        int ef = (argc > 6) ? std::stoi(argv[6]) : 0;
+        benchSearch(n, dim, queries, k, ef);
+    } else if (bench == "batch") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int batch = (argc > 4) ? std::stoi(argv[4]) : 256;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        int max_threads = (argc > 6) ? std::stoi(argv[6]) : 0;
+        benchBatch(n, dim, batch, k, max_threads);
+    } else if (bench == "build") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 200000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int max_threads = (argc > 4) ? std::stoi(argv[4]) : 0;
+        benchBuild(n, dim, max_threads);
+    } else if (bench == "ingest") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        benchIngest(n, dim);
+    } else if (bench == "storage") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 64;
+        benchStorage(n, dim);
+    } else if (bench == "jsonload") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 64;
+        benchJsonLoad(n, dim);
+    } else if (bench == "wal") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 20000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int max_threads = (argc > 4) ? std::stoi(argv[4]) : 0;
+        benchWal(n, dim, max_threads);
+    } else if (bench == "checkpoint") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        benchCheckpoint(n, dim);
+    } else if (bench == "server") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int queries = (argc > 4) ? std::stoi(argv[4]) : 2000;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        benchServer(n, dim, queries, k);
+    } else if (bench == "update") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        double fraction = (argc > 4) ? std::stod(argv[4]) : 0.05;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        benchUpdate(n, dim, fraction, k);
+    } else if (bench == "compact") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        double deleted = (argc > 4) ? std::stod(argv[4]) : 0.3;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        benchCompact(n, dim, deleted, k);
+    } else if (bench == "selection") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int queries = (argc > 4) ? std::stoi(argv[4]) : 1000;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        benchSelection(n, dim, queries, k);
+    } else if (bench == "membership") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int queries = (argc > 4) ? std::stoi(argv[4]) : 1000;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        benchMembership(n, dim, queries, k);
+    } else if (bench == "metadata") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 1000000;
+        benchMetadata(n);
+    } else if (bench == "filter") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 100000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int queries = (argc > 4) ? std::stoi(argv[4]) : 1000;
+        int k = (argc > 5) ? std::stoi(argv[5]) : 10;
+        int ef = (argc > 6) ? std::stoi(argv[6]) : 0;
+        benchFilter(n, dim, queries, k, ef);
+    } else if (bench == "concurrent") {
+        int n = (argc > 2) ? std::stoi(argv[2]) : 200000;
+        int dim = (argc > 3) ? std::stoi(argv[3]) : 32;
+        int max_threads = (argc > 4) ? std::stoi(argv[4]) : 0;
+        double seconds = (argc > 5) ? std::stod(argv[5]) : 2.0;
+        int k = (argc > 6) ? std::stoi(argv[6]) : 10;
+        benchConcurrent(n, dim, max_threads, seconds, k);
+    } else {
+        std::cerr << "Unknown benchmark: " << bench << std::endl;
+        printBenchUsage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "client.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+using protocol::Op;
+using protocol::Status;
+
+VectorDBClient::VectorDBClient(const std::string& socket_path) : fd_(protocol::connectSocket(socket_path)) {
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to connect to " + socket_path + ": " + std::strerror(errno));
+    }
+}
+
+VectorDBClient::VectorDBClient(int fd) : fd_(fd) {}
+
+VectorDBClient::~VectorDBClient() {
+    ::close(fd_);
+}
+
+std::unique_ptr<VectorDBClient> VectorDBClient::tryConnect(const std::string& socket_path) {
+    int fd = protocol::connectSocket(socket_path);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ECONNREFUSED || errno == ENAMETOOLONG) {
+            return nullptr;
+        }
+        throw std::runtime_error("Failed to connect to " + socket_path + ": " + std::strerror(errno));
+    }
+    return std::unique_ptr<VectorDBClient>(new VectorDBClient(fd));
+}
+
+void VectorDBClient::begin(Op op) {
+    request_.clear();
+    request_.put(op);
+}
+
+void VectorDBClient::call() {
+    request_.send(fd_);
+    if (!reply_.receive(fd_)) {
+        throw std::runtime_error("The server closed the connection.");
+    }
+    if (reply_.get<Status>() != Status::Ok) {
+        throw std::runtime_error(reply_.getString());
+    }
+}
+
+void VectorDBClient::fetchInfo() {
+    if (dim_ > 0) {
+        return;
+    }
+    begin(Op::Info);
+    call();
+    dim_ = (int)reply_.get<uint32_t>();
+    metric_ = (Metric)reply_.get<uint8_t>();
+}
+
+int VectorDBClient::getDimensions() {
+    fetchInfo();
+    return dim_;
+}
+
+Metric VectorDBClient::getMetric() {
+    fetchInfo();
+    return metric_;
+}
+
+std::vector<std::pair<long long, float>> VectorDBClient::search(const std::vector<float>& query, int k, int ef_search,
+                                                                const json& filter) {
+    begin(Op::Search);
+    request_.put<uint32_t>((uint32_t)k);
+    request_.put<uint32_t>((uint32_t)std::max(ef_search, 0));
+    request_.putFloats(query.data(), query.size());
+    request_.putString(filter.is_null() ? std::string() : filter.dump());
+    call();
+    std::vector<std::pair<long long, float>> results(reply_.get<uint32_t>());
+    for (auto& result : results) {
+        result.first = reply_.get<int64_t>();
+        result.second = reply_.get<float>();
+    }
+    return results;
+}
+
+BatchSearchResults VectorDBClient::searchBatch(const float* queries, size_t nq, int k, int ef_search) {
+    fetchInfo();
+    begin(Op::SearchBatch);
+    request_.put<uint32_t>((uint32_t)k);
+    request_.put<uint32_t>((uint32_t)std::max(ef_search, 0));
+    request_.put<uint32_t>((uint32_t)nq);
+    request_.putFloats(queries, nq * dim_);
+    call();
+    BatchSearchResults results;
+    results.nq = reply_.get<uint32_t>();
+    results.k = (int)reply_.get<uint32_t>();
+    results.ids.resize(results.nq * results.k);
+    results.distances.resize(results.nq * results.k);
+    for (long long& id : results.ids) {
+        id = reply_.get<int64_t>();
+    }
+    for (float& distance : results.distances) {
+        distance = reply_.get<float>();
+    }
+    return results;
+}
+
+std::pair<VectorData, bool> VectorDBClient::getVector(long long id) {
+    begin(Op::Get);
+    request_.put<int64_t>(id);
+    call();
+    if (!reply_.get<uint8_t>()) {
+        return {{}, false};
+    }
+    VectorData data;
+    data.id = id;
+    data.vec = reply_.getFloats();
+    data.metadata = json::parse(reply_.getString());
+    return {data, true};
+}
+
+long long VectorDBClient::addVector(const std::vector<float>& vec, const json& metadata) {
+    begin(Op::Add);
+    request_.putFloats(vec.data(), vec.size());
+    request_.putString(metadata.dump());
+    call();
+    return reply_.get<int64_t>();
+}
+
+bool VectorDBClient::updateVector(long long id, const std::vector<float>& vec, const json& metadata) {
+    begin(Op::Update);
+    request_.put<int64_t>(id);
+    request_.putFloats(vec.data(), vec.size());
+    request_.putString(metadata.dump());
+    call();
+    return reply_.get<uint8_t>() != 0;
+}
+
+bool VectorDBClient::deleteVector(long long id) {
+    begin(Op::Delete);
+    request_.put<int64_t>(id);
+    call();
+    return reply_.get<uint8_t>() != 0;
+}
+
+std::pair<bool, double> VectorDBClient::compactIndex(double min_deleted_ratio) {
+    begin(Op::Compact);
+    request_.put<double>(min_deleted_ratio);
+    call();
+    bool compacted = reply_.get<uint8_t>() != 0;
+    return {compacted, reply_.get<double>()};
+}
+
+void VectorDBClient::save() {
+    begin(Op::Save);
+    call();
+}
+
+void VectorDBClient::shutdown() {
+    begin(Op::Shutdown);
+    call();
+}
@@ -0,0 +1,59 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "vectordb.h"
+#include "protocol.h"
+
+// Talks to a VectorDBServer (see server.h) over its socket. The calls
+// mirror VectorDB's and throw std::runtime_error with the server's message
+// when the request fails there, or when the connection is lost.
+// One request at a time: use a client per thread.
+class VectorDBClient {
+public:
+    // Throws std::runtime_error if no server answers on 'socket_path'
+    explicit VectorDBClient(const std::string& socket_path);
+    ~VectorDBClient();
+    VectorDBClient(const VectorDBClient&) = delete;
+    VectorDBClient& operator=(const VectorDBClient&) = delete;
+
+    // nullptr if no server answers on 'socket_path': there is no socket
+    // file, or one left by a server that is gone
+    static std::unique_ptr<VectorDBClient> tryConnect(const std::string& socket_path);
+
+    int getDimensions();
+    Metric getMetric();
+    std::vector<std::pair<long long, float>> search(const std::vector<float>& query, int k, int ef_search = 0,
+                                                    const json& filter = json());
+    // Runs on the server's cores, see VectorDB::searchBatch()
+    BatchSearchResults searchBatch(const float* queries, size_t nq, int k, int ef_search = 0);
+    std::pair<VectorData, bool> getVector(long long id);
+    long long addVector(const std::vector<float>& vec, const json& metadata);
+    bool updateVector(long long id, const std::vector<float>& vec, const json& metadata);
+    bool deleteVector(long long id);
+    // VectorDB::compactIndex() on the server. Returns whether it compacted,
+    // and the share of deleted nodes before.
+    std::pair<bool, double> compactIndex(double min_deleted_ratio = 0.0);
+    void save();
+    // Asks the server to stop; it saves the database on the way out
+    void shutdown();
+
+private:
+    explicit VectorDBClient(int fd);
+
+    int fd_;
+    int dim_ = 0;
+    Metric metric_ = Metric::L2;
+    protocol::FrameWriter request_;
+    protocol::FrameReader reply_;
+
+    void begin(protocol::Op op);
+    // Sends request_ and reads the reply into reply_, throwing its error
+    void call();
+    void fetchInfo();
+};
+
+#endif // CLIENT_H
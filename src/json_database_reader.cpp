@@ -0,0 +1,245 @@
+#include "json_database_reader.h"
+#include <stdexcept>
+#include <string>
+
+namespace {
+// "dim" or "metric" came after vectors were passed to add()
+struct LateHeader {};
+
+std::runtime_error corrupted(const std::string& what) {
+    return std::runtime_error("Database file is corrupted (" + what + ").");
+}
+
+// Nesting inside the top-level object: 1 = its fields, 2 = the "vectors"
+// array, 3 = the fields of one vector, 4 = its "vec" array. Any other value
+// is built as a json value (captured) and stored when it closes.
+class DatabaseSax : public json::json_sax_t {
+public:
+    DatabaseSax(bool stream, const JsonDatabaseStart& start, const JsonDatabaseAdd& add) :
+        stream_(stream), start_(start), add_(add) {}
+
+    json header = json::object();
+    std::string error; // Parse error, when sax_parse() returns false
+
+    bool null() override {
+        return value(nullptr);
+    }
+    bool boolean(bool val) override {
+        return value(val);
+    }
+    bool number_integer(number_integer_t val) override {
+        return in_vec_ ? element((float)val) : value(val);
+    }
+    bool number_unsigned(number_unsigned_t val) override {
+        return in_vec_ ? element((float)val) : value(val);
+    }
+    bool number_float(number_float_t val, const string_t&) override {
+        return in_vec_ ? element((float)val) : value(val);
+    }
+    bool string(string_t& val) override {
+        return value(std::move(val));
+    }
+    bool binary(binary_t& val) override {
+        return value(json::binary(std::move(val)));
+    }
+
+    bool start_object(std::size_t) override {
+        return open(json::object());
+    }
+    bool start_array(std::size_t) override {
+        return open(json::array());
+    }
+    bool end_object() override {
+        return close();
+    }
+    bool end_array() override {
+        return close();
+    }
+
+    bool key(string_t& val) override {
+        if (!capture_.empty()) {
+            capture_key_ = val;
+        } else if (depth_ == 1) {
+            if (started_ && (val == "dim" || val == "metric")) {
+                throw LateHeader();
+            }
+            sorted_ = sorted_ && (top_key_.empty() || top_key_ < val);
+            top_key_ = val;
+        } else if (depth_ == 3) {
+            element_key_ = val;
+        }
+        return true;
+    }
+
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& ex) override {
+        error = ex.what();
+        return false;
+    }
+
+private:
+    struct Pending {
+        long long id;
+        std::vector<float> vec;
+        json metadata;
+    };
+
+    bool stream_;
+    const JsonDatabaseStart& start_;
+    const JsonDatabaseAdd& add_;
+
+    int depth_ = 0;
+    std::string top_key_;
+    bool sorted_ = true;         // Top-level keys so far came in order
+    bool started_ = false;       // start() was called
+    bool in_vectors_ = false;
+    bool in_vec_ = false;
+
+    // The vector being read
+    std::string element_key_;
+    json element_;               // Its fields but "vec"
+    std::vector<float> vec_;
+    bool has_vec_ = false;
+    std::vector<Pending> pending_; // Vectors read before start()
+
+    json captured_;
+    std::vector<json*> capture_; // Open containers of the captured value
+    std::string capture_key_;
+
+    bool element(float x) {
+        vec_.push_back(x);
+        return true;
+    }
+
+    // Puts 'val' into the innermost captured container
+    json* attach(json val) {
+        json* parent = capture_.back();
+        if (parent->is_array()) {
+            parent->push_back(std::move(val));
+            return &parent->back();
+        }
+        json& slot = (*parent)[capture_key_];
+        slot = std::move(val);
+        return &slot;
+    }
+
+    // A complete value for the current field
+    void finish(json val) {
+        if (depth_ == 1) {
+            header[top_key_] = std::move(val);
+        } else if (depth_ == 3) {
+            element_[element_key_] = std::move(val);
+        }
+    }
+
+    bool value(json val) {
+        if (!capture_.empty()) {
+            attach(std::move(val));
+        } else if (depth_ == 0) {
+            throw corrupted("not a JSON object");
+        } else if (in_vec_) {
+            throw corrupted("\"vec\" must hold numbers");
+        } else if (in_vectors_ && depth_ == 2) {
+            throw corrupted("\"vectors\" must hold objects");
+        } else {
+            finish(std::move(val));
+        }
+        return true;
+    }
+
+    bool open(json container) {
+        if (!capture_.empty()) {
+            capture_.push_back(attach(std::move(container)));
+        } else if (depth_ == 0) {
+            if (!container.is_object()) {
+                throw corrupted("not a JSON object");
+            }
+        } else if (depth_ == 1 && top_key_ == "vectors" && container.is_array()) {
+            in_vectors_ = true;
+            // Stream if start() has all it needs: a missing "metric" in a
+            // sorted file means there is none
+            if (stream_ && !started_ && header.contains("dim") && (header.contains("metric") || sorted_)) {
+                start_(header);
+                started_ = true;
+            }
+        } else if (in_vectors_ && depth_ == 2) {
+            if (!container.is_object()) {
+                throw corrupted("\"vectors\" must hold objects");
+            }
+            element_ = json::object();
+            element_key_.clear();
+            vec_.clear();
+            has_vec_ = false;
+        } else if (in_vectors_ && depth_ == 3 && element_key_ == "vec" && container.is_array()) {
+            in_vec_ = true;
+            has_vec_ = true;
+            vec_.clear();
+        } else if (in_vec_) {
+            throw corrupted("\"vec\" must hold numbers");
+        } else {
+            captured_ = std::move(container);
+            capture_.push_back(&captured_);
+        }
+        ++depth_;
+        return true;
+    }
+
+    bool close() {
+        --depth_;
+        if (!capture_.empty()) {
+            capture_.pop_back();
+            if (capture_.empty()) {
+                finish(std::move(captured_));
+            }
+        } else if (in_vec_) {
+            in_vec_ = false;
+        } else if (in_vectors_ && depth_ == 2) {
+            addElement();
+        } else if (in_vectors_ && depth_ == 1) {
+            in_vectors_ = false;
+        } else if (depth_ == 0) {
+            if (!started_) {
+                start_(header);
+                started_ = true;
+            }
+            for (Pending& p : pending_) {
+                add_(p.id, p.vec, std::move(p.metadata));
+            }
+            pending_.clear();
+        }
+        return true;
+    }
+
+    void addElement() {
+        if (!has_vec_ || !element_.contains("id") || !element_.contains("metadata")) {
+            throw corrupted("missing fields: a vector needs \"id\", \"vec\" and \"metadata\"");
+        }
+        long long id = element_["id"].get<long long>();
+        if (started_) {
+            add_(id, vec_, std::move(element_["metadata"]));
+        } else {
+            pending_.push_back({id, vec_, std::move(element_["metadata"])});
+        }
+    }
+};
+}
+
+json readJsonDatabase(std::istream& in, const JsonDatabaseStart& start, const JsonDatabaseAdd& add) {
+    for (bool stream : {true, false}) {
+        DatabaseSax sax(stream, start, add);
+        try {
+            if (!json::sax_parse(in, &sax)) {
+                throw std::runtime_error("Failed to parse database file (JSON error): " + sax.error);
+            }
+            sax.header.erase("vectors");
+            return std::move(sax.header);
+        } catch (const LateHeader&) {
+            // Read it again, holding the vectors back until the end
+            in.clear();
+            in.seekg(0);
+            if (!in) {
+                throw corrupted("\"dim\" or \"metric\" after \"vectors\" in a stream that can't be read again");
+            }
+        }
+    }
+    throw std::logic_error("unreachable");
+}
@@ -0,0 +1,35 @@
+#ifndef JSON_DATABASE_READER_H
+#define JSON_DATABASE_READER_H
+
+#include <istream>
+#include <functional>
+#include <vector>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+/*
+Reads a database in the JSON format of older versions (the one
+VectorDB::exportJson() writes) without building a DOM of the whole file.
+
+nlohmann's SAX parser hands over one token at a time. The fields other than
+"vectors" are small; they are collected into a json object, the header.
+Each element of "vectors" goes to add() as soon as its closing brace is
+read, with "vec" parsed straight into floats, so the extra memory is one
+vector and its metadata.
+
+start() gets the header before the first add() and may use its "dim" and
+"metric". nlohmann writes keys sorted, so those come before "vectors"; in a
+file where they don't, the vectors wait in a buffer until the end of the
+file (or, if one turns up after vectors were passed on, the file is read
+again that way).
+*/
+using JsonDatabaseStart = std::function<void(const json& header)>;
+using JsonDatabaseAdd = std::function<void(long long id, const std::vector<float>& vec, json metadata)>;
+
+// Returns the header. Throws std::runtime_error if 'in' is not valid JSON or
+// not laid out like a database, and passes on what the callbacks throw.
+json readJsonDatabase(std::istream& in, const JsonDatabaseStart& start, const JsonDatabaseAdd& add);
+
+#endif // JSON_DATABASE_READER_H
@@ -1,8 +1,14 @@
 #include "vectordb.h"
+#include "server.h"
+#include "client.h"
 #include <iostream>
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <memory>
+#include <csignal>
+#include <fstream>
+#include <tuple>
 
 // Helper function to parse a comma-separated vector string
 std::vector<float> parseVector(const std::string& s, int expectedDim) {
@@ -22,17 +28,39 @@ std::vector<float> parseVector(const std::string& s, int expectedDim) {
     return vec;
 }
 
+// The server of 'serve', stopped by SIGINT / SIGTERM
+VectorDBServer* runningServer = nullptr;
+
+void stopServer(int) {
+    if (runningServer) {
+        runningServer->stop();
+    }
+}
+
 // Helper to print usage instructions
 void printUsage(const std::string& progName) {
     std::cerr << "Usage: " << progName << " <db_path> <command> [args]" << std::endl;
     std::cerr << "Commands:" << std::endl;
-    std::cerr << "  init <dimension>                  - Initialize a new vector database." << std::endl;
-    std::cerr << "  add <vector> <metadata_json>      - Add a new vector. Vector is '1.0,2.0,3.0'. Metadata is '{\"key\": \"val\"}'." << std::endl;
+    std::cerr << "  init <dimension> [metric]         - Initialize a new vector database. Metric is l2 (default), ip or cosine." << std::endl;
+    std::cerr << "  add <vector> <metadata_json>      - Add a new vector, searchable right away. Vector is '1.0,2.0,3.0'. Metadata is '{\"key\": \"val\"}'." << std::endl;
     std::cerr << "  get <id>                          - Get a vector and its metadata by ID." << std::endl;
-    std::cerr << "  update <id> <vector> <metadata>   - Update a vector (requires rebuild)." << std::endl;
-    std::cerr << "  delete <id>                       - Delete a vector (requires rebuild)." << std::endl;
-    std::cerr << "  rebuild                         - Rebuild the HNSW index (REQUIRED after add/update/delete)." << std::endl;
-    std::cerr << "  search <k> <query_vector>         - Search for k-nearest neighbors." << std::endl;
+    std::cerr << "  update <id> <vector> <metadata>   - Update a vector, searchable at its new position right away." << std::endl;
+    std::cerr << "  delete <id>                       - Delete a vector, gone from search results right away." << std::endl;
+    std::cerr << "  rebuild [threads]                 - Rebuild the HNSW index from scratch. Default: one thread per core." << std::endl;
+    std::cerr << "  search <k> <query_vector> [ef] [filter_json]" << std::endl;
+    std::cerr << "                                    - Search for k-nearest neighbors. 'ef' is the search beam width (higher = better recall, slower, 0 = default)." << std::endl;
+    std::cerr << "                                      The filter limits results by metadata, e.g. '{\"tenant\": \"acme\", \"lang\": [\"en\", \"de\"], \"price\": {\"lt\": 20}}'." << std::endl;
+    std::cerr << "  search-batch <k> <queries_file> [ef] [threads]" << std::endl;
+    std::cerr << "                                    - Search for the queries in a file, one vector per line ('-' = stdin), on 'threads' threads (default: one per core)." << std::endl;
+    std::cerr << "  vacuum [min_deleted_ratio]        - Remove deleted vectors from the index if their share is at least min_deleted_ratio (default 0)." << std::endl;
+    std::cerr << "  set-ef <ef>                       - Set the database's default search beam width (0 = built-in default)." << std::endl;
+    std::cerr << "  create-index <field>              - Index a metadata field, so search filters on it don't read every vector's metadata." << std::endl;
+    std::cerr << "  drop-index <field>                - Stop indexing a metadata field." << std::endl;
+    std::cerr << "  import <json_file>                - Replace the contents with a JSON file (the format of older data files)." << std::endl;
+    std::cerr << "  export <json_file>                - Write the contents as JSON." << std::endl;
+    std::cerr << "  serve                             - Keep the database open and answer requests on the socket '<db_path>.sock'." << std::endl;
+    std::cerr << "                                      While it runs, get, search, add, update, delete and vacuum go through it; the other commands refuse." << std::endl;
+    std::cerr << "  stop                              - Stop the server of the database (it saves the database first)." << std::endl;
     std::cerr << std::endl;
 }
 
@@ -44,18 +72,31 @@ int main(int argc, char** argv) {
 
     std::string dbPath = argv[1];
     std::string command = argv[2];
-    VectorDB db(dbPath);
+    // Read-only commands map the index file instead of loading it, so they
+    // start instantly and share the page cache with other readers.
+    bool readOnly = (command == "get" || command == "search" || command == "search-batch");
+    VectorDB db(dbPath, readOnly ? OpenMode::ReadOnlyMapped : OpenMode::ReadWrite);
 
     try {
+        // A database with a server is only read and changed through it
+        std::unique_ptr<VectorDBClient> server = VectorDBClient::tryConnect(VectorDBServer::socketPath(dbPath));
+        bool servable = readOnly || command == "add" || command == "update" || command == "delete" || command == "vacuum" ||
+                        command == "stop";
+        if (server && !servable) {
+            std::cerr << "Error: '" << dbPath << "' is being served. Stop the server first: " << argv[0] << " " << dbPath << " stop" << std::endl;
+            return 1;
+        }
+
         // --- init ---
         if (command == "init") {
-            if (argc != 4) {
-                std::cerr << "Usage: " << argv[0] << " " << dbPath << " init <dimension>" << std::endl;
+            if (argc != 4 && argc != 5) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " init <dimension> [metric]" << std::endl;
                 return 1;
             }
             int dim = std::stoi(argv[3]);
-            db.init(dim);
-            std::cout << "Database initialized at '" << dbPath << "' with dimension " << dim << std::endl;
+            Metric metric = (argc == 5) ? metricFromString(argv[4]) : Metric::L2;
+            db.init(dim, metric);
+            std::cout << "Database initialized at '" << dbPath << "' with dimension " << dim << " and metric " << metricToString(metric) << std::endl;
         } 
         // --- add ---
         else if (command == "add") {
@@ -63,12 +104,17 @@ int main(int argc, char** argv) {
                 std::cerr << "Usage: " << argv[0] << " " << dbPath << " add <vector> <metadata_json>" << std::endl;
                 return 1;
             }
-            db.load(); // Load existing data first
-            std::vector<float> vec = parseVector(argv[3], db.getDimensions());
+            if (!server) {
+                db.load(); // Load existing data first
+            }
+            std::vector<float> vec = parseVector(argv[3], server ? server->getDimensions() : db.getDimensions());
             json metadata = json::parse(argv[4]);
-            long long id = db.addVector(vec, metadata);
-            db.save(); // Save after adding
-            std::cout << "Vector added with ID: " << id << ". Run 'rebuild' to index." << std::endl;
+            // Appended to the write-ahead log, no rewrite of the data file
+            long long id = server ? server->addVector(vec, metadata) : db.addVector(vec, metadata);
+            std::cout << "Vector added with ID: " << id << "." << std::endl;
+            if (!server && db.needsRebuild()) {
+                std::cout << "Run 'rebuild' to index pending changes." << std::endl;
+            }
         } 
         // --- get ---
         else if (command == "get") {
@@ -76,9 +122,11 @@ int main(int argc, char** argv) {
                 std::cerr << "Usage: " << argv[0] << " " << dbPath << " get <id>" << std::endl;
                 return 1;
             }
-            db.load();
+            if (!server) {
+                db.load();
+            }
             long long id = std::stoll(argv[3]);
-            auto result = db.getVector(id);
+            auto result = server ? server->getVector(id) : db.getVector(id);
             if (result.second) {
                 std::cout << "ID: " << result.first.id << std::endl;
                 std::cout << "Metadata: " << result.first.metadata.dump(2) << std::endl;
@@ -93,37 +141,168 @@ int main(int argc, char** argv) {
         } 
         // --- search ---
         else if (command == "search") {
-            if (argc != 5) {
-                std::cerr << "Usage: " << argv[0] << " " << dbPath << " search <k> <query_vector>" << std::endl;
+            if (argc < 5 || argc > 7) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " search <k> <query_vector> [ef] [filter_json]" << std::endl;
                 return 1;
             }
-            db.load();
+            if (!server) {
+                db.load();
+            }
             int k = std::stoi(argv[3]);
             
             // --- THIS IS THE FIX ---
             // The third argument was a copy-paste error and has been removed.
-            std::vector<float> query = parseVector(argv[4], db.getDimensions());
+            std::vector<float> query = parseVector(argv[4], server ? server->getDimensions() : db.getDimensions());
             // --- END FIX ---
 
-            auto results = db.search(query, k);
+            int ef = (argc >= 6) ? std::stoi(argv[5]) : 0;
+            json filter = (argc == 7) ? json::parse(argv[6]) : json();
+
+            auto results = server ? server->search(query, k, ef, filter) : db.search(query, k, ef, filter);
 
             std::cout << "Search results (ID, Distance):" << std::endl;
-            if (results.empty()) {
+            if (results.empty() && !filter.is_null()) {
+                std::cout << "No results match the filter." << std::endl;
+            } else if (results.empty()) {
                 std::cout << "No results found. Have you run 'rebuild'?" << std::endl;
             }
             for (const auto& pair : results) {
-                // We add std::sqrt here because the HNSW lib returns L2 SQUARED for performance
-                std::cout << "- ID: " << pair.first << ", Dist: " << std::sqrt(pair.second) << std::endl;
+                // search() already reports the distance in the database's metric
+                std::cout << "- ID: " << pair.first << ", Dist: " << pair.second << std::endl;
+            }
+        }
+        // --- search-batch ---
+        else if (command == "search-batch") {
+            if (argc < 5 || argc > 7) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " search-batch <k> <queries_file> [ef] [threads]" << std::endl;
+                return 1;
+            }
+            if (!server) {
+                db.load();
+            }
+            int k = std::stoi(argv[3]);
+            int ef = (argc >= 6) ? std::stoi(argv[5]) : 0;
+            int threads = (argc == 7) ? std::stoi(argv[6]) : 0;
+            int dim = server ? server->getDimensions() : db.getDimensions();
+
+            std::ifstream file;
+            std::string queriesPath = argv[4];
+            if (queriesPath != "-") {
+                file.open(queriesPath);
+                if (!file) {
+                    throw std::runtime_error("Could not open " + queriesPath);
+                }
+            }
+            std::istream& in = (queriesPath == "-") ? std::cin : file;
+            std::vector<float> queries;
+            size_t nq = 0;
+            std::string line;
+            while (std::getline(in, line)) {
+                if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+                std::vector<float> query = parseVector(line, dim);
+                queries.insert(queries.end(), query.begin(), query.end());
+                ++nq;
+            }
+
+            // A server searches on all of its cores
+            BatchSearchResults results = server ? server->searchBatch(queries.data(), nq, k, ef)
+                                                : db.searchBatch(queries.data(), nq, k, ef, threads);
+            std::cout << "Search results per query (ID, Distance):" << std::endl;
+            for (size_t q = 0; q < nq; ++q) {
+                std::cout << "Query " << q << ":";
+                for (int i = 0; i < k && results.id(q, i) >= 0; ++i) {
+                    std::cout << (i == 0 ? " " : ", ") << results.id(q, i) << " (" << results.distance(q, i) << ")";
+                }
+                std::cout << std::endl;
+            }
+        }
+        // --- set-ef ---
+        else if (command == "set-ef") {
+            if (argc != 4) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " set-ef <ef>" << std::endl;
+                return 1;
+            }
+            db.load();
+            db.setEfSearch(std::stoi(argv[3]));
+            db.save();
+            std::cout << "Default ef_search set to " << db.getEfSearch() << "." << std::endl;
+        }
+        // --- create-index / drop-index ---
+        else if (command == "create-index" || command == "drop-index") {
+            if (argc != 4) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " " << command << " <field>" << std::endl;
+                return 1;
+            }
+            db.load();
+            if (command == "create-index") {
+                db.createFieldIndex(argv[3]);
+            } else {
+                db.dropFieldIndex(argv[3]);
+            }
+            db.save();
+            std::cout << "Indexed metadata fields:";
+            for (const auto& field : db.getIndexedFields()) {
+                std::cout << " " << field;
+            }
+            std::cout << std::endl;
+        }
+        // --- import / export ---
+        else if (command == "import" || command == "export") {
+            if (argc != 4) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " " << command << " <json_file>" << std::endl;
+                return 1;
+            }
+            if (command == "import") {
+                db.importJson(argv[3]);
+                db.save();
+                std::cout << "Imported '" << argv[3] << "' into '" << dbPath << "'." << std::endl;
+            } else {
+                db.load();
+                db.exportJson(argv[3]);
+                std::cout << "Exported '" << dbPath << "' to '" << argv[3] << "'." << std::endl;
+            }
+        }
+        // --- vacuum ---
+        else if (command == "vacuum") {
+            if (argc != 3 && argc != 4) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " vacuum [min_deleted_ratio]" << std::endl;
+                return 1;
+            }
+            double min_ratio = (argc == 4) ? std::stod(argv[3]) : 0.0;
+            bool compacted;
+            if (server) {
+                // Searches go on meanwhile; the server saves the index later
+                double deleted_ratio;
+                std::tie(compacted, deleted_ratio) = server->compactIndex(min_ratio);
+                std::cout << "Deleted nodes in index: " << deleted_ratio * 100 << "%" << std::endl;
+            } else {
+                db.load();
+                std::cout << "Deleted nodes in index: " << db.getDeletedRatio() * 100 << "%" << std::endl;
+                compacted = db.compactIndex(min_ratio);
+                if (compacted) {
+                    db.save();
+                }
+            }
+            if (compacted) {
+                std::cout << "Index compacted." << std::endl;
+            } else {
+                std::cout << "Nothing to compact." << std::endl;
             }
         }
         // --- rebuild ---
         else if (command == "rebuild") {
+            if (argc != 3 && argc != 4) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " rebuild [threads]" << std::endl;
+                return 1;
+            }
+            int threads = (argc == 4) ? std::stoi(argv[3]) : 0;
             db.load();
             std::cout << "Rebuilding index..." << std::endl;
-            db.rebuildIndex();
+            db.rebuildIndex(threads);
+            db.save(); // Writes the index file too, so later commands don't rebuild
             std::cout << "Index rebuild complete." << std::endl;
-            // Note: We don't save the index, as it's purely in-memory.
-            // A production DB would save the index binary to indexFilePath
         }
         // --- delete ---
         else if (command == "delete") {
@@ -131,11 +310,15 @@ int main(int argc, char** argv) {
                 std::cerr << "Usage: " << argv[0] << " " << dbPath << " delete <id>" << std::endl;
                 return 1;
             }
-            db.load();
+            if (!server) {
+                db.load();
+            }
             long long id = std::stoll(argv[3]);
-            if (db.deleteVector(id)) {
-                db.save();
-                std::cout << "Vector " << id << " deleted. Run 'rebuild' to update index." << std::endl;
+            if (server ? server->deleteVector(id) : db.deleteVector(id)) {
+                std::cout << "Vector " << id << " deleted." << std::endl;
+                if (!server && db.needsRebuild()) {
+                    std::cout << "Run 'rebuild' to index pending changes." << std::endl;
+                }
             } else {
                 std::cerr << "Error: Vector with ID " << id << " not found." << std::endl;
             }
@@ -146,16 +329,52 @@ int main(int argc, char** argv) {
                 std::cerr << "Usage: " << argv[0] << " " << dbPath << " update <id> <vector> <metadata>" << std::endl;
                 return 1;
             }
-            db.load();
+            if (!server) {
+                db.load();
+            }
             long long id = std::stoll(argv[3]);
-            std::vector<float> vec = parseVector(argv[4], db.getDimensions());
+            std::vector<float> vec = parseVector(argv[4], server ? server->getDimensions() : db.getDimensions());
             json metadata = json::parse(argv[5]);
-            if (db.updateVector(id, vec, metadata)) {
-                db.save();
-                std::cout << "Vector " << id << " updated. Run 'rebuild' to update index." << std::endl;
+            if (server ? server->updateVector(id, vec, metadata) : db.updateVector(id, vec, metadata)) {
+                std::cout << "Vector " << id << " updated." << std::endl;
+                if (!server && db.needsRebuild()) {
+                    std::cout << "Run 'rebuild' to index pending changes." << std::endl;
+                }
             } else {
                  std::cerr << "Error: Vector with ID " << id << " not found." << std::endl;
             }
+        }
+        // --- serve / stop ---
+        else if (command == "serve") {
+            if (argc != 3) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " serve" << std::endl;
+                return 1;
+            }
+            db.load();
+            std::string socketPath = VectorDBServer::socketPath(dbPath);
+            VectorDBServer listener(db, socketPath);
+            runningServer = &listener;
+            std::signal(SIGINT, stopServer);
+            std::signal(SIGTERM, stopServer);
+            std::cout << "Serving '" << dbPath << "' on " << socketPath << "." << std::endl;
+            listener.run();
+            std::signal(SIGINT, SIG_DFL);
+            std::signal(SIGTERM, SIG_DFL);
+            runningServer = nullptr;
+            db.save();
+            std::cout << "Server stopped, database saved." << std::endl;
+        }
+        else if (command == "stop") {
+            if (argc != 3) {
+                std::cerr << "Usage: " << argv[0] << " " << dbPath << " stop" << std::endl;
+                return 1;
+            }
+            if (!server) {
+                std::cerr << "Error: '" << dbPath << "' is not being served." << std::endl;
+                return 1;
+            }
+            server->shutdown();
+            std::cout << "Server of '" << dbPath << "' is stopping." << std::endl;
         }
          else {
             std::cerr << "Unknown command: " << command << std::endl;
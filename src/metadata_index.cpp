@@ -0,0 +1,174 @@
+#include "metadata_index.h"
+#include <limits>
+#include <tuple>
+
+// --- MetadataIndex ---
+
+MetadataIndex::NumberKey::NumberKey(const json& number)
+    : value(number.get<double>()), type((uint8_t)number.type()),
+      bits(number.is_number_float() ? 0 : number.get<uint64_t>()) {}
+
+bool MetadataIndex::NumberKey::operator<(const NumberKey& other) const {
+    return std::tie(value, type, bits) < std::tie(other.value, other.type, other.bits);
+}
+
+json MetadataIndex::NumberKey::number() const {
+    switch ((json::value_t)type) {
+    case json::value_t::number_integer:
+        return (int64_t)bits;
+    case json::value_t::number_unsigned:
+        return bits;
+    default:
+        return value;
+    }
+}
+
+void MetadataIndex::addField(const std::string& field) {
+    fields_[field];
+}
+
+void MetadataIndex::removeField(const std::string& field) {
+    fields_.erase(field);
+}
+
+bool MetadataIndex::hasField(const std::string& field) const {
+    return fields_.count(field) != 0;
+}
+
+std::vector<std::string> MetadataIndex::fields() const {
+    std::vector<std::string> names;
+    for (const auto& [field, postings] : fields_) {
+        names.push_back(field);
+    }
+    return names;
+}
+
+void MetadataIndex::clear() {
+    for (auto& [field, postings] : fields_) {
+        postings = FieldPostings();
+    }
+}
+
+RoaringBitmap& MetadataIndex::postingsFor(FieldPostings& postings, const json& value) {
+    if (value.is_number()) {
+        return postings.numbers[NumberKey(value)];
+    }
+    if (value.is_primitive()) {
+        return postings.others[value.dump()];
+    }
+    return postings.composites.try_emplace(value.dump(), Composite{value, RoaringBitmap()}).first->second.labels;
+}
+
+void MetadataIndex::findPostings(const FieldPostings& postings, const json& value,
+                                 std::vector<const RoaringBitmap*>& matching) {
+    if (value.is_number()) {
+        // Equal doubles first, then as JSON compares them: an integer and a
+        // float by the double, two integers exactly
+        double v = value.get<double>();
+        for (auto it = postings.numbers.lower_bound(NumberKey(v)); it != postings.numbers.end() && it->first.value == v;
+             ++it) {
+            if (it->first.number() == value) {
+                matching.push_back(&it->second);
+            }
+        }
+    } else if (value.is_primitive()) {
+        auto it = postings.others.find(value.dump());
+        if (it != postings.others.end()) {
+            matching.push_back(&it->second);
+        }
+    } else {
+        // The text differs for equal values ([1] and [1.0]), so compare
+        for (const auto& [text, composite] : postings.composites) {
+            if (composite.value == value) {
+                matching.push_back(&composite.labels);
+            }
+        }
+    }
+}
+
+void MetadataIndex::insert(int label, const json& metadata) {
+    if (!metadata.is_object()) {
+        return;
+    }
+    for (auto& [field, postings] : fields_) {
+        auto value = metadata.find(field);
+        if (value == metadata.end()) {
+            continue;
+        }
+        postingsFor(postings, *value).add((uint32_t)label);
+    }
+}
+
+void MetadataIndex::erase(int label, const json& metadata) {
+    if (!metadata.is_object()) {
+        return;
+    }
+    // Drops label from lists[key], and the bitmap once it is empty
+    auto remove = [label](auto& lists, const auto& key) {
+        auto it = lists.find(key);
+        if (it != lists.end() && it->second.remove((uint32_t)label) && it->second.empty()) {
+            lists.erase(it);
+        }
+    };
+    for (auto& [field, postings] : fields_) {
+        auto value = metadata.find(field);
+        if (value == metadata.end()) {
+            continue;
+        }
+        if (value->is_number()) {
+            remove(postings.numbers, NumberKey(*value));
+        } else if (value->is_primitive()) {
+            remove(postings.others, value->dump());
+        } else {
+            auto it = postings.composites.find(value->dump());
+            if (it != postings.composites.end() && it->second.labels.remove((uint32_t)label) &&
+                it->second.labels.empty()) {
+                postings.composites.erase(it);
+            }
+        }
+    }
+}
+
+void MetadataIndex::lookup(const std::string& field, const json& condition, RoaringBitmap& out) const {
+    const FieldPostings& postings = fields_.at(field);
+    std::vector<const RoaringBitmap*> matching;
+
+    if (condition.is_array()) {
+        for (const auto& value : condition) {
+            findPostings(postings, value, matching);
+        }
+    } else if (condition.is_object()) {
+        // Numeric range: walk the ordered map from the lower bound
+        double lo = -std::numeric_limits<double>::infinity(), hi = std::numeric_limits<double>::infinity();
+        bool lo_inclusive = true, hi_inclusive = true;
+        for (const auto& [op, bound] : condition.items()) {
+            double b = bound.get<double>();
+            if ((op == "gt" || op == "gte") && (b > lo || (b == lo && op == "gt"))) {
+                lo = b;
+                lo_inclusive = (op == "gte");
+            } else if ((op == "lt" || op == "lte") && (b < hi || (b == hi && op == "lt"))) {
+                hi = b;
+                hi_inclusive = (op == "lte");
+            }
+        }
+        for (auto it = postings.numbers.lower_bound(NumberKey(lo)); it != postings.numbers.end(); ++it) {
+            double v = it->first.value;
+            if (v == lo && !lo_inclusive) {
+                continue;
+            }
+            if (v > hi || (v == hi && !hi_inclusive)) {
+                break;
+            }
+            matching.push_back(&it->second);
+        }
+    } else {
+        findPostings(postings, condition, matching);
+    }
+
+    if (matching.size() == 1) {
+        out |= *matching[0];
+    } else if (!matching.empty()) {
+        matching.push_back(&out);
+        out = RoaringBitmap::unionOf(matching);
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef METADATA_INDEX_H
+#define METADATA_INDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <cstdint>
+
+#include "hnsw.h"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+/*
+Inverted index over declared metadata fields.
+
+For every indexed field it keeps a postings bitmap of labels per value:
+numbers in an ordered map so ranges are a map walk, other scalars (strings,
+booleans, null) in a hash map keyed by their JSON text. Arrays and objects
+are kept with their value, which a one-of condition compares against each of
+them. Lookups match what JSON equality matches in a scan: integers exactly,
+an integer and a float by their double values. VectorDB keeps it in step
+with the labels of the HNSW index, so a filter turns into a RoaringBitmap
+without looking at the metadata.
+*/
+class MetadataIndex {
+public:
+    // Declares a field; the caller then re-inserts the existing vectors
+    void addField(const std::string& field);
+    void removeField(const std::string& field);
+    bool hasField(const std::string& field) const;
+    std::vector<std::string> fields() const;
+
+    // Drops all postings, keeps the declared fields
+    void clear();
+    // Adds / removes 'label' under the values 'metadata' has for the
+    // indexed fields. erase() must get the metadata insert() got.
+    void insert(int label, const json& metadata);
+    void erase(int label, const json& metadata);
+
+    // Adds to 'out' the labels whose value of the indexed 'field' satisfies
+    // 'condition' (equality, one-of or range, see matchesFilter()).
+    void lookup(const std::string& field, const json& condition, RoaringBitmap& out) const;
+
+private:
+    // A number as a postings key: ordered by its double value, which ranges
+    // compare, then by its exact value, so integers past 2^53 that round to
+    // the same double keep apart
+    struct NumberKey {
+        double value;
+        uint8_t type;  // The json::value_t
+        uint64_t bits; // The integer, 0 for a float
+
+        explicit NumberKey(const json& number);
+        // Sorts before every key with this value
+        explicit NumberKey(double value) : value(value), type(0), bits(0) {}
+        bool operator<(const NumberKey& other) const;
+        json number() const;
+    };
+    // An array or object under its JSON text, which equality doesn't go by
+    struct Composite {
+        json value;
+        RoaringBitmap labels;
+    };
+    struct FieldPostings {
+        std::map<NumberKey, RoaringBitmap> numbers;
+        std::unordered_map<std::string, RoaringBitmap> others;
+        std::unordered_map<std::string, Composite> composites;
+    };
+    std::map<std::string, FieldPostings> fields_;
+
+    static RoaringBitmap& postingsFor(FieldPostings& postings, const json& value);
+    // Appends the postings of the values equal to 'value'
+    static void findPostings(const FieldPostings& postings, const json& value,
+                             std::vector<const RoaringBitmap*>& matching);
+};
+
+#endif // METADATA_INDEX_H
@@ -0,0 +1,231 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+Wire format between VectorDBServer and VectorDBClient, over a Unix domain
+socket.
+
+Every message is a frame: uint32 payload length, then the payload. A request
+payload is an Op byte and its arguments, a reply payload a Status byte and
+the results (or, for Status::Error, the error message). Numbers are in native
+byte order, both ends run on the same host. A vector is a uint32 count and
+that many floats; a string is a uint32 length and the bytes. Metadata and
+filters are strings of JSON text, an empty filter meaning none.
+
+  Op        arguments                      results
+  Info      -                              uint32 dim, uint8 metric
+  Search    uint32 k, uint32 ef, query,    uint32 n, n x (int64 id, float distance)
+            filter
+  Get       int64 id                       uint8 found, then vector, metadata if found
+  Add       vector, metadata               int64 id
+  Update    int64 id, vector, metadata     uint8 found
+  Delete    int64 id                       uint8 found
+  Save      -                              -
+  Shutdown  -                              -
+  SearchBatch
+            uint32 k, uint32 ef,           uint32 nq, uint32 k, nq*k x int64 id,
+            uint32 nq, queries (a vector   nq*k x float distance (row-major, as
+            of nq rows)                    in BatchSearchResults)
+                                           nq * k is at most MAX_BATCH_RESULTS
+  Compact   double min_deleted_ratio       uint8 compacted, double deleted ratio
+                                           before
+*/
+namespace protocol {
+
+enum class Op : uint8_t { Info = 1, Search = 2, Get = 3, Add = 4, Update = 5, Delete = 6, Save = 7, Shutdown = 8,
+                          SearchBatch = 9, Compact = 10 };
+enum class Status : uint8_t { Ok = 0, Error = 1 };
+
+// A longer frame is garbage, not a message
+const uint32_t MAX_FRAME_BYTES = 1u << 28;
+// Most results (nq * k) a SearchBatch may ask for, so that the reply fits
+// in a frame
+const uint64_t MAX_BATCH_RESULTS = 1u << 24;
+
+// Address of the socket file at 'path'. Throws std::runtime_error if the
+// path is longer than a socket address holds.
+inline sockaddr_un socketAddress(const std::string& path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path '" + path + "' is too long (at most " +
+                                 std::to_string(sizeof(addr.sun_path) - 1) + " bytes).");
+    }
+    std::memcpy(addr.sun_path, path.data(), path.size());
+    return addr;
+}
+
+// A socket connected to the server at 'path', or -1 (errno says why)
+inline int connectSocket(const std::string& path) {
+    if (path.size() >= sizeof(sockaddr_un::sun_path)) {
+        errno = ENAMETOOLONG; // No server can listen there
+        return -1;
+    }
+    sockaddr_un addr = socketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        int error = errno;
+        ::close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+// Builds one frame; send() fills in the length
+class FrameWriter {
+public:
+    FrameWriter() : buf_(sizeof(uint32_t)) {}
+
+    void clear() {
+        buf_.resize(sizeof(uint32_t));
+    }
+    template <typename T>
+    void put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "put() copies bytes");
+        bytes(&value, sizeof(T));
+    }
+    void putFloats(const float* data, size_t n) {
+        put<uint32_t>((uint32_t)n);
+        bytes(data, n * sizeof(float));
+    }
+    void putString(const std::string& s) {
+        put<uint32_t>((uint32_t)s.size());
+        bytes(s.data(), s.size());
+    }
+
+    // Writes the frame in one go. Throws std::runtime_error if the peer is gone.
+    void send(int fd) {
+        uint32_t length = (uint32_t)(buf_.size() - sizeof(uint32_t));
+        std::memcpy(buf_.data(), &length, sizeof(length));
+        const uint8_t* p = buf_.data();
+        size_t left = buf_.size();
+        while (left > 0) {
+            ssize_t n = ::send(fd, p, left, SEND_FLAGS);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error(std::string("Failed to send over the socket: ") + std::strerror(errno));
+            }
+            p += n;
+            left -= n;
+        }
+    }
+
+private:
+    // A write to a closed socket fails with EPIPE instead of killing us
+#ifdef MSG_NOSIGNAL
+    static const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+    static const int SEND_FLAGS = 0;
+#endif
+
+    std::vector<uint8_t> buf_;
+
+    void bytes(const void* data, size_t n) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        buf_.insert(buf_.end(), p, p + n);
+    }
+};
+
+// Reads one frame, then its fields in order, throwing if they run out
+class FrameReader {
+public:
+    // Returns false if the peer closed the connection before a frame began.
+    // Throws std::runtime_error on a broken or oversized frame.
+    bool receive(int fd) {
+        uint32_t length;
+        if (!readAll(fd, &length, sizeof(length), true)) {
+            return false;
+        }
+        if (length > MAX_FRAME_BYTES) {
+            throw std::runtime_error("Frame of " + std::to_string(length) + " bytes is too large.");
+        }
+        buf_.resize(length);
+        readAll(fd, buf_.data(), length, false);
+        pos_ = 0;
+        return true;
+    }
+
+    template <typename T>
+    T get() {
+        static_assert(std::is_trivially_copyable<T>::value, "get() copies bytes");
+        T value;
+        bytes(&value, sizeof(T));
+        return value;
+    }
+    std::vector<float> getFloats() {
+        std::vector<float> v(count(sizeof(float)));
+        bytes(v.data(), v.size() * sizeof(float));
+        return v;
+    }
+    std::string getString() {
+        std::string s(count(1), '\0');
+        bytes(&s[0], s.size());
+        return s;
+    }
+
+private:
+    std::vector<uint8_t> buf_;
+    size_t pos_ = 0;
+
+    // An element count, checked against what is left before anything is allocated
+    size_t count(size_t element_bytes) {
+        size_t n = get<uint32_t>();
+        if ((buf_.size() - pos_) / element_bytes < n) {
+            throw std::runtime_error("Message is truncated.");
+        }
+        return n;
+    }
+    void bytes(void* out, size_t n) {
+        if (buf_.size() - pos_ < n) {
+            throw std::runtime_error("Message is truncated.");
+        }
+        std::memcpy(out, buf_.data() + pos_, n);
+        pos_ += n;
+    }
+
+    // False on end of stream before the first byte, if that is allowed
+    static bool readAll(int fd, void* data, size_t size, bool eof_ok) {
+        uint8_t* p = static_cast<uint8_t*>(data);
+        size_t got = 0;
+        while (got < size) {
+            ssize_t n = ::recv(fd, p + got, size - got, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error(std::string("Failed to receive over the socket: ") + std::strerror(errno));
+            }
+            if (n == 0) {
+                if (got == 0 && eof_ok) {
+                    return false;
+                }
+                throw std::runtime_error("Connection closed in the middle of a message.");
+            }
+            got += n;
+        }
+        return true;
+    }
+};
+
+} // namespace protocol
+
+#endif // PROTOCOL_H
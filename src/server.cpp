@@ -0,0 +1,286 @@
+#include "server.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+using protocol::Op;
+using protocol::Status;
+
+namespace {
+std::runtime_error socketError(const std::string& what, const std::string& path) {
+    return std::runtime_error("Failed to " + what + " socket " + path + ": " + std::strerror(errno));
+}
+
+json parseJson(const std::string& text) {
+    return text.empty() ? json() : json::parse(text);
+}
+
+// A listening socket at 'path'
+int listenOn(const std::string& path) {
+    sockaddr_un addr = protocol::socketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw socketError("create", path);
+    }
+    auto bindSocket = [&] {
+        return ::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+    };
+    bool bound = bindSocket();
+    if (!bound && errno == EADDRINUSE) {
+        // Left by a server that is gone, unless one still answers
+        int other = protocol::connectSocket(path);
+        if (other >= 0) {
+            ::close(other);
+            ::close(fd);
+            throw std::runtime_error("The database is already being served on " + path + ".");
+        }
+        ::unlink(path.c_str());
+        bound = bindSocket();
+    }
+    if (!bound || ::listen(fd, SOMAXCONN) != 0) {
+        std::runtime_error error = socketError(bound ? "listen on" : "bind", path);
+        ::close(fd);
+        throw error;
+    }
+    return fd;
+}
+}
+
+VectorDBServer::VectorDBServer(VectorDB& db, const std::string& socket_path)
+    : db_(db), socket_path_(socket_path), batch_threads_(std::max(resolveThreadCount(0) / 2, 1)) {
+    if (::pipe(wake_fds_) != 0) {
+        throw std::runtime_error(std::string("Failed to create a pipe: ") + std::strerror(errno));
+    }
+    // stop() must never block, however often it is called
+    ::fcntl(wake_fds_[1], F_SETFL, ::fcntl(wake_fds_[1], F_GETFL) | O_NONBLOCK);
+    db_.setSyncWrites(false);
+}
+
+VectorDBServer::~VectorDBServer() {
+    ::close(wake_fds_[0]);
+    ::close(wake_fds_[1]);
+}
+
+std::string VectorDBServer::socketPath(const std::string& db_path) {
+    return db_path + ".sock";
+}
+
+void VectorDBServer::stop() {
+    char byte = 0;
+    ssize_t rc = ::write(wake_fds_[1], &byte, 1);
+    (void)rc; // Full means a wakeup is pending already
+}
+
+void VectorDBServer::run() {
+    int listen_fd = listenOn(socket_path_);
+    pollfd fds[2] = {{listen_fd, POLLIN, 0}, {wake_fds_[0], POLLIN, 0}};
+    while (true) {
+        if (::poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue; // EINTR, or a client that gave up in the meantime
+        }
+        reapConnections();
+        connections_.emplace_back();
+        Connection& connection = connections_.back();
+        connection.fd = fd;
+        connection.thread = std::thread([this, &connection] { serveConnection(connection); });
+    }
+    ::close(listen_fd);
+    ::unlink(socket_path_.c_str());
+
+    // Wake the connections out of their reads; a request being handled
+    // still gets its reply
+    for (Connection& connection : connections_) {
+        ::shutdown(connection.fd, SHUT_RD);
+    }
+    for (Connection& connection : connections_) {
+        connection.thread.join();
+        ::close(connection.fd);
+    }
+    connections_.clear();
+}
+
+void VectorDBServer::reapConnections() {
+    for (auto it = connections_.begin(); it != connections_.end();) {
+        if (it->done) {
+            it->thread.join();
+            ::close(it->fd);
+            it = connections_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void VectorDBServer::serveConnection(Connection& connection) {
+    protocol::FrameReader request;
+    protocol::FrameWriter reply;
+    try {
+        while (request.receive(connection.fd)) {
+            reply.clear();
+            try {
+                handle(request, reply);
+            } catch (const std::exception& e) {
+                reply.clear();
+                reply.put(Status::Error);
+                reply.putString(e.what());
+            }
+            reply.send(connection.fd);
+        }
+    } catch (const std::exception&) {
+        // The client broke off or sent garbage; drop the connection
+    }
+    connection.done = true;
+}
+
+void VectorDBServer::handle(protocol::FrameReader& request, protocol::FrameWriter& reply) {
+    Op op = request.get<Op>();
+    switch (op) {
+    case Op::Info: {
+        std::shared_lock<std::shared_mutex> lock(db_lock_);
+        reply.put(Status::Ok);
+        reply.put<uint32_t>((uint32_t)db_.getDimensions());
+        reply.put<uint8_t>((uint8_t)db_.getMetric());
+        break;
+    }
+    case Op::Search: {
+        int k = (int)request.get<uint32_t>();
+        int ef = (int)request.get<uint32_t>();
+        std::vector<float> query = request.getFloats();
+        json filter = parseJson(request.getString());
+        if (k <= 0) {
+            throw std::invalid_argument("k must be positive.");
+        }
+        std::vector<std::pair<long long, float>> results;
+        {
+            std::shared_lock<std::shared_mutex> lock(db_lock_);
+            results = db_.search(query, k, ef, filter);
+        }
+        reply.put(Status::Ok);
+        reply.put<uint32_t>((uint32_t)results.size());
+        for (const auto& [id, distance] : results) {
+            reply.put<int64_t>(id);
+            reply.put<float>(distance);
+        }
+        break;
+    }
+    case Op::SearchBatch: {
+        int k = (int)request.get<uint32_t>();
+        int ef = (int)request.get<uint32_t>();
+        size_t nq = request.get<uint32_t>();
+        if (k <= 0) {
+            throw std::invalid_argument("k must be positive.");
+        }
+        if (nq * k > protocol::MAX_BATCH_RESULTS) {
+            throw std::invalid_argument("Batch of " + std::to_string(nq) + " x " + std::to_string(k) +
+                                        " results is too large (at most " +
+                                        std::to_string(protocol::MAX_BATCH_RESULTS) + ").");
+        }
+        std::vector<float> queries = request.getFloats();
+        BatchSearchResults results;
+        {
+            std::shared_lock<std::shared_mutex> lock(db_lock_);
+            if (queries.size() != nq * db_.getDimensions()) {
+                throw std::runtime_error("Query vector dimension mismatch.");
+            }
+            results = db_.searchBatch(queries.data(), nq, k, ef, batch_threads_);
+        }
+        reply.put(Status::Ok);
+        reply.put<uint32_t>((uint32_t)results.nq);
+        reply.put<uint32_t>((uint32_t)results.k);
+        for (long long id : results.ids) {
+            reply.put<int64_t>(id);
+        }
+        for (float distance : results.distances) {
+            reply.put<float>(distance);
+        }
+        break;
+    }
+    case Op::Get: {
+        long long id = request.get<int64_t>();
+        std::pair<VectorData, bool> result;
+        {
+            std::shared_lock<std::shared_mutex> lock(db_lock_);
+            result = db_.getVector(id);
+        }
+        reply.put(Status::Ok);
+        reply.put<uint8_t>(result.second);
+        if (result.second) {
+            reply.putFloats(result.first.vec.data(), result.first.vec.size());
+            reply.putString(result.first.metadata.dump());
+        }
+        break;
+    }
+    case Op::Add:
+    case Op::Update:
+    case Op::Delete: {
+        long long id = (op == Op::Add) ? 0 : request.get<int64_t>();
+        std::vector<float> vec;
+        json metadata;
+        if (op != Op::Delete) {
+            vec = request.getFloats();
+            metadata = parseJson(request.getString());
+        }
+        bool found = true;
+        {
+            std::unique_lock<std::shared_mutex> lock(db_lock_);
+            if (op == Op::Add) {
+                id = db_.addVector(vec, metadata);
+            } else if (op == Op::Update) {
+                found = db_.updateVector(id, vec, metadata);
+            } else {
+                found = db_.deleteVector(id);
+            }
+        }
+        // Outside the lock, so that writers queue up behind one fsync
+        db_.flush();
+        reply.put(Status::Ok);
+        if (op == Op::Add) {
+            reply.put<int64_t>(id);
+        } else {
+            reply.put<uint8_t>(found);
+        }
+        break;
+    }
+    case Op::Compact: {
+        double min_deleted_ratio = request.get<double>();
+        double deleted_ratio;
+        bool compacted;
+        {
+            // Searches go on, on the old graph; writes wait
+            std::shared_lock<std::shared_mutex> lock(db_lock_);
+            deleted_ratio = db_.getDeletedRatio();
+            compacted = db_.compactIndex(min_deleted_ratio);
+        }
+        reply.put(Status::Ok);
+        reply.put<uint8_t>(compacted);
+        reply.put<double>(deleted_ratio);
+        break;
+    }
+    case Op::Save: {
+        std::unique_lock<std::shared_mutex> lock(db_lock_);
+        db_.save();
+        reply.put(Status::Ok);
+        break;
+    }
+    case Op::Shutdown:
+        stop();
+        reply.put(Status::Ok);
+        break;
+    default:
+        throw std::runtime_error("Unknown request " + std::to_string((int)op) + ".");
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <string>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+
+#include "vectordb.h"
+#include "protocol.h"
+
+/*
+Serves a loaded VectorDB over a Unix domain socket (see protocol.h), so a
+query costs the search and a round trip rather than opening the database.
+
+Each connection gets a thread and may send any number of requests, one at a
+time. Searches and gets from different connections run in parallel, also
+with a compaction of the index; adds, updates, deletes and saves take the
+database exclusively. Their log records
+are synced after the database is released again, so the writes of several
+clients share fsyncs; a write is on disk before its reply is sent, as with
+VectorDB's default sync mode. A batch search runs on at most half of the
+database's search threads, so one client's batch leaves room for another's.
+*/
+class VectorDBServer {
+public:
+    // 'db' must be loaded (or initialized) and outlive the server. Turns off
+    // its sync mode, see above.
+    VectorDBServer(VectorDB& db, const std::string& socket_path);
+    ~VectorDBServer();
+    VectorDBServer(const VectorDBServer&) = delete;
+    VectorDBServer& operator=(const VectorDBServer&) = delete;
+
+    // The socket a database is served on by default: "<db_path>.sock"
+    static std::string socketPath(const std::string& db_path);
+
+    // Listens on the socket and serves until stop(), then closes the
+    // connections and removes the socket. A socket file left by a server
+    // that is gone is replaced; throws std::runtime_error if a server still
+    // answers on it, or if the socket can't be set up.
+    void run();
+    // Makes run() return. Safe to call from any thread and from a signal
+    // handler, also before run().
+    void stop();
+
+private:
+    struct Connection {
+        int fd;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    VectorDB& db_;
+    std::string socket_path_;
+    int wake_fds_[2]; // stop() writes to [1], run() polls [0]
+    int batch_threads_; // Most threads for one batch search
+
+    std::shared_mutex db_lock_; // Shared for reads, exclusive for changes
+    std::list<Connection> connections_; // Only touched by run()
+
+    void serveConnection(Connection& connection);
+    // Answers one request. Throws for a request that fails; the caller
+    // sends the error back.
+    void handle(protocol::FrameReader& request, protocol::FrameWriter& reply);
+    // Joins and closes the connections that ended
+    void reapConnections();
+};
+
+#endif // SERVER_H
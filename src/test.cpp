@@ -1,11 +1,26 @@
+// The tests are plain asserts, keep them active in Release builds too
+#undef NDEBUG
+
 
 #include "vectordb.h"
+#include "server.h"
+#include "client.h"
 #include <iostream>
 #include <cassert>     // For our simple tests
 #include <vector>
 #include <cmath>       // For std::abs
 #include <cstdio>      // For std::remove (to clean up)
 #include <filesystem>  // For checking file existence
+#include "distances.h" // For the distance kernel tests
+#include <random>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <set>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <chrono>
 
 // Helper for float comparison
 bool approx_equal(float a, float b) {
@@ -14,9 +29,10 @@ bool approx_equal(float a, float b) {
 
 // Helper to clean up test files
 void cleanup(const std::string& path) {
+    std::remove((path + ".vdb").c_str());
     std::remove((path + ".json").c_str());
-    // Note: .hnsw file is not saved by our current code, but good to have
     std::remove((path + ".hnsw").c_str()); 
+    std::remove((path + ".wal").c_str());
 }
 
 void run_test(const std::string& test_name, std::function<void()> test_func) {
@@ -112,10 +128,11 @@ int main() {
         bool deleted = db.deleteVector(1); // Delete vec1
         assert(deleted == true);
         
-        // Search *before* rebuild (index is stale)
+        // Search *before* rebuild: the delete is already in the index
         auto old_results = db.search({1.0f, 1.0f}, 1);
-        assert(old_results[0].first == 1); // Still finds old ID 1
-        std::cout << "  - Search on stale index ok." << std::endl;
+        assert(old_results.size() == 1 && old_results[0].first == 2);
+        assert(!db.needsRebuild());
+        std::cout << "  - Search right after delete ok." << std::endl;
 
         db.rebuildIndex(); // Rebuild with only vec2
         
@@ -134,11 +151,17 @@ int main() {
         bool updated = db.updateVector(2, {20.0f, 20.0f}, {{"name", "vec2_updated"}});
         assert(updated == true);
 
+        // The index follows the update without a rebuild
+        auto moved = db.search({20.1f, 20.1f}, 1);
+        assert(moved.size() == 1 && moved[0].first == 2);
+        assert(!db.needsRebuild());
+
         db.rebuildIndex(); // Rebuild with vec2 at new position
 
-        // Search near old position
+        // Search near old position: ID 2 is only found at its new one (the
+        // delete of ID 1 above was logged, so ID 2 is all there is)
         auto results1 = db.search({10.0f, 10.0f}, 1);
-        assert(results1.empty() || results1[0].first != 2); // Should not find ID 2
+        assert(results1.empty() || results1[0].first != 2 || std::abs(results1[0].second - std::sqrt(200.0f)) < 1e-3);
         std::cout << "  - Search old position ok." << std::endl;
         
         // Search near new position
@@ -154,6 +177,1579 @@ int main() {
     });
 
 
+    // --- Test 6: SIMD distance kernels agree with the scalar loop ---
+    run_test("Distance Kernels", [&]() {
+        for (int dim : {1, 2, 3, 7, 8, 15, 16, 17, 31, 32, 33, 100, 768, 1536}) {
+            std::vector<float> a(dim), b(dim);
+            for (int i = 0; i < dim; ++i) {
+                a[i] = std::sin(0.1f * i);
+                b[i] = std::cos(0.3f * i);
+            }
+            float expected = L2SqrScalar(a.data(), b.data(), dim);
+            for (const auto& kernel : getAvailableL2SqrKernels()) {
+                float got = kernel.func(a.data(), b.data(), dim);
+                assert(std::abs(got - expected) <= 1e-4f * std::max(1.0f, expected));
+            }
+            assert(std::abs(HNSW::L2Sqr(a.data(), b.data(), dim) - expected) <= 1e-4f * std::max(1.0f, expected));
+
+            float expected_ip = InnerProductDistanceScalar(a.data(), b.data(), dim);
+            for (const auto& kernel : getAvailableInnerProductKernels()) {
+                float got = kernel.func(a.data(), b.data(), dim);
+                assert(std::abs(got - expected_ip) <= 1e-4f * std::max(1.0f, std::abs(expected_ip)));
+            }
+        }
+        std::cout << "  - " << getAvailableL2SqrKernels().size() << " kernels checked, dispatcher uses " << getDistanceSimdLevel() << "." << std::endl;
+    });
+
+
+    // --- Test 7: Inner product and cosine metrics ---
+    run_test("Metrics", [&]() {
+        const std::string metric_db_path = "./test_metric_db";
+        cleanup(metric_db_path);
+        {
+            VectorDB db(metric_db_path);
+            db.init(2, Metric::Cosine);
+            db.addVector({10.0f, 0.0f}, {{"name", "east"}});
+            db.addVector({0.0f, 0.5f}, {{"name", "north"}});
+            db.addVector({-3.0f, -3.0f}, {{"name", "south_west"}});
+            db.save();
+        }
+        {
+            VectorDB db(metric_db_path);
+            db.load(); // The metric comes back from the file
+            assert(db.getMetric() == Metric::Cosine);
+
+            // Length does not matter for cosine, only direction
+            auto results = db.search({0.0f, 100.0f}, 3);
+            assert(results.size() == 3);
+            assert(results[0].first == 2);
+            assert(approx_equal(results[0].second, 0.0f)); // same direction
+            assert(results[2].first == 3);
+            std::cout << "  - cosine ok." << std::endl;
+        }
+        cleanup(metric_db_path);
+
+        {
+            VectorDB db(metric_db_path);
+            db.init(2, Metric::InnerProduct);
+            db.addVector({1.0f, 0.0f}, {});
+            db.addVector({3.0f, 0.0f}, {});
+            db.rebuildIndex();
+
+            // Larger dot product == closer
+            auto results = db.search({1.0f, 0.0f}, 2);
+            assert(results.size() == 2);
+            assert(results[0].first == 2);
+            assert(approx_equal(results[0].second, 1.0f - 3.0f));
+            std::cout << "  - inner product ok." << std::endl;
+        }
+        cleanup(metric_db_path);
+
+        {
+            VectorDB db(metric_db_path);
+            db.init(2); // l2 by default
+            db.addVector({3.0f, 4.0f}, {});
+            db.rebuildIndex();
+            auto results = db.search({0.0f, 0.0f}, 1);
+            assert(approx_equal(results[0].second, 5.0f)); // real distance, not squared
+            std::cout << "  - l2 ok." << std::endl;
+        }
+        cleanup(metric_db_path);
+    });
+
+
+    // --- Test 8: Visited list pool (epoch reset and wrap-around) ---
+    run_test("Visited List Pool", [&]() {
+        VisitedListPool pool(1, 4);
+        // Run past the 16-bit epoch wrap-around; a stale tag must never look visited
+        for (int i = 0; i < 70000; ++i) {
+            std::unique_ptr<VisitedList> list = pool.getFreeVisitedList(4);
+            assert(!list->isVisited(i % 4));
+            list->markVisited(i % 4);
+            assert(list->isVisited(i % 4));
+            pool.releaseVisitedList(std::move(list));
+        }
+        // Growing the graph grows the list
+        std::unique_ptr<VisitedList> list = pool.getFreeVisitedList(10);
+        assert(list->mass.size() >= 10 && !list->isVisited(9));
+        std::cout << "  - epoch reset ok." << std::endl;
+    });
+
+
+    // --- Test 9: HNSW flat storage ---
+    run_test("HNSW Storage", [&]() {
+        const int n = 2000, dim = 16;
+        std::mt19937 rng(123);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(n * dim);
+        for (auto& x : data) x = uniform(rng);
+
+        HNSW index(dim, n);
+        for (int i = 0; i < n; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+        assert(index.getCurrentElementCount() == n);
+
+        // Every reported distance must match the vector stored for that label
+        for (int i = 0; i < n; i += 7) {
+            const float* query = data.data() + i * dim;
+            auto result = index.searchKnn(query, 10);
+            assert(result.size() == 10);
+            while (!result.empty()) {
+                int label = result.top().second;
+                assert(approx_equal(result.top().first, L2SqrScalar(query, data.data() + label * dim, dim)));
+                result.pop();
+            }
+        }
+        std::cout << "  - stored vectors and labels ok." << std::endl;
+
+        // The storage is sized up front; one more point does not fit
+        bool threw = false;
+        try {
+            index.addPoint(data.data(), n);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        std::cout << "  - capacity check ok." << std::endl;
+
+        // A damaged file throws on load instead of sending a search out of
+        // bounds: an entry point, level, link count or neighbor out of range
+        std::stringstream saved;
+        index.saveIndex(saved);
+        const std::string file = saved.str();
+        HNSWFileHeader header;
+        std::memcpy(&header, file.data(), sizeof(header));
+        auto damaged = [&](size_t offset, int32_t value) {
+            std::string copy = file;
+            std::memcpy(&copy[offset], &value, sizeof(value));
+            std::stringstream in(copy);
+            try {
+                HNSW::loadIndex(in);
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+            return false;
+        };
+        size_t node_links = header.offset_level0_links + 5 * (1 + header.M_max0) * sizeof(int);
+        assert(!damaged(node_links, 1)); // Still a valid graph
+        assert(damaged(offsetof(HNSWFileHeader, enter_point), n));
+        assert(damaged(offsetof(HNSWFileHeader, max_level), header.max_level + 1));
+        assert(damaged(header.offset_levels + 5 * sizeof(int), header.max_level + 1));
+        assert(damaged(header.offset_labels + 5 * sizeof(int), -1));
+        assert(damaged(node_links, header.M_max0 + 1));
+        assert(damaged(node_links + sizeof(int), n));
+        std::cout << "  - damaged file check ok." << std::endl;
+    });
+
+
+    // --- Test 10: Label -> ID mapping survives changes without a rebuild ---
+    run_test("Stable Label Mapping", [&]() {
+        const std::string mapping_db_path = "./test_mapping_db";
+        cleanup(mapping_db_path);
+        VectorDB db(mapping_db_path);
+        db.init(2);
+        db.addVector({1.0f, 1.0f}, {});
+        db.addVector({5.0f, 5.0f}, {});
+        db.addVector({9.0f, 9.0f}, {});
+        db.rebuildIndex();
+
+        // Deleting ID 1 must not shift the labels of IDs 2 and 3
+        db.deleteVector(1);
+        db.addVector({20.0f, 20.0f}, {}); // not indexed until the next rebuild
+        auto results = db.search({5.0f, 5.0f}, 1);
+        assert(results.size() == 1 && results[0].first == 2);
+        results = db.search({9.0f, 9.0f}, 1);
+        assert(results.size() == 1 && results[0].first == 3);
+        std::cout << "  - labels stable after delete/add ok." << std::endl;
+        cleanup(mapping_db_path);
+    });
+
+
+    // --- Test 11: Index file is saved, reused, and ignored when stale ---
+    run_test("Index File", [&]() {
+        const std::string index_db_path = "./test_index_db";
+        cleanup(index_db_path);
+        {
+            VectorDB db(index_db_path);
+            db.init(2);
+            db.addVector({1.0f, 1.0f}, {});
+            db.addVector({5.0f, 5.0f}, {});
+            db.rebuildIndex();
+            db.save();
+        }
+        assert(std::filesystem::exists(index_db_path + ".hnsw"));
+        std::filesystem::copy_file(index_db_path + ".hnsw", index_db_path + ".hnsw.old");
+
+        {
+            VectorDB db(index_db_path);
+            db.load(); // Reuses the index file
+            auto results = db.search({5.0f, 5.0f}, 2);
+            assert(results.size() == 2 && results[0].first == 2 && results[1].first == 1);
+            std::cout << "  - index reused ok." << std::endl;
+
+            db.addVector({9.0f, 9.0f}, {}); // Goes straight into the index
+            db.save(); // So the index is still in sync and gets written
+            assert(!db.needsRebuild());
+            assert(std::filesystem::exists(index_db_path + ".hnsw"));
+        }
+
+        // Put the old index back: its generation no longer matches the data
+        std::filesystem::rename(index_db_path + ".hnsw.old", index_db_path + ".hnsw");
+        {
+            VectorDB db(index_db_path);
+            db.load(); // Must rebuild instead of trusting the stale index
+            auto results = db.search({9.0f, 9.0f}, 1);
+            assert(results.size() == 1 && results[0].first == 3);
+            std::cout << "  - stale index rebuilt ok." << std::endl;
+        }
+        cleanup(index_db_path);
+        {
+            // The vectors are written once, into the data file; the index
+            // file only has the graph
+            VectorDB db(index_db_path);
+            db.init(256);
+            std::vector<float> vec(256, 1.0f);
+            for (int i = 0; i < 100; ++i) {
+                vec[0] = (float)i;
+                db.addVector(vec, {});
+            }
+            db.save();
+            uintmax_t vector_bytes = 100 * 256 * sizeof(float);
+            assert(std::filesystem::file_size(index_db_path + ".vdb") > vector_bytes);
+            assert(std::filesystem::file_size(index_db_path + ".hnsw") < vector_bytes / 2);
+        }
+        {
+            VectorDB db(index_db_path);
+            db.load();
+            assert(!db.needsRebuild());
+            auto results = db.search(std::vector<float>(256, 1.0f), 1);
+            assert(results.size() == 1 && results[0].first == 2);
+            std::cout << "  - index file without vectors ok." << std::endl;
+        }
+        cleanup(index_db_path);
+    });
+
+
+    // --- Test 12: Read-only memory-mapped open mode ---
+    run_test("Mapped Read-Only", [&]() {
+        const std::string mapped_db_path = "./test_mapped_db";
+        cleanup(mapped_db_path);
+        {
+            VectorDB db(mapped_db_path);
+            db.init(2);
+            db.addVector({1.0f, 1.0f}, {{"name", "a"}});
+            db.addVector({5.0f, 5.0f}, {{"name", "b"}});
+            db.rebuildIndex();
+            db.save();
+        }
+        {
+            VectorDB db(mapped_db_path, OpenMode::ReadOnlyMapped, true);
+            db.load();
+            assert(db.isIndexMapped());
+            auto results = db.search({5.0f, 5.0f}, 2);
+            assert(results.size() == 2 && results[0].first == 2 && results[1].first == 1);
+
+            // Vectors and metadata both come from the data file
+            auto res = db.getVector(1);
+            assert(res.second && res.first.metadata["name"] == "a");
+            assert(res.first.vec.size() == 2 && approx_equal(res.first.vec[1], 1.0f));
+
+            std::vector<std::function<void()>> changes = {
+                [&] { db.addVector({2.0f, 2.0f}, {}); },
+                [&] { db.createFieldIndex("name"); },
+                [&] { db.dropFieldIndex("name"); },
+            };
+            for (const auto& change : changes) {
+                bool threw = false;
+                try {
+                    change();
+                } catch (const std::runtime_error&) {
+                    threw = true;
+                }
+                assert(threw);
+            }
+            std::cout << "  - mapped search and get ok." << std::endl;
+        }
+        {
+            // Data changed and no index file: falls back to an in-memory index
+            VectorDB db(mapped_db_path);
+            db.load();
+            db.addVector({9.0f, 9.0f}, {});
+            db.save();
+            std::filesystem::remove(mapped_db_path + ".hnsw");
+        }
+        {
+            VectorDB db(mapped_db_path, OpenMode::ReadOnlyMapped);
+            db.load();
+            assert(!db.isIndexMapped());
+            auto results = db.search({9.0f, 9.0f}, 1);
+            assert(results.size() == 1 && results[0].first == 3);
+            assert(!std::filesystem::exists(mapped_db_path + ".hnsw")); // read-only never writes
+            std::cout << "  - stale index fallback ok." << std::endl;
+        }
+        cleanup(mapped_db_path);
+        {
+            // Cosine rows are stored normalized; a delete leaves a free slot
+            VectorDB db(mapped_db_path);
+            db.init(2, Metric::Cosine);
+            db.addVector({3.0f, 4.0f}, {});
+            db.addVector({-2.0f, 0.0f}, {});
+            db.addVector({0.0f, 5.0f}, {});
+            db.deleteVector(1);
+            db.save();
+        }
+        {
+            VectorDB db(mapped_db_path, OpenMode::ReadOnlyMapped);
+            db.load();
+            assert(db.isIndexMapped());
+            auto results = db.search({0.0f, 1.0f}, 2);
+            assert(results.size() == 2 && results[0].first == 3 && results[1].first == 2);
+            auto res = db.getVector(3);
+            assert(res.second && approx_equal(res.first.vec[0], 0.0f) && approx_equal(res.first.vec[1], 5.0f));
+            assert(!db.getVector(1).second);
+            std::cout << "  - mapped cosine rows with a free slot ok." << std::endl;
+        }
+        cleanup(mapped_db_path);
+    });
+
+
+    // --- Test 13: Parallel bulk build ---
+    run_test("Parallel Build", [&]() {
+        const int n = 2000, dim = 16;
+        std::mt19937 rng(321);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(n * dim);
+        for (auto& x : data) x = uniform(rng);
+        std::vector<int> labels(n);
+        for (int i = 0; i < n; ++i) labels[i] = i;
+
+        HNSW index(dim, n);
+        index.addPoints(data.data(), labels.data(), n, 4);
+        assert(index.getCurrentElementCount() == n);
+
+        // Every reported distance must match the vector stored for that label
+        for (int i = 0; i < n; i += 5) {
+            const float* query = data.data() + i * dim;
+            auto result = index.searchKnn(query, 10);
+            assert(result.size() == 10);
+            while (!result.empty()) {
+                int label = result.top().second;
+                assert(approx_equal(result.top().first, L2SqrScalar(query, data.data() + label * dim, dim)));
+                result.pop();
+            }
+        }
+        std::cout << "  - 4-thread build ok." << std::endl;
+    });
+
+
+    // --- Test 14: Searches run alongside inserts ---
+    run_test("Concurrent Search", [&]() {
+        const int n = 2000, dim = 16;
+        std::mt19937 rng(99);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(n * dim);
+        for (auto& x : data) x = uniform(rng);
+
+        HNSW index(dim, n);
+        for (int i = 0; i < n / 2; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+
+        std::atomic<bool> bad_result{false};
+        std::vector<std::thread> writers;
+        for (int w = 0; w < 2; ++w) {
+            writers.emplace_back([&, w]() {
+                for (int i = n / 2 + w; i < n; i += 2) {
+                    index.addPoint(data.data() + i * dim, i);
+                }
+            });
+        }
+        // The third reader scans every node, as far as the inserts got
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 3; ++t) {
+            readers.emplace_back([&, t]() {
+                for (int i = t; i < n; i += 3) {
+                    const float* query = data.data() + i * dim;
+                    auto result = (t == 2) ? index.searchKnnBruteForce(query, 5) : index.searchKnn(query, 5);
+                    while (!result.empty()) {
+                        int label = result.top().second;
+                        if (label < 0 || label >= n ||
+                            !approx_equal(result.top().first, L2SqrScalar(query, data.data() + label * dim, dim))) {
+                            bad_result = true;
+                        }
+                        result.pop();
+                    }
+                }
+            });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        for (auto& reader : readers) {
+            reader.join();
+        }
+        assert(!bad_result);
+        assert(index.getCurrentElementCount() == n);
+        std::cout << "  - 3 readers + 2 writers ok." << std::endl;
+    });
+
+
+    // --- Test 15: ef_search is separate from k ---
+    run_test("ef_search", [&]() {
+        const int n = 2000, dim = 16, k = 10;
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(n * dim);
+        for (auto& x : data) x = uniform(rng);
+
+        HNSW index(dim, n);
+        for (int i = 0; i < n; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+
+        // Recall@k over queries that are perturbed copies of stored points
+        auto recall = [&](int ef) {
+            int found = 0, total = 0;
+            for (int q = 0; q < 100; ++q) {
+                std::vector<float> query(data.begin() + q * dim, data.begin() + (q + 1) * dim);
+                for (auto& x : query) x += 0.05f * uniform(rng);
+                std::vector<std::pair<float, int>> exact;
+                for (int i = 0; i < n; ++i) {
+                    exact.push_back({L2SqrScalar(query.data(), data.data() + i * dim, dim), i});
+                }
+                std::partial_sort(exact.begin(), exact.begin() + k, exact.end());
+                auto result = index.searchKnn(query.data(), k, ef);
+                assert((int)result.size() == k);
+                while (!result.empty()) {
+                    for (int j = 0; j < k; ++j) {
+                        if (exact[j].second == result.top().second) found++;
+                    }
+                    result.pop();
+                }
+                total += k;
+            }
+            return (double)found / total;
+        };
+        double narrow = recall(k);
+        double wide = recall(200);
+        std::cout << "  - recall@10: ef=10 " << narrow << ", ef=200 " << wide << std::endl;
+        assert(wide >= narrow && wide > 0.95);
+
+        // The beam is never narrower than k
+        assert((int)index.searchKnn(data.data(), 50, 1).size() == 50);
+
+        // The database default is saved with the data
+        const std::string ef_db_path = "./test_ef_db";
+        cleanup(ef_db_path);
+        {
+            VectorDB db(ef_db_path);
+            db.init(2);
+            db.addVector({1.0f, 1.0f}, {});
+            db.addVector({5.0f, 5.0f}, {});
+            db.rebuildIndex();
+            db.setEfSearch(64);
+            db.save();
+        }
+        {
+            VectorDB db(ef_db_path);
+            db.load();
+            assert(db.getEfSearch() == 64);
+            auto results = db.search({5.0f, 5.0f}, 1, 8); // per-query override
+            assert(results.size() == 1 && results[0].first == 2);
+        }
+        cleanup(ef_db_path);
+        std::cout << "  - default saved, per-query override ok." << std::endl;
+    });
+
+
+    // --- Test 16: addVector inserts into the live index ---
+    run_test("Incremental Add", [&]() {
+        const std::string add_db_path = "./test_add_db";
+        cleanup(add_db_path);
+        VectorDB db(add_db_path);
+        db.init(2); // Empty index, capacity 1
+        for (int i = 0; i < 100; ++i) {
+            db.addVector({(float)i, (float)i}, {});
+            // Searchable right away, no rebuild
+            auto results = db.search({(float)i, (float)i}, 1);
+            assert(results.size() == 1 && results[0].first == i + 1);
+        }
+        assert(!db.needsRebuild());
+        db.save();
+
+        VectorDB reopened(add_db_path);
+        reopened.load(); // Reuses the index written by save()
+        auto results = reopened.search({50.0f, 50.0f}, 3);
+        assert(results.size() == 3 && results[0].first == 51);
+        cleanup(add_db_path);
+        std::cout << "  - 100 adds searchable without rebuild ok." << std::endl;
+    });
+
+
+    // --- Test 17: Tombstone deletes and slot reuse ---
+    run_test("Tombstone Delete", [&]() {
+        const int n = 1000, dim = 8;
+        std::mt19937 rng(5);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(2 * n * dim);
+        for (auto& x : data) x = uniform(rng);
+
+        HNSW index(dim, n);
+        for (int i = 0; i < n; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+        // Delete every even label: never returned, still routed through
+        for (int i = 0; i < n; i += 2) {
+            index.markDelete(i);
+        }
+        assert(index.getDeletedCount() == n / 2);
+        for (int i = 0; i < n; i += 3) {
+            auto result = index.searchKnn(data.data() + i * dim, 10, 100);
+            assert(result.size() == 10);
+            while (!result.empty()) {
+                assert(result.top().second % 2 == 1);
+                result.pop();
+            }
+        }
+        std::cout << "  - deleted labels never returned ok." << std::endl;
+
+        // New points fill the deleted slots instead of growing the index
+        for (int i = n; i < n + n / 2; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+        assert(index.getCurrentElementCount() == n && index.getDeletedCount() == 0);
+        int found_self = 0;
+        for (int i = n; i < n + n / 2; i += 5) {
+            auto result = index.searchKnn(data.data() + i * dim, 1, 100);
+            if (result.size() == 1 && result.top().second == i) found_self++;
+        }
+        assert(found_self >= (n / 2 / 5) * 9 / 10);
+        std::cout << "  - slots reused, new points found ok." << std::endl;
+
+        // Through VectorDB: the delete survives save/load and labels are reused
+        const std::string delete_db_path = "./test_delete_db";
+        cleanup(delete_db_path);
+        {
+            VectorDB db(delete_db_path);
+            db.init(2);
+            db.addVector({1.0f, 1.0f}, {});
+            db.addVector({5.0f, 5.0f}, {});
+            db.addVector({9.0f, 9.0f}, {});
+            db.deleteVector(2);
+            db.save();
+        }
+        {
+            VectorDB db(delete_db_path, OpenMode::ReadOnlyMapped);
+            db.load();
+            assert(db.isIndexMapped());
+            auto results = db.search({5.0f, 5.0f}, 3);
+            assert(results.size() == 2 && results[0].first != 2);
+        }
+        {
+            VectorDB db(delete_db_path);
+            db.load();
+            auto results = db.search({5.0f, 5.0f}, 3);
+            assert(results.size() == 2 && results[0].first != 2 && results[1].first != 2);
+            db.addVector({5.0f, 5.1f}, {}); // ID 4 takes the freed slot
+            results = db.search({5.0f, 5.0f}, 1);
+            assert(results.size() == 1 && results[0].first == 4);
+        }
+        {
+            // ID 4 is only in the write-ahead log, which the index file
+            // doesn't have, so it is not mapped
+            VectorDB db(delete_db_path, OpenMode::ReadOnlyMapped);
+            db.load();
+            assert(!db.isIndexMapped());
+            auto results = db.search({5.0f, 5.0f}, 3);
+            assert(results.size() == 3 && results[0].first == 4);
+        }
+        cleanup(delete_db_path);
+        std::cout << "  - VectorDB delete, save and reuse ok." << std::endl;
+    });
+
+
+    // --- Test 18: In-place update repairs the graph ---
+    run_test("Update Repair", [&]() {
+        const int n = 2000, dim = 16, k = 10;
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(n * dim);
+        for (auto& x : data) x = uniform(rng);
+
+        HNSW index(dim, n);
+        for (int i = 0; i < n; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+        // Re-embed 10% of the points
+        for (int i = 0; i < n; i += 10) {
+            for (int d = 0; d < dim; ++d) data[i * dim + d] = uniform(rng);
+            index.updatePoint(i, data.data() + i * dim);
+        }
+        assert(index.getCurrentElementCount() == n);
+
+        // Moved points are found at their new position, and recall holds
+        int found = 0, total = 0;
+        for (int q = 0; q < n; q += 10) {
+            const float* query = data.data() + q * dim;
+            std::vector<std::pair<float, int>> exact;
+            for (int i = 0; i < n; ++i) {
+                exact.push_back({L2SqrScalar(query, data.data() + i * dim, dim), i});
+            }
+            std::partial_sort(exact.begin(), exact.begin() + k, exact.end());
+            auto result = index.searchKnn(query, k, 100);
+            while (!result.empty()) {
+                assert(approx_equal(result.top().first, L2SqrScalar(query, data.data() + result.top().second * dim, dim)));
+                for (int j = 0; j < k; ++j) {
+                    if (exact[j].second == result.top().second) found++;
+                }
+                result.pop();
+            }
+            total += k;
+        }
+        std::cout << "  - recall@10 after updates: " << (double)found / total << std::endl;
+        assert((double)found / total > 0.95);
+    });
+
+
+    // --- Test 19: Compaction while searches run ---
+    run_test("Compaction", [&]() {
+        const int n = 2000, dim = 16, k = 10;
+        std::mt19937 rng(17);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(n * dim);
+        for (auto& x : data) x = uniform(rng);
+
+        HNSW index(dim, n);
+        for (int i = 0; i < n; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+        for (int i = 0; i < n; ++i) {
+            if (i % 5 < 2) index.markDelete(i); // 40%
+        }
+        assert(approx_equal((float)index.getDeletedRatio(), 0.4f));
+
+        // Searches keep running (and stay correct) while it compacts
+        std::atomic<bool> done{false}, bad_result{false};
+        std::thread reader([&]() {
+            int q = 0;
+            do {
+                q = (q + 1) % n;
+                auto result = index.searchKnn(data.data() + q * dim, k);
+                while (!result.empty()) {
+                    int label = result.top().second;
+                    if (label % 5 < 2 || !approx_equal(result.top().first, L2SqrScalar(data.data() + q * dim, data.data() + label * dim, dim))) {
+                        bad_result = true;
+                    }
+                    result.pop();
+                }
+            } while (!done);
+        });
+        index.compact();
+        done = true;
+        reader.join();
+        assert(!bad_result);
+        assert(index.getCurrentElementCount() == n * 3 / 5 && index.getDeletedCount() == 0);
+        assert(index.getDeletedRatio() == 0.0);
+        assert(index.getMaxElements() > n * 3 / 5); // Headroom for new adds
+
+        // Recall on the survivors
+        int found = 0, total = 0;
+        for (int q = 2; q < n; q += 20) {
+            const float* query = data.data() + q * dim;
+            std::vector<std::pair<float, int>> exact;
+            for (int i = 0; i < n; ++i) {
+                if (i % 5 >= 2) exact.push_back({L2SqrScalar(query, data.data() + i * dim, dim), i});
+            }
+            std::partial_sort(exact.begin(), exact.begin() + k, exact.end());
+            auto result = index.searchKnn(query, k, 100);
+            while (!result.empty()) {
+                for (int j = 0; j < k; ++j) {
+                    if (exact[j].second == result.top().second) found++;
+                }
+                result.pop();
+            }
+            total += k;
+        }
+        std::cout << "  - recall@10 after compaction: " << (double)found / total << std::endl;
+        assert((double)found / total > 0.95);
+
+        // Through VectorDB, and the compacted index is reused on load
+        const std::string vacuum_db_path = "./test_vacuum_db";
+        cleanup(vacuum_db_path);
+        {
+            VectorDB db(vacuum_db_path);
+            db.init(2);
+            for (int i = 0; i < 10; ++i) db.addVector({(float)i, (float)i}, {});
+            for (long long id = 1; id <= 5; ++id) db.deleteVector(id);
+            assert(approx_equal((float)db.getDeletedRatio(), 0.5f));
+            assert(!db.compactIndex(0.6)); // Below the threshold
+            assert(db.compactIndex(0.5));
+            assert(db.getDeletedRatio() == 0.0);
+            db.addVector({2.0f, 2.0f}, {}); // ID 11, grows the shrunk index
+            db.save();
+        }
+        {
+            VectorDB db(vacuum_db_path);
+            db.load();
+            assert(std::filesystem::exists(vacuum_db_path + ".hnsw"));
+            auto results = db.search({2.0f, 2.0f}, 2);
+            assert(results.size() == 2 && results[0].first == 11 && results[1].first == 6);
+        }
+        cleanup(vacuum_db_path);
+        std::cout << "  - VectorDB vacuum ok." << std::endl;
+    });
+
+
+    // --- Test 20: Filtered search ---
+    run_test("Filtered Search", [&]() {
+        const int n = 2000, dim = 16, k = 10;
+        std::mt19937 rng(19);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        std::vector<float> data(n * dim);
+        for (auto& x : data) x = uniform(rng);
+
+        HNSW index(dim, n);
+        for (int i = 0; i < n; ++i) {
+            index.addPoint(data.data() + i * dim, i);
+        }
+
+        // Only every 'step'-th label may come back
+        struct EveryNth : LabelFilter {
+            int step;
+            explicit EveryNth(int step) : step(step) {}
+            bool allow(int label) const override { return label % step == 0; }
+        };
+        for (int step : {3, 100}) {
+            EveryNth filter(step);
+            int found = 0, total = 0;
+            for (int q = 1; q < n; q += 40) {
+                const float* query = data.data() + q * dim;
+                std::vector<std::pair<float, int>> exact;
+                for (int i = 0; i < n; i += step) {
+                    exact.push_back({L2SqrScalar(query, data.data() + i * dim, dim), i});
+                }
+                std::partial_sort(exact.begin(), exact.begin() + k, exact.end());
+
+                auto exact_result = index.searchKnnBruteForce(query, k, &filter);
+                assert((int)exact_result.size() == k);
+                assert(exact_result.top().second == exact[k - 1].second);
+
+                auto result = index.searchKnn(query, k, 100, &filter);
+                assert((int)result.size() == k);
+                while (!result.empty()) {
+                    assert(result.top().second % step == 0);
+                    for (int j = 0; j < k; ++j) {
+                        if (exact[j].second == result.top().second) found++;
+                    }
+                    result.pop();
+                }
+                total += k;
+            }
+            std::cout << "  - recall@10 with 1/" << step << " allowed: " << (double)found / total << std::endl;
+            assert((double)found / total > 0.9);
+        }
+
+        // Through VectorDB: equality, one-of and range
+        assert(matchesFilter({{"lang", "en"}, {"price", 5}}, {{"lang", {"de", "en"}}, {"price", {{"gte", 5}, {"lt", 6}}}}));
+        assert(!matchesFilter({{"lang", "en"}}, {{"price", {{"lt", 6}}}}));
+        bool threw = false;
+        try { matchesFilter({}, {{"price", {{"below", 6}}}}); } catch (const std::invalid_argument&) { threw = true; }
+        assert(threw);
+
+        const std::string filter_db_path = "./test_filter_db";
+        cleanup(filter_db_path);
+        VectorDB db(filter_db_path);
+        db.init(2);
+        for (int i = 0; i < 100; ++i) {
+            db.addVector({(float)i, 0.0f}, {{"tenant", i % 2 ? "odd" : "even"}, {"price", i}});
+        }
+        auto results = db.search({10.2f, 0.0f}, 3, 0, {{"tenant", "odd"}}); // x = ID - 1
+        assert(results.size() == 3 && results[0].first == 12 && results[1].first == 10 && results[2].first == 14);
+        results = db.search({0.0f, 0.0f}, 5, 0, {{"price", {{"gt", 97}}}});
+        assert(results.size() == 2 && results[0].first == 99 && results[1].first == 100);
+        assert(db.search({0.0f, 0.0f}, 5, 0, {{"tenant", "none"}}).empty());
+        cleanup(filter_db_path);
+    });
+
+
+    // --- Test 21: Indexed metadata fields ---
+    run_test("Metadata Index", [&]() {
+        MetadataIndex index;
+        index.addField("price");
+        for (int label = 0; label < 10; ++label) {
+            index.insert(label, {{"price", label}, {"name", "x"}});
+        }
+        index.erase(4, {{"price", 4}});
+        RoaringBitmap range;
+        index.lookup("price", {{"gt", 2}, {"lte", 6}}, range);
+        assert(range.cardinality() == 3 && range.contains(3) && !range.contains(4) && range.contains(6) && !range.contains(7));
+
+        // Indexed and scanned filters must agree, through adds (with
+        // reused labels), updates, deletes and a save/load
+        const std::string index_db_path = "./test_index_db";
+        cleanup(index_db_path);
+        std::vector<json> filters = {
+            {{"tenant", "a"}},
+            {{"tenant", {"b", "c"}}, {"price", {{"gte", 20}}}},
+            {{"price", {{"gt", 10}, {"lt", 60}}}, {"lang", "en"}},
+            {{"lang", "de"}},
+        };
+        auto sameResults = [&](VectorDB& indexed, VectorDB& scanned) {
+            for (const auto& filter : filters) {
+                for (float x : {0.0f, 37.5f, 80.0f}) {
+                    assert(indexed.search({x, 0.0f}, 10, 0, filter) == scanned.search({x, 0.0f}, 10, 0, filter));
+                }
+            }
+        };
+        {
+            VectorDB indexed(index_db_path);
+            VectorDB scanned("./test_index_scan_db");
+            cleanup("./test_index_scan_db");
+            indexed.init(2);
+            scanned.init(2);
+            indexed.createFieldIndex("tenant");
+            indexed.createFieldIndex("price");
+            for (VectorDB* db : {&indexed, &scanned}) {
+                for (int i = 0; i < 100; ++i) {
+                    db->addVector({(float)i, 0.0f}, {{"tenant", std::string(1, 'a' + i % 3)}, {"price", i}, {"lang", i % 2 ? "en" : "de"}});
+                }
+                for (long long id = 1; id <= 100; id += 7) db->deleteVector(id);
+                for (long long id = 2; id <= 100; id += 9) db->updateVector(id, {(float)id, 1.0f}, {{"tenant", "a"}, {"price", 1000}});
+                for (int i = 0; i < 5; ++i) db->addVector({(float)i, 2.0f}, {{"tenant", "c"}, {"price", 30}});
+            }
+            sameResults(indexed, scanned);
+            indexed.save();
+            cleanup("./test_index_scan_db");
+        }
+        {
+            VectorDB indexed(index_db_path);
+            indexed.load();
+            assert(indexed.getIndexedFields() == std::vector<std::string>({"price", "tenant"}));
+            auto results = indexed.search({0.0f, 0.0f}, 100, 0, {{"price", 1000}});
+            assert(results.size() == 9); // The updated ones, minus IDs 29 and 92 which were deleted first
+            indexed.dropFieldIndex("price");
+            assert(indexed.search({0.0f, 0.0f}, 100, 0, {{"price", 1000}}) == results);
+        }
+        cleanup(index_db_path);
+
+        // Values that JSON equality tells apart (integers past 2^53) or not
+        // (an integer and a float, [1] and [1.0]), arrays and objects
+        {
+            const long long big = 1LL << 53;
+            std::vector<json> values = {
+                big, big + 1, big + 2, (double)big, 5, 5.0, 5.5, -big - 1, std::numeric_limits<uint64_t>::max(),
+                {"a", "b"}, {1}, {1.0}, {{"x", 1}}, {{"x", 1.0}}, "5", nullptr,
+            };
+            VectorDB indexed(index_db_path);
+            VectorDB scanned("./test_index_scan_db");
+            cleanup("./test_index_scan_db");
+            indexed.init(2);
+            scanned.init(2);
+            indexed.createFieldIndex("v");
+            for (VectorDB* db : {&indexed, &scanned}) {
+                for (size_t i = 0; i < 3 * values.size(); ++i) {
+                    db->addVector({(float)i, 0.0f}, {{"v", values[i % values.size()]}});
+                }
+                for (long long id = 1; id <= (long long)values.size(); id += 2) {
+                    db->deleteVector(id);
+                }
+                db->updateVector(2, {2.0f, 0.0f}, {{"v", big + 3}});
+            }
+            std::vector<json> value_filters = {
+                {{"v", big}}, {{"v", big + 1}}, {{"v", (double)big}}, {{"v", big + 3}}, {{"v", 5}}, {{"v", 5.0}},
+                {{"v", -big - 1}}, {{"v", std::numeric_limits<uint64_t>::max()}},
+                {{"v", {big + 2, 5.5, "5"}}},
+                {{"v", {{"gt", (double)big}}}},
+                {{"v", {{"gte", (double)big}, {"lt", 1e19}}}},
+                {{"v", {{"lte", 5}}}},
+                {{"v", json::array({json::array({1.0})})}},
+                {{"v", json::array({json::array({"a", "b"}), 7})}},
+                {{"v", json::array({json::object({{"x", 1}})})}},
+            };
+            for (const auto& filter : value_filters) {
+                auto results = indexed.search({0.0f, 0.0f}, 100, 0, filter);
+                assert(!results.empty() && results == scanned.search({0.0f, 0.0f}, 100, 0, filter));
+            }
+            cleanup("./test_index_scan_db");
+        }
+        cleanup(index_db_path);
+    });
+
+
+    // --- Test 22: Roaring bitmap against std::set ---
+    run_test("Roaring Bitmap", [&]() {
+        std::mt19937 rng(23);
+        RoaringBitmap a, b;
+        std::set<uint32_t> ref_a, ref_b;
+        // Sparse values, a dense chunk (array -> bitmap) and a range (run)
+        for (int i = 0; i < 20000; ++i) {
+            uint32_t x = rng() % 1000000;
+            a.add(x);
+            ref_a.insert(x);
+        }
+        for (uint32_t x = 131072; x < 131072 + 60000; x += 3) {
+            a.add(x);
+            ref_a.insert(x);
+        }
+        b.addRange(500000, 700000);
+        for (uint32_t x = 500000; x < 700000; ++x) ref_b.insert(x);
+        for (int i = 0; i < 5000; ++i) {
+            uint32_t x = rng() % 1000000;
+            b.add(x);
+            ref_b.insert(x);
+        }
+        // Removes, enough to turn the dense chunk back into an array
+        for (uint32_t x = 131072; x < 131072 + 50000; x += 3) {
+            assert(a.remove(x));
+            ref_a.erase(x);
+        }
+        assert(!a.remove(131072));
+
+        auto sameAs = [](const RoaringBitmap& bitmap, const std::set<uint32_t>& ref) {
+            std::vector<uint32_t> values;
+            bitmap.forEach([&](uint32_t x) { values.push_back(x); });
+            return bitmap.cardinality() == ref.size() && std::equal(values.begin(), values.end(), ref.begin());
+        };
+        assert(sameAs(a, ref_a) && sameAs(b, ref_b));
+        for (int i = 0; i < 100000; ++i) {
+            uint32_t x = rng() % 1100000;
+            assert(a.contains(x) == (ref_a.count(x) == 1));
+            assert(b.contains(x) == (ref_b.count(x) == 1));
+        }
+
+        std::set<uint32_t> ref_and, ref_or(ref_a);
+        std::set_intersection(ref_a.begin(), ref_a.end(), ref_b.begin(), ref_b.end(), std::inserter(ref_and, ref_and.end()));
+        ref_or.insert(ref_b.begin(), ref_b.end());
+        assert(sameAs(a & b, ref_and));
+        assert(sameAs(a | b, ref_or));
+        assert(RoaringBitmap::unionOf({&a, &b}) == (a | b));
+
+        // Run-optimized: same set, smaller
+        RoaringBitmap c = b;
+        size_t before = c.sizeInBytes();
+        c.runOptimize();
+        assert(c == b && c.sizeInBytes() < before && sameAs(c, ref_b));
+        c.add(600000);
+        c.remove(600001);
+        ref_b.erase(600001);
+        assert(sameAs(c, ref_b));
+    });
+
+
+    // --- Test 23: Columnar vector store shared with the index ---
+    run_test("Vector Store", [&]() {
+        VectorStore store;
+        store.reset(2, true);
+        std::vector<float> a = {3.0f, 4.0f}, b = {0.0f, 0.0f}, c = {-2.0f, 0.0f};
+        assert(store.insert(10, a.data(), {{"n", "a"}}) == 0);
+        assert(store.insert(20, b.data(), {}) == 1);
+        assert(approx_equal(store.row(0)[0], 0.6f) && approx_equal(store.vectorAt(0)[1], 4.0f));
+        assert(store.vectorAt(1) == b); // Zero vectors stay as they are
+        assert(store.erase(0)["n"] == "a" && store.find(10) == -1);
+        assert(store.insert(30, c.data(), {}) == 0 && store.size() == 2); // Slot reused
+        assert(!store.arrange({30, 30}) && !store.arrange({30, 40}) && store.find(30) == 0);
+        assert(store.arrange({-1, 20, 30}) && store.find(30) == 2 && store.idAt(0) == -1);
+        assert(approx_equal(store.vectorAt(2)[0], -2.0f) && store.insert(40, a.data(), {}) == 0);
+        store.compact();
+        assert(store.ids() == std::vector<long long>({20, 30, 40}));
+
+        // Through the database: the matrix grows under a live index, and
+        // deleted slots are refilled, with the index reading rows in place
+        const std::string store_db_path = "./test_store_db";
+        cleanup(store_db_path);
+        std::mt19937 rng(19);
+        std::uniform_real_distribution<float> dist(-5.0f, 5.0f);
+        std::map<long long, std::vector<float>> expected;
+        auto randomVector = [&]() {
+            std::vector<float> v(8);
+            for (float& x : v) x = dist(rng);
+            return v;
+        };
+        {
+            VectorDB db(store_db_path);
+            db.init(8, Metric::Cosine);
+            for (int i = 0; i < 300; ++i) {
+                auto v = randomVector();
+                expected[db.addVector(v, {{"i", i}})] = v;
+            }
+            for (long long id = 1; id <= 300; id += 3) {
+                db.deleteVector(id);
+                expected.erase(id);
+            }
+            for (int i = 0; i < 150; ++i) {
+                auto v = randomVector();
+                expected[db.addVector(v, {})] = v;
+            }
+            assert(!db.needsRebuild());
+            db.save();
+        }
+        {
+            VectorDB db(store_db_path);
+            db.load();
+            for (const auto& [id, v] : expected) {
+                auto res = db.getVector(id);
+                assert(res.second);
+                for (int d = 0; d < 8; ++d) {
+                    assert(std::abs(res.first.vec[d] - v[d]) < 1e-4);
+                }
+                auto results = db.search(v, 1);
+                assert(results.size() == 1 && results[0].first == id);
+            }
+            assert(!db.getVector(1).second && db.getVector(2).first.metadata["i"] == 1);
+        }
+        cleanup(store_db_path);
+    });
+
+
+    // --- Test 24: Binary data file, JSON import/export ---
+    run_test("Data File", [&]() {
+        const std::string data_db_path = "./test_data_db";
+        const std::string copy_db_path = "./test_data_copy_db";
+        cleanup(data_db_path);
+        cleanup(copy_db_path);
+        json nested = {{"tags", {"a", "b"}}, {"score", 0.25}, {"ok", true}, {"none", nullptr}};
+        {
+            VectorDB db(data_db_path);
+            db.init(3, Metric::Cosine);
+            db.addVector({1.0f, 2.0f, 3.0f}, nested);
+            db.addVector({-1.0f, 0.5f, 0.0f}, {{"n", 2}});
+            db.addVector({0.0f, 0.0f, 7.0f}, {{"n", 3}});
+            db.deleteVector(2); // Leaves a hole in the slots
+            db.setEfSearch(40);
+            db.createFieldIndex("n");
+            db.save();
+        }
+        assert(std::filesystem::exists(data_db_path + ".vdb") && !std::filesystem::exists(data_db_path + ".json"));
+        auto sameContents = [&](VectorDB& db, long long next_id) {
+            assert(db.getMetric() == Metric::Cosine && db.getEfSearch() == 40);
+            assert(db.getIndexedFields() == std::vector<std::string>({"n"}));
+            auto res = db.getVector(1);
+            assert(res.second && res.first.metadata == nested && approx_equal(res.first.vec[2], 3.0f));
+            assert(!db.getVector(2).second && db.getVector(3).first.metadata["n"] == 3);
+            assert(db.search({0.0f, 0.1f, 1.0f}, 1, 0, {{"n", 3}})[0].first == 3);
+            assert(db.addVector({1.0f, 0.0f, 0.0f}, {}) == next_id); // nextId survived
+        };
+        {
+            VectorDB db(data_db_path);
+            db.load();
+            sameContents(db, 4);
+            std::cout << "  - binary round trip ok." << std::endl;
+
+            db.deleteVector(4);
+            db.exportJson(copy_db_path + ".json");
+        }
+        {
+            // A database with only a JSON file is read from it, and converted by save()
+            VectorDB db(copy_db_path);
+            db.load();
+            sameContents(db, 5);
+            db.save();
+            assert(std::filesystem::exists(copy_db_path + ".vdb"));
+        }
+        {
+            VectorDB db(copy_db_path);
+            db.importJson(copy_db_path + ".json");
+            assert(db.getVector(1).first.metadata == nested && !db.getVector(4).second);
+            std::cout << "  - JSON import and export ok." << std::endl;
+        }
+
+        // A truncated file is an error, not an empty database
+        std::filesystem::resize_file(data_db_path + ".vdb", std::filesystem::file_size(data_db_path + ".vdb") - 4);
+        bool threw = false;
+        try {
+            VectorDB db(data_db_path);
+            db.load();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        cleanup(data_db_path);
+        cleanup(copy_db_path);
+    });
+
+
+    // --- Test 25: Write-ahead log ---
+    run_test("Write-Ahead Log", [&]() {
+        const std::string wal_db_path = "./test_wal_db";
+        cleanup(wal_db_path);
+        {
+            VectorDB db(wal_db_path);
+            db.init(2);
+            db.addVector({1.0f, 1.0f}, {{"n", 1}});
+            db.addVector({2.0f, 2.0f}, {{"n", 2}});
+            db.save();
+            db.addVector({3.0f, 3.0f}, {{"n", 3}}); // From here on only in the log
+            db.updateVector(1, {1.5f, 1.5f}, {{"n", 10}});
+            db.deleteVector(2);
+        }
+        std::filesystem::copy_file(wal_db_path + ".wal", wal_db_path + ".wal.old");
+        {
+            VectorDB db(wal_db_path);
+            db.load();
+            assert(db.getVector(3).second && !db.getVector(2).second);
+            assert(db.getVector(1).first.metadata["n"] == 10 && approx_equal(db.getVector(1).first.vec[0], 1.5f));
+            assert(db.search({3.0f, 3.0f}, 1)[0].first == 3);
+            assert(db.addVector({4.0f, 4.0f}, {}) == 4);
+            std::cout << "  - changes replayed ok." << std::endl;
+        }
+
+        // A record torn by a crash is cut off; what came before still counts
+        {
+            std::ofstream wal(wal_db_path + ".wal", std::ios::binary | std::ios::app);
+            wal.write("\x40\0\0\0garbage", 11);
+        }
+        {
+            VectorDB db(wal_db_path);
+            db.load();
+            assert(db.getVector(4).second && db.addVector({5.0f, 5.0f}, {}) == 5);
+        }
+        {
+            VectorDB db(wal_db_path);
+            db.load();
+            assert(db.getVector(5).second);
+            db.save();
+            std::cout << "  - torn tail ignored ok." << std::endl;
+        }
+
+        // A log from before the last save (e.g. a crash before it was reset)
+        // is not replayed on top of the data file that has its changes
+        std::filesystem::rename(wal_db_path + ".wal.old", wal_db_path + ".wal");
+        {
+            VectorDB db(wal_db_path);
+            db.load();
+            assert(db.getVector(1).first.metadata["n"] == 10 && db.addVector({6.0f, 6.0f}, {}) == 6);
+        }
+
+        // Group commit: concurrent writers, every record is there once
+        const std::string log_path = "./test_wal_group.wal";
+        std::remove(log_path.c_str());
+        {
+            WriteAheadLog log;
+            log.open(log_path, 7);
+            std::vector<std::thread> writers;
+            for (int t = 0; t < 4; ++t) {
+                writers.emplace_back([&log, t]() {
+                    for (int i = 0; i < 50; ++i) {
+                        log.sync(log.append({WriteAheadLog::RecordType::Add, t * 100 + i, {1.0f, 2.0f}, {{"t", t}}}));
+                    }
+                });
+            }
+            for (auto& w : writers) w.join();
+        }
+        std::set<long long> ids;
+        size_t replayed = WriteAheadLog::replay(log_path, 7, [&](const WriteAheadLog::Record& r) {
+            assert(r.vec.size() == 2 && r.metadata["t"] == r.id / 100);
+            ids.insert(r.id);
+        }, false);
+        assert(replayed == 200 && ids.size() == 200);
+        assert(WriteAheadLog::replay(log_path, 8, [](const WriteAheadLog::Record&) { assert(false); }, false) == 0);
+        std::remove(log_path.c_str());
+        cleanup(wal_db_path);
+        std::cout << "  - group commit ok." << std::endl;
+    });
+
+
+    run_test("Checkpoint", [&]() {
+        const std::string cp_db_path = "./test_checkpoint_db";
+        const std::string wal_path = cp_db_path + ".wal";
+        cleanup(cp_db_path);
+        {
+            VectorDB db(cp_db_path);
+            db.init(2);
+            db.setCheckpointBytes(0);
+            for (int i = 1; i <= 50; ++i) {
+                db.addVector({(float)i, (float)i}, {{"n", i}});
+            }
+            uintmax_t logged = std::filesystem::file_size(wal_path);
+            assert(db.checkpoint());
+            // Writes go on while the checkpoint runs, into the log
+            for (int i = 51; i <= 60; ++i) {
+                db.addVector({(float)i, (float)i}, {{"n", i}});
+            }
+            db.deleteVector(7);
+            db.waitForCheckpoint();
+            assert(std::filesystem::file_size(wal_path) < logged);
+        }
+        {
+            VectorDB db(cp_db_path);
+            db.load();
+            assert(!db.needsRebuild() && !db.getVector(7).second);
+            for (long long id : {1, 50, 51, 60}) {
+                assert(db.getVector(id).second && db.getVector(id).first.metadata["n"] == id);
+            }
+            assert(db.search({55.0f, 55.0f}, 1)[0].first == 55 && db.addVector({0.0f, 0.0f}, {}) == 61);
+            std::cout << "  - checkpoint while writing ok." << std::endl;
+        }
+
+        // A crash after the data file was written but before the log was
+        // cut: the log is replayed from where the data file leaves off
+        std::filesystem::copy_file(wal_path, wal_path + ".old");
+        {
+            VectorDB db(cp_db_path);
+            db.load();
+            db.setCheckpointBytes(0);
+            assert(db.checkpoint());
+            db.waitForCheckpoint();
+        }
+        uint64_t old_generation = 0;
+        {
+            std::ifstream in(wal_path + ".old", std::ios::binary);
+            in.seekg(16); // WalHeader::generation
+            in.read(reinterpret_cast<char*>(&old_generation), sizeof(old_generation));
+            WriteAheadLog log;
+            log.open(wal_path + ".old", old_generation);
+            log.append({WriteAheadLog::RecordType::Add, 62, {62.0f, 62.0f}, {{"n", 62}}});
+        }
+        std::filesystem::rename(wal_path + ".old", wal_path);
+        for (int round = 0; round < 2; ++round) {
+            // The second time the log has been cut, 62 must survive that
+            VectorDB db(cp_db_path);
+            db.load();
+            assert(db.getVector(61).second && db.getVector(62).second && !db.getVector(7).second);
+            assert(db.search({62.0f, 62.0f}, 1)[0].first == 62);
+        }
+        std::cout << "  - uncut log replayed from the checkpoint ok." << std::endl;
+
+        // Automatic checkpoints keep the log bounded
+        {
+            VectorDB db(cp_db_path);
+            db.load();
+            db.setSyncWrites(false);
+            db.setCheckpointBytes(4096);
+            for (int i = 0; i < 1000; ++i) {
+                db.addVector({(float)i, 1.0f}, {{"n", i}});
+            }
+            db.waitForCheckpoint();
+        }
+        assert(std::filesystem::file_size(wal_path) < 3 * 4096);
+        {
+            VectorDB db(cp_db_path);
+            db.load();
+            assert(db.getVector(63).second && db.getVector(1062).second && !db.getVector(1063).second);
+        }
+        std::cout << "  - automatic checkpoints ok." << std::endl;
+
+        // The files hold the contents as of the checkpoint, whatever changes
+        // while they are written
+        {
+            VectorDB db(cp_db_path);
+            db.load();
+            db.setCheckpointBytes(0);
+            assert(db.checkpoint());
+            db.updateVector(1, {-1.0f, -1.0f}, {{"n", -1}});
+            db.deleteVector(2);
+            assert(db.addVector({-3.0f, -3.0f}, {{"n", -3}}) == 1063); // Takes the slot of 2
+            db.waitForCheckpoint();
+        }
+        const std::string copy_path = cp_db_path + "_copy";
+        cleanup(copy_path);
+        std::filesystem::copy_file(cp_db_path + ".vdb", copy_path + ".vdb");
+        std::filesystem::copy_file(cp_db_path + ".hnsw", copy_path + ".hnsw");
+        {
+            VectorDB db(copy_path); // Without the log
+            db.load();
+            assert(!db.needsRebuild() && !db.getVector(1063).second);
+            auto one = db.getVector(1);
+            assert(one.second && one.first.metadata["n"] == 1 && approx_equal(one.first.vec[0], 1.0f));
+            assert(db.getVector(2).second && db.search({2.0f, 2.0f}, 1)[0].first == 2);
+        }
+        cleanup(copy_path);
+        cleanup(cp_db_path);
+        std::cout << "  - checkpoint snapshot ok." << std::endl;
+    });
+
+
+    run_test("JSON Reader", [&]() {
+        // Sorted keys (as nlohmann writes them): vectors stream as they are parsed
+        std::istringstream sorted(R"({"dim": 2, "efSearch": 5, "nextId": 9, "vectors": [
+            {"id": 3, "metadata": {"tags": ["a", {"b": null}], "n": 1.5}, "vec": [1, 2.5]},
+            {"id": 7, "metadata": {}, "vec": [-3e-1, 4]}]})");
+        std::vector<std::string> calls;
+        std::vector<std::vector<float>> vecs;
+        json header = readJsonDatabase(sorted, [&](const json& h) {
+            assert(h["dim"] == 2 && !h.contains("vectors"));
+            calls.push_back("start");
+        }, [&](long long id, const std::vector<float>& vec, json metadata) {
+            calls.push_back(std::to_string(id));
+            vecs.push_back(vec);
+            if (id == 3) {
+                assert(metadata == json::parse(R"({"tags": ["a", {"b": null}], "n": 1.5})"));
+            }
+        });
+        assert(calls == std::vector<std::string>({"start", "3", "7"}));
+        assert(vecs[0] == std::vector<float>({1.0f, 2.5f}) && approx_equal(vecs[1][0], -0.3f));
+        assert(header["nextId"] == 9 && header["efSearch"] == 5 && !header.contains("vectors"));
+        std::cout << "  - streamed ok." << std::endl;
+
+        // "metric" after "vectors" in a file sorted up to there: read again
+        // with the vectors held back, so cosine rows are normalized
+        const std::string json_db_path = "./test_json_db";
+        cleanup(json_db_path);
+        for (const char* text : {
+                 R"({"dim": 2, "vectors": [{"id": 1, "metadata": {}, "vec": [3, 4]}, {"id": 2, "metadata": {}, "vec": [1, 0]}], "metric": "cosine", "nextId": 3})",
+                 R"({"vectors": [{"vec": [3, 4], "id": 1, "metadata": {}}, {"metadata": {}, "id": 2, "vec": [1, 0]}], "nextId": 3, "metric": "cosine", "dim": 2})"}) {
+            std::ofstream(json_db_path + ".json") << text;
+            VectorDB db(json_db_path);
+            db.load();
+            assert(db.getMetric() == Metric::Cosine && db.getDimensions() == 2);
+            auto res = db.getVector(1);
+            assert(res.second && approx_equal(res.first.vec[0], 3.0f) && approx_equal(res.first.vec[1], 4.0f));
+            assert(db.search({6.0f, 8.0f}, 1)[0].first == 1 && db.addVector({0.0f, 1.0f}, {}) == 3);
+            cleanup(json_db_path);
+        }
+        std::cout << "  - out-of-order keys ok." << std::endl;
+
+        auto fails = [&](const std::string& text, const std::string& message) {
+            std::ofstream(json_db_path + ".json") << text;
+            bool threw = false;
+            try {
+                VectorDB db(json_db_path);
+                db.load();
+            } catch (const std::runtime_error& e) {
+                threw = std::string(e.what()).find(message) != std::string::npos;
+            }
+            cleanup(json_db_path);
+            assert(threw);
+        };
+        fails(R"({"dim": 2, "nextId": 1, "vectors": [{"id": 1, "metadata": {}, "vec": [1, 2]})", "JSON error");
+        fails(R"({"dim": 2, "nextId": 2, "vectors": [{"id": 1, "metadata": {}, "vec": [1, "x"]}]})", "must hold numbers");
+        fails(R"({"dim": 2, "nextId": 2, "vectors": [{"id": 1, "metadata": {}, "vec": [1, 2, 3]}]})", "dimension mismatch");
+        fails(R"({"dim": 2, "nextId": 2, "vectors": [{"id": 1, "vec": [1, 2]}]})", "missing fields");
+        fails(R"({"dim": 2, "vectors": []})", "missing fields");
+        fails(R"([1, 2])", "not a JSON object");
+        std::cout << "  - errors ok." << std::endl;
+    });
+
+
+    run_test("Batch Search", [&]() {
+        const std::string batch_db_path = "./test_batch_db";
+        for (Metric metric : {Metric::L2, Metric::Cosine}) {
+            cleanup(batch_db_path);
+            const int dim = 8, n = 2000, nq = 100, k = 10;
+            std::mt19937 rng(7);
+            std::uniform_real_distribution<float> uni(-1.0f, 1.0f);
+            VectorDB db(batch_db_path);
+            db.init(dim, metric);
+            db.setSyncWrites(false);
+            for (int i = 0; i < n; ++i) {
+                std::vector<float> v(dim);
+                for (float& x : v) {
+                    x = uni(rng);
+                }
+                db.addVector(v, {{"i", i}});
+            }
+            for (long long id = 0; id < 100; id += 3) {
+                db.deleteVector(id);
+            }
+            std::vector<float> queries(nq * dim);
+            for (float& x : queries) {
+                x = uni(rng);
+            }
+            // Same results as one search() per query, on any number of threads
+            for (int threads : {1, 4}) {
+                BatchSearchResults results = db.searchBatch(queries.data(), nq, k, 40, threads);
+                assert(results.nq == (size_t)nq && results.k == k && results.ids.size() == (size_t)nq * k);
+                for (int q = 0; q < nq; ++q) {
+                    auto expected = db.search(std::vector<float>(queries.begin() + q * dim, queries.begin() + (q + 1) * dim), k, 40);
+                    assert(expected.size() == (size_t)k);
+                    for (int i = 0; i < k; ++i) {
+                        assert(results.id(q, i) == expected[i].first);
+                        assert(results.id(q, i) >= 100 || results.id(q, i) % 3 != 0);
+                        assert(approx_equal(results.distance(q, i), expected[i].second));
+                    }
+                }
+            }
+        }
+        std::cout << "  - matches search() ok." << std::endl;
+
+        {
+            // Batches from several threads at once share the database's
+            // search threads, each worker with scratch of its own
+            VectorDB db(batch_db_path);
+            db.load();
+            const int dim = 8, nq = 50, k = 5;
+            std::vector<float> queries(nq * dim);
+            std::mt19937 rng(11);
+            std::uniform_real_distribution<float> uni(-1.0f, 1.0f);
+            for (float& x : queries) {
+                x = uni(rng);
+            }
+            BatchSearchResults expected = db.searchBatch(queries.data(), nq, k, 40, 1);
+            std::vector<std::thread> callers;
+            std::atomic<int> wrong{0};
+            for (int t = 0; t < 4; ++t) {
+                callers.emplace_back([&, t] {
+                    for (int round = 0; round < 5; ++round) {
+                        if (db.searchBatch(queries.data(), nq, k, 40, 1 + t % 2).ids != expected.ids) {
+                            ++wrong;
+                        }
+                    }
+                });
+            }
+            for (auto& caller : callers) {
+                caller.join();
+            }
+            assert(wrong == 0);
+
+            ThreadPool pool(3);
+            std::atomic<int> bad_workers{0};
+            pool.parallelFor(0, 100, 2, [&](size_t, int worker) {
+                if (worker < 0 || worker >= pool.size()) {
+                    ++bad_workers;
+                }
+            });
+            assert(bad_workers == 0);
+            bool threw = false;
+            try {
+                pool.parallelFor(0, 100, 0, [](size_t i, int) {
+                    if (i == 42) {
+                        throw std::runtime_error("stop");
+                    }
+                });
+            } catch (const std::runtime_error&) {
+                threw = true;
+            }
+            assert(threw);
+        }
+        std::cout << "  - concurrent batches ok." << std::endl;
+
+        // Fewer vectors than k: rows are padded
+        cleanup(batch_db_path);
+        VectorDB db(batch_db_path);
+        db.init(2);
+        db.addVector({1.0f, 1.0f}, {});
+        db.addVector({2.0f, 2.0f}, {});
+        std::vector<float> queries = {0.0f, 0.0f, 3.0f, 3.0f};
+        BatchSearchResults results = db.searchBatch(queries.data(), 2, 3);
+        assert(results.id(0, 0) == 1 && results.id(0, 1) == 2 && results.id(0, 2) == -1);
+        assert(results.id(1, 0) == 2 && approx_equal(results.distance(1, 0), std::sqrt(2.0f)));
+        assert(std::isinf(results.distance(1, 2)));
+        assert(db.searchBatch(queries.data(), 0, 3).ids.empty());
+        cleanup(batch_db_path);
+        std::cout << "  - padding ok." << std::endl;
+    });
+
+
+    run_test("Server", [&]() {
+        const std::string srv_db_path = "./test_server_db";
+        const std::string socket_path = VectorDBServer::socketPath(srv_db_path);
+        cleanup(srv_db_path);
+        std::remove(socket_path.c_str());
+        assert(!VectorDBClient::tryConnect(socket_path));
+        auto throwsContaining = [](const std::function<void()>& f, const std::string& text) {
+            try {
+                f();
+            } catch (const std::runtime_error& e) {
+                return std::string(e.what()).find(text) != std::string::npos;
+            }
+            return false;
+        };
+        {
+            VectorDB db(srv_db_path);
+            db.init(2);
+            for (int i = 1; i <= 20; ++i) {
+                db.addVector({(float)i, (float)i}, {{"n", i}});
+            }
+            VectorDBServer server(db, socket_path);
+            std::thread serving([&] { server.run(); });
+            std::unique_ptr<VectorDBClient> client;
+            while (!(client = VectorDBClient::tryConnect(socket_path))) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            assert(client->getDimensions() == 2 && client->getMetric() == Metric::L2);
+
+            auto results = client->search({5.1f, 5.1f}, 3);
+            assert(results.size() == 3 && results[0].first == 5);
+            assert(approx_equal(results[0].second, db.search({5.1f, 5.1f}, 1)[0].second));
+            results = client->search({5.0f, 5.0f}, 2, 50, {{"n", {{"gt", 15}}}});
+            assert(results.size() == 2 && results[0].first == 16 && results[1].first == 17);
+            auto got = client->getVector(7);
+            assert(got.second && got.first.vec == std::vector<float>({7.0f, 7.0f}) && got.first.metadata["n"] == 7);
+            assert(!client->getVector(99).second);
+            std::cout << "  - search and get ok." << std::endl;
+
+            assert(client->addVector({100.0f, 100.0f}, {{"n", 100}}) == 21);
+            assert(client->updateVector(3, {50.0f, 50.0f}, {{"n", 3}}) && !client->updateVector(99, {0.0f, 0.0f}, {}));
+            assert(client->deleteVector(4) && !client->deleteVector(4));
+            assert(client->search({50.0f, 50.0f}, 1)[0].first == 3);
+            std::cout << "  - add, update and delete ok." << std::endl;
+
+            // Compaction, while the server runs
+            auto compacted = client->compactIndex(0.5);
+            assert(!compacted.first && compacted.second > 0.0);
+            compacted = client->compactIndex();
+            assert(compacted.first && compacted.second > 0.0);
+            assert(!client->compactIndex().first);
+            assert(client->search({4.1f, 4.1f}, 1)[0].first == 5);
+            std::cout << "  - compaction ok." << std::endl;
+
+            // The server's errors are thrown by the client, which stays usable
+            assert(throwsContaining([&] { client->search({1.0f}, 1); }, "dimension mismatch"));
+            assert(throwsContaining([&] { client->search({1.0f, 1.0f}, 1, 0, {{"n", {{"gt", "x"}}}}); }, "Bad range"));
+            assert(client->search({1.0f, 1.0f}, 1)[0].first == 1);
+            std::vector<float> queries = {2.0f, 2.0f, 18.0f, 18.1f};
+            BatchSearchResults batch = client->searchBatch(queries.data(), 2, 2);
+            assert(batch.nq == 2 && batch.k == 2 && batch.id(0, 0) == 2 && batch.id(1, 0) == 18 && batch.id(1, 1) == 19);
+            assert(approx_equal(batch.distance(1, 0), db.search({18.0f, 18.1f}, 1)[0].second));
+            assert(throwsContaining([&] { client->searchBatch(queries.data(), 2, 1 << 24); }, "too large"));
+            // So is a second server on the socket
+            VectorDBServer second(db, socket_path);
+            assert(throwsContaining([&] { second.run(); }, "already being served"));
+            std::cout << "  - errors ok." << std::endl;
+
+            // Readers and writers on their own connections
+            std::vector<std::thread> threads;
+            std::atomic<int> wrong{0};
+            for (int t = 0; t < 4; ++t) {
+                threads.emplace_back([&, t] {
+                    VectorDBClient own(socket_path);
+                    for (int i = 0; i < 50; ++i) {
+                        if (t % 2 == 0) {
+                            wrong += own.search({10.0f, 10.0f}, 1)[0].first != 10;
+                        } else {
+                            own.addVector({(float)(1000 + i), (float)t}, {{"t", t}});
+                        }
+                    }
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            assert(wrong == 0);
+            std::cout << "  - concurrent clients ok." << std::endl;
+
+            client->shutdown();
+            serving.join();
+            assert(!std::filesystem::exists(socket_path) && !VectorDBClient::tryConnect(socket_path));
+            db.save();
+        }
+        {
+            // The writes made through the server are in the database
+            VectorDB db(srv_db_path);
+            db.load();
+            assert(db.getVector(121).second && !db.getVector(122).second);
+            assert(!db.getVector(4).second && db.getVector(3).first.vec[0] == 50.0f);
+        }
+        {
+            // A socket file left by a server that crashed is replaced
+            int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr = protocol::socketAddress(socket_path);
+            assert(::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0);
+            ::close(fd);
+            assert(std::filesystem::exists(socket_path) && !VectorDBClient::tryConnect(socket_path));
+            VectorDB db(srv_db_path);
+            db.load();
+            VectorDBServer server(db, socket_path);
+            server.stop(); // run() returns as soon as it listens
+            server.run();
+            assert(!std::filesystem::exists(socket_path));
+        }
+        cleanup(srv_db_path);
+        std::cout << "  - stale socket ok." << std::endl;
+    });
+
+
     std::cout << "\n---------------------" << std::endl;
     std::cout << "ALL TESTS PASSED!" << std::endl;
     std::cout << "---------------------" << std::endl;
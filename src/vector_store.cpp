@@ -0,0 +1,145 @@
+#include "vector_store.h"
+#include <algorithm>
+#include <cmath>
+
+#include "distances.h"
+
+void VectorStore::reset(int dim, bool normalize, bool keep_vectors) {
+    dim_ = dim;
+    normalize_ = normalize;
+    keep_vectors_ = keep_vectors;
+    AlignedVector<float>().swap(matrix_);
+    norms_.clear();
+    ids_.clear();
+    metadata_.clear();
+    slots_.clear();
+    free_.clear();
+}
+
+std::vector<float> VectorStore::vectorAt(int slot) const {
+    std::vector<float> vec(dim_);
+    copyVector(slot, vec.data());
+    return vec;
+}
+
+void VectorStore::copyVector(int slot, float* out) const {
+    std::copy(row(slot), row(slot) + dim_, out);
+    if (normalize_) {
+        for (int i = 0; i < dim_; ++i) {
+            out[i] *= norms_[slot];
+        }
+    }
+}
+
+AlignedVector<float> VectorStore::grow(int slots) {
+    AlignedVector<float> bigger((size_t)std::max(slots, slotCount()) * dim_);
+    std::copy(matrix_.begin(), matrix_.begin() + std::min(matrix_.size(), bigger.size()), bigger.begin());
+    matrix_.swap(bigger);
+    return bigger;
+}
+
+void VectorStore::setRow(int slot, const float* vec) {
+    if (!keep_vectors_) {
+        return;
+    }
+    float* row = matrix_.data() + (size_t)slot * dim_;
+    std::copy(vec, vec + dim_, row);
+    if (normalize_) {
+        float norm_sq = 0;
+        for (int i = 0; i < dim_; ++i) {
+            norm_sq += row[i] * row[i];
+        }
+        // Same rounding as the index applies to queries
+        normalizeVector(row, dim_);
+        norms_[slot] = norm_sq > 0 ? std::sqrt(norm_sq) : 1.0f;
+    }
+}
+
+int VectorStore::insert(long long id, const float* vec, json metadata) {
+    int slot;
+    if (!free_.empty()) {
+        slot = free_.back();
+        free_.pop_back();
+    } else {
+        slot = slotCount();
+        if (keep_vectors_ && (size_t)(slot + 1) * dim_ > matrix_.size()) {
+            grow(std::max(slot * 2, 16));
+        }
+        ids_.push_back(-1);
+        metadata_.emplace_back();
+        if (normalize_) {
+            norms_.push_back(1.0f);
+        }
+    }
+    ids_[slot] = id;
+    metadata_[slot] = std::move(metadata);
+    slots_[id] = slot;
+    setRow(slot, vec);
+    return slot;
+}
+
+void VectorStore::update(int slot, const float* vec, json metadata) {
+    metadata_[slot] = std::move(metadata);
+    setRow(slot, vec);
+}
+
+json VectorStore::erase(int slot) {
+    json metadata = std::move(metadata_[slot]);
+    metadata_[slot] = json();
+    slots_.erase(ids_[slot]);
+    ids_[slot] = -1;
+    free_.push_back(slot);
+    return metadata;
+}
+
+void VectorStore::compact() {
+    std::vector<long long> ids;
+    ids.reserve(slots_.size());
+    for (const auto& [id, slot] : slots_) {
+        ids.push_back(id);
+    }
+    std::sort(ids.begin(), ids.end());
+    arrange(ids);
+}
+
+bool VectorStore::arrange(const std::vector<long long>& slot_ids) {
+    int count = (int)slot_ids.size();
+    std::unordered_map<long long, int> slots;
+    slots.reserve(slots_.size());
+    std::vector<int> free;
+    for (int slot = 0; slot < count; ++slot) {
+        long long id = slot_ids[slot];
+        if (id < 0) {
+            free.push_back(slot);
+        } else if (!slots_.count(id) || !slots.emplace(id, slot).second) {
+            return false; // Not stored, or named twice
+        }
+    }
+    if (slots.size() != slots_.size()) {
+        return false; // Some stored ID has no slot
+    }
+    // Reuse the low slots first
+    std::reverse(free.begin(), free.end());
+
+    AlignedVector<float> matrix(keep_vectors_ ? (size_t)std::max(count, 1) * dim_ : 0);
+    std::vector<float> norms(normalize_ ? count : 0, 1.0f);
+    std::vector<json> metadata(count);
+    for (const auto& [id, slot] : slots) {
+        int old = slots_.at(id);
+        if (keep_vectors_) {
+            std::copy(row(old), row(old) + dim_, matrix.data() + (size_t)slot * dim_);
+        }
+        if (normalize_) {
+            norms[slot] = norms_[old];
+        }
+        metadata[slot] = std::move(metadata_[old]);
+    }
+
+    matrix_.swap(matrix);
+    norms_.swap(norms);
+    metadata_.swap(metadata);
+    slots_.swap(slots);
+    free_.swap(free);
+    ids_ = slot_ids;
+    return true;
+}
@@ -0,0 +1,121 @@
+#ifndef VECTOR_STORE_H
+#define VECTOR_STORE_H
+
+#include <vector>
+#include <unordered_map>
+
+#include "aligned_allocator.h"
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+/*
+Columnar storage behind VectorDB. Every vector lives in a slot, and slot s
+is row s of one aligned float matrix, plus ids_[s] and metadata_[s] in
+columns of their own. An ID -> slot hash map finds them by external ID.
+
+Slots are the labels VectorDB gives the HNSW index, and the index reads
+the rows in place (see HNSW::setExternalVectors()), so each vector is held
+once. For cosine the rows are normalized, as the index needs them, and
+norms_ gives vectorAt() back the original length.
+
+A deleted vector frees its slot; the next insert reuses it. compact()
+closes the gaps.
+*/
+class VectorStore {
+public:
+    // Empties the store. normalize: keep unit-length rows (cosine).
+    // Without keep_vectors only IDs and metadata are stored (the vectors
+    // are read elsewhere, e.g. from a mapped index file).
+    void reset(int dim, bool normalize, bool keep_vectors = true);
+
+    int dim() const {
+        return dim_;
+    }
+    // Live vectors
+    size_t size() const {
+        return slots_.size();
+    }
+    // Slots handed out so far, live or free
+    int slotCount() const {
+        return (int)ids_.size();
+    }
+    bool hasVectors() const {
+        return keep_vectors_;
+    }
+
+    // Slot of an ID, -1 if it is not stored
+    int find(long long id) const {
+        auto it = slots_.find(id);
+        return it == slots_.end() ? -1 : it->second;
+    }
+    // ID in a slot, -1 if the slot is free
+    long long idAt(int slot) const {
+        return ids_[slot];
+    }
+    // slot -> ID for every slot, -1 for free ones
+    const std::vector<long long>& ids() const {
+        return ids_;
+    }
+    const json& metadataAt(int slot) const {
+        return metadata_[slot];
+    }
+    // The row as the index reads it (normalized for cosine)
+    const float* row(int slot) const {
+        return matrix_.data() + (size_t)slot * dim_;
+    }
+    // Row 0; rows are dim() floats apart
+    const float* data() const {
+        return matrix_.data();
+    }
+    // Length of the vector before row() normalized it (1 without normalize)
+    float normAt(int slot) const {
+        return normalize_ ? norms_[slot] : 1.0f;
+    }
+    // The vector as it was stored
+    std::vector<float> vectorAt(int slot) const;
+    // Same, into dim() floats at 'out'
+    void copyVector(int slot, float* out) const;
+
+    // The slot the next insert() takes
+    int nextSlot() const {
+        return free_.empty() ? slotCount() : free_.back();
+    }
+    // True when the next insert() needs a row past the allocated ones
+    bool full() const {
+        return free_.empty() && (size_t)ids_.size() * dim_ >= matrix_.size() && keep_vectors_;
+    }
+    // Reallocates the matrix to hold at least 'slots' rows. Returns the old
+    // rows, still intact, so whoever reads them can be moved to data()
+    // before they are freed.
+    AlignedVector<float> grow(int slots);
+
+    // Stores the vector in a free slot or a new one (growing the matrix if
+    // needed) and returns the slot. 'vec' is ignored without keep_vectors.
+    int insert(long long id, const float* vec, json metadata);
+    void update(int slot, const float* vec, json metadata);
+    // Frees the slot, returns the metadata that was in it
+    json erase(int slot);
+
+    // Renumbers the live vectors into slots 0..size()-1 in ID order
+    void compact();
+    // Moves the vectors into the layout slot_ids describes (slot -> ID, -1 =
+    // free), e.g. the labels of a saved index. Returns false and leaves the
+    // store alone unless it names exactly the stored IDs.
+    bool arrange(const std::vector<long long>& slot_ids);
+
+private:
+    int dim_ = 0;
+    bool normalize_ = false;
+    bool keep_vectors_ = true;
+    AlignedVector<float> matrix_;
+    std::vector<float> norms_;     // Cosine only: length of each vector before normalizing
+    std::vector<long long> ids_;   // slot -> ID, -1 = free
+    std::vector<json> metadata_;   // slot -> metadata
+    std::unordered_map<long long, int> slots_; // ID -> slot
+    std::vector<int> free_;        // Free slots, reused last-freed first
+
+    void setRow(int slot, const float* vec);
+};
+
+#endif // VECTOR_STORE_H
@@ -2,31 +2,241 @@
 #include <stdexcept>
 #include <fstream>
 #include <filesystem> // For checking file existence
+#include <random>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+
+// --- Index file header ---
+// The index file is this header, the label -> ID array, then the HNSW graph
+// (see HNSWFileHeader) starting at hnsw_offset.
+namespace {
+struct IndexFileHeader {
+    char magic[8];               // "VDBINDEX"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t generation;         // Must match the data file's "generation"
+    uint64_t label_count;        // Number of int64 IDs after the header
+    uint64_t hnsw_offset;        // Byte offset of the HNSW section (64-byte aligned)
+    uint64_t vectors_offset;     // Where the rows the graph reads start in the data file (0 = unknown)
+    char padding[16];
+};
+static_assert(sizeof(IndexFileHeader) == 64, "IndexFileHeader must be 64 bytes");
+
+const char INDEX_FILE_MAGIC[8] = {'V', 'D', 'B', 'I', 'N', 'D', 'E', 'X'};
+const uint32_t INDEX_FILE_VERSION = 2; // 2: no vectors, the graph reads the data file's
+
+// --- Data file header ---
+// The data file is this header and the sections it points to: the vectors,
+// count rows of dim floats, for cosine their norms, the IDs, the metadata
+// (count + 1 offsets into a blob of MessagePack values, then the blob) and
+// the settings (one MessagePack object). Values are in native byte order
+// (little-endian on everything we build for); endian_check catches a
+// mismatch.
+//
+// Row n is the store's slot n as the index reads it (normalized for
+// cosine), with ID -1 and null metadata for a free slot, so the rows are
+// also the vectors of the saved index (see IndexFileHeader). Version 1
+// files only have the live vectors, as they were added.
+struct DataFileHeader {
+    char magic[8];               // "VDBDATA"
+    uint32_t version;
+    uint32_t endian_check;       // DATA_ENDIAN_CHECK as written by the saving host
+    int32_t dim;
+    int32_t metric;              // Metric
+    int32_t ef_search;
+    uint32_t reserved;
+    uint64_t generation;         // Copied into the index file, see IndexFileHeader
+    int64_t next_id;
+    uint64_t count;              // Number of rows (slots), live or free
+    uint64_t offset_ids;         // count int64
+    uint64_t offset_metadata;    // count + 1 uint64 (relative to the blob), then the blob
+    uint64_t offset_settings;    // settings_size bytes
+    uint64_t settings_size;
+    uint64_t offset_vectors;     // count * dim floats (64-byte aligned)
+    uint64_t total_size;
+    uint64_t log_generation;     // Written by a checkpoint: the file holds the log
+    uint64_t log_offset;         // of log_generation up to log_offset (0 = none)
+    uint64_t offset_norms;       // count floats, the length of each row before normalizing (0 = none)
+};
+static_assert(sizeof(DataFileHeader) == 128, "DataFileHeader must be 128 bytes");
+
+const char DATA_FILE_MAGIC[8] = {'V', 'D', 'B', 'D', 'A', 'T', 'A', '\0'};
+const uint32_t DATA_FILE_VERSION = 2; // 2: rows in slot order, normalized for cosine
+const uint32_t DATA_ENDIAN_CHECK = 0x01020304;
+
+// --- Search filters ---
+
+// A filtered graph search walks about ef / share nodes to fill its beam
+// (share = matching / all vectors), each costing up to M0 distances, while
+// an exact scan costs one distance per match. search() scans when
+// matches * share <= ef * FILTER_SCAN_FACTOR; the factor is calibrated with
+// "vectordb_bench filter" (the scan wins from ~20% matching at 50k vectors,
+// from ~4% at 1M).
+const double FILTER_SCAN_FACTOR = 32.0;
+
+bool isRange(const json& condition) {
+    return condition.is_object();
+}
+
+void checkFilter(const json& filter) {
+    if (!filter.is_object()) {
+        throw std::invalid_argument("Filter must be a JSON object.");
+    }
+    for (const auto& [field, condition] : filter.items()) {
+        if (!isRange(condition)) {
+            continue;
+        }
+        if (condition.empty()) {
+            throw std::invalid_argument("Empty range for filter field '" + field + "'.");
+        }
+        for (const auto& [op, bound] : condition.items()) {
+            if ((op != "gt" && op != "gte" && op != "lt" && op != "lte") || !bound.is_number()) {
+                throw std::invalid_argument("Bad range for filter field '" + field +
+                                            "': expected numeric gt, gte, lt or lte.");
+            }
+        }
+    }
+}
+
+// matchesFilter() for a filter that already passed checkFilter()
+bool matchesCheckedFilter(const json& metadata, const json& filter) {
+    if (!metadata.is_object()) {
+        return filter.empty();
+    }
+    for (const auto& [field, condition] : filter.items()) {
+        auto value = metadata.find(field);
+        if (value == metadata.end()) {
+            return false;
+        }
+        if (condition.is_array()) {
+            if (std::find(condition.begin(), condition.end(), *value) == condition.end()) {
+                return false;
+            }
+        } else if (isRange(condition)) {
+            if (!value->is_number()) {
+                return false;
+            }
+            double v = value->get<double>();
+            for (const auto& [op, bound] : condition.items()) {
+                double b = bound.get<double>();
+                if ((op == "gt" && !(v > b)) || (op == "gte" && !(v >= b)) ||
+                    (op == "lt" && !(v < b)) || (op == "lte" && !(v <= b))) {
+                    return false;
+                }
+            }
+        } else if (*value != condition) {
+            return false;
+        }
+    }
+    return true;
+}
+
+unsigned long long newGeneration() {
+    std::random_device rd;
+    unsigned long long g = ((unsigned long long)rd() << 32) ^ rd();
+    return g == 0 ? 1 : g;
+}
+
+// Log size at which a change starts a checkpoint, see setCheckpointBytes()
+const uint64_t DEFAULT_CHECKPOINT_BYTES = 64ull << 20;
+
+// Puts a file written with an ofstream on disk, so the log records it
+// holds can be dropped once it is renamed into place
+void syncFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0 || ::fsync(fd) != 0) {
+        int error = errno;
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        throw std::runtime_error("Failed to sync " + path + ": " + std::strerror(error));
+    }
+    ::close(fd);
+}
+
+// An ostream target that appends to a string. HNSW::saveIndex() writes a
+// row at a time, which costs an ostringstream several times more.
+class StringSink : public std::streambuf {
+public:
+    explicit StringSink(std::string& out) : out_(out) {}
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        out_.append(s, n);
+        return n;
+    }
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            out_.push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    std::string& out_;
+};
+
+// Renames a fully written temp file over 'to', durably
+void renameDurably(const std::string& from, const std::string& to) {
+    syncFile(from);
+    std::filesystem::rename(from, to);
+    std::string dir = std::filesystem::path(to).parent_path().string();
+    syncFile(dir.empty() ? "." : dir);
+}
+}
+
+bool matchesFilter(const json& metadata, const json& filter) {
+    checkFilter(filter);
+    return matchesCheckedFilter(metadata, filter);
+}
 
 // --- Constructor & Destructor ---
 
-VectorDB::VectorDB(const std::string& dbPath) : 
+VectorDB::VectorDB(const std::string& dbPath, OpenMode mode, bool prefault) : 
     dbPath(dbPath),
-    dataFilePath(dbPath + ".json"),
-    indexFilePath(dbPath + ".hnsw"), // We don't use this yet, but good practice
+    dataFilePath(dbPath + ".vdb"),
+    jsonFilePath(dbPath + ".json"),
+    walFilePath(dbPath + ".wal"),
+    indexFilePath(dbPath + ".hnsw"),
+    mode(mode),
+    prefault(prefault),
     dim(0), 
-    nextId(0) {
+    metric(Metric::L2),
+    ef_search(0),
+    nextId(0),
+    generation(0),
+    data_vectors_offset(0),
+    index_dirty(false),
+    sync_writes(true),
+    log_start(),
+    checkpoint_done(false),
+    checkpoint_generation(0),
+    checkpoint_vectors_offset(0),
+    checkpoint_bytes(DEFAULT_CHECKPOINT_BYTES),
+    checkpoint_retry_bytes(0),
+    mapped_rows(nullptr),
+    mapped_norms(nullptr) {
     // Constructor body. We call load() to populate the db.
 }
 
 VectorDB::~VectorDB() {
-    // Destructor
+    finishCheckpoint();
 }
 
 // --- Public API ---
 
-void VectorDB::init(int dimension) {
-    if (std::filesystem::exists(dataFilePath)) {
+void VectorDB::init(int dimension, Metric metric) {
+    requireWritable();
+    if (std::filesystem::exists(dataFilePath) || std::filesystem::exists(jsonFilePath)) {
         throw std::runtime_error("Database file already exists. Cannot initialize.");
     }
     this->dim = dimension;
+    this->metric = metric;
     this->nextId = 1; // Start IDs at 1
-    this->vectors.clear();
+    store.reset(dimension, metric == Metric::Cosine);
     
     // Create an empty index
     rebuildIndex(); 
@@ -36,88 +246,359 @@ void VectorDB::init(int dimension) {
 }
 
 long long VectorDB::addVector(const std::vector<float>& vec, const json& metadata) {
+    requireWritable();
     if (vec.size() != (size_t)this->dim) {
         throw std::runtime_error("Vector dimension mismatch.");
     }
 
-    long long id = nextId++;
-    VectorData data;
-    data.id = id;
-    data.vec = vec;
-    data.metadata = metadata;
-    
-    vectors[id] = data;
-    // Note: Does not rebuild index. User must call rebuild().
+    long long id = nextId;
+    logWrite({WriteAheadLog::RecordType::Add, id, vec, metadata});
+    nextId++;
+    applyAdd(id, vec.data(), metadata);
+    maybeCheckpoint();
     return id;
 }
 
+void VectorDB::applyAdd(long long id, const float* vec, const json& metadata) {
+    std::unique_lock<std::mutex> change = beginChange(store.nextSlot());
+    if (store.full()) {
+        // Capacity doubles, so growing stays amortized O(1) per add. The
+        // index reads the rows in place: move it before the old rows go.
+        AlignedVector<float> old_rows = store.grow(std::max(store.slotCount() * 2, 16));
+        if (hnsw_index) {
+            hnsw_index->setExternalVectors(store.data());
+        }
+    }
+    int slot = store.insert(id, vec, metadata);
+
+    if (!hnsw_index || index_dirty) {
+        // The index is already out of date, the next rebuild picks this up
+        index_dirty = true;
+        return;
+    }
+
+    // Insert straight into the live index, so the vector is searchable now.
+    // HNSW reuses a deleted node if it has one; otherwise capacity doubles
+    // when full.
+    if (hnsw_index->getCurrentElementCount() >= hnsw_index->getMaxElements() && hnsw_index->getDeletedCount() == 0) {
+        hnsw_index->resizeIndex(std::max(hnsw_index->getMaxElements() * 2, 16));
+    }
+    hnsw_index->addPoint(store.row(slot), slot);
+    metadata_index.insert(slot, metadata);
+}
+
 std::pair<VectorData, bool> VectorDB::getVector(long long id) {
-    if (vectors.find(id) != vectors.end()) {
-        return {vectors[id], true};
+    int slot = store.find(id);
+    if (slot < 0) {
+        return {{}, false};
     }
-    return {{}, false};
+    VectorData data;
+    data.id = id;
+    data.metadata = store.metadataAt(slot);
+    data.vec = vectorAt(slot);
+    return {data, true};
+}
+
+std::vector<float> VectorDB::vectorAt(int slot) const {
+    if (store.hasVectors()) {
+        return store.vectorAt(slot);
+    }
+    // Mapped mode: the row in the data file, normalized for cosine
+    const float* row = mapped_rows + (size_t)slot * dim;
+    std::vector<float> vec(row, row + dim);
+    if (mapped_norms) {
+        for (float& x : vec) {
+            x *= mapped_norms[slot];
+        }
+    }
+    return vec;
 }
 
 bool VectorDB::updateVector(long long id, const std::vector<float>& vec, const json& metadata) {
-    if (vectors.find(id) == vectors.end()) {
+    requireWritable();
+    int slot = store.find(id);
+    if (slot < 0) {
         return false; // Not found
     }
      if (vec.size() != (size_t)this->dim) {
         throw std::runtime_error("Vector dimension mismatch.");
     }
-    
-    vectors[id].vec = vec;
-    vectors[id].metadata = metadata;
+
+    logWrite({WriteAheadLog::RecordType::Update, id, vec, metadata});
+    applyUpdate(slot, vec.data(), metadata);
+    maybeCheckpoint();
     return true;
 }
 
+void VectorDB::applyUpdate(int slot, const float* vec, const json& metadata) {
+    std::unique_lock<std::mutex> change = beginChange(slot);
+    bool in_index = hnsw_index && !index_dirty;
+    if (in_index) {
+        metadata_index.erase(slot, store.metadataAt(slot));
+        metadata_index.insert(slot, metadata);
+    }
+    store.update(slot, vec, metadata);
+
+    if (!in_index) {
+        index_dirty = true;
+        return;
+    }
+    // The row holds the new vector now: repair the node's neighborhood in
+    // the index, no rebuild
+    hnsw_index->updatePoint(slot, store.row(slot));
+}
+
 bool VectorDB::deleteVector(long long id) {
-    if (vectors.find(id) == vectors.end()) {
+    requireWritable();
+    int slot = store.find(id);
+    if (slot < 0) {
         return false; // Not found
     }
-    vectors.erase(id);
+    logWrite({WriteAheadLog::RecordType::Delete, id, {}, json()});
+    applyDelete(slot);
+    maybeCheckpoint();
     return true;
 }
 
-void VectorDB::rebuildIndex() {
-    // 1. Prepare the raw data in the format HNSW needs
-    // We need a single, flat array of floats
-    raw_vector_data.clear();
-    raw_vector_data.reserve(vectors.size() * dim);
-    
-    // We also need a map to get from the HNSW's internal index (0, 1, 2...)
-    // back to our external ID (1, 10, 105...)
-    // For this simple library, the internal label IS the index.
-    
-    int internal_index = 0;
-    std::map<int, long long> internal_to_external_id;
+void VectorDB::applyDelete(int slot) {
+    std::unique_lock<std::mutex> change = beginChange(slot);
+    json metadata = store.erase(slot);
 
-    for (auto const& [id, data] : vectors) {
-        raw_vector_data.insert(raw_vector_data.end(), data.vec.begin(), data.vec.end());
-        internal_to_external_id[internal_index] = id;
-        internal_index++;
+    if (!hnsw_index || index_dirty) {
+        index_dirty = true;
+        return;
     }
+    metadata_index.erase(slot, metadata);
+    // Tombstone it in the index: gone from results now, and the next
+    // addVector reuses both its slot and its HNSW node
+    hnsw_index->markDelete(slot);
+}
 
-    // 2. Create a new, empty index
-    int max_elements = std::max((int)vectors.size(), 1); // Ensure not zero
-    hnsw_index = std::make_unique<HNSW>(dim, max_elements, 16, 200);
+void VectorDB::logWrite(const WriteAheadLog::Record& record) {
+    if (!wal.isOpen()) {
+        return; // Neither init() nor load() ran, nothing on disk to follow
+    }
+    uint64_t lsn = wal.append(record);
+    if (sync_writes) {
+        wal.sync(lsn);
+    }
+}
+
+void VectorDB::replayLog() {
+    WriteAheadLog::replay(walFilePath, generation, [this](const WriteAheadLog::Record& record) {
+        if (record.type != WriteAheadLog::RecordType::Delete && record.vec.size() != (size_t)dim) {
+            throw std::runtime_error("Write-ahead log is corrupted (vector dimension mismatch).");
+        }
+        int slot = store.find(record.id);
+        if (record.type == WriteAheadLog::RecordType::Add && slot < 0) {
+            applyAdd(record.id, record.vec.data(), record.metadata);
+            nextId = std::max(nextId, record.id + 1);
+        } else if (record.type != WriteAheadLog::RecordType::Delete && slot >= 0) {
+            applyUpdate(slot, record.vec.data(), record.metadata);
+        } else if (record.type == WriteAheadLog::RecordType::Delete && slot >= 0) {
+            applyDelete(slot);
+        }
+    }, mode == OpenMode::ReadWrite, log_start);
+    if (mode == OpenMode::ReadWrite) {
+        wal.open(walFilePath, generation, log_start);
+        log_start = WriteAheadLog::Position();
+    }
+}
+
+void VectorDB::setSyncWrites(bool sync) {
+    sync_writes = sync;
+}
+
+void VectorDB::flush() {
+    if (wal.isOpen()) {
+        wal.flush();
+    }
+}
+
+bool VectorDB::checkpoint() {
+    requireWritable();
+    if (checkpoint_thread.joinable()) {
+        if (!checkpoint_done) {
+            return false;
+        }
+        joinCheckpoint();
+    }
+    if (!wal.isOpen()) {
+        return false; // The data file doesn't follow these contents (importJson()), save() first
+    }
+
+    // Everything as of the end of the log. Changes only come in through
+    // this thread, so nothing lands in between; from here on they go
+    // through beginChange(), which keeps what the checkpoint still needs.
+    auto info = std::make_shared<DataFileInfo>(dataFileInfo());
+    info->generation = newGeneration();
+    info->log_position = {wal.generation(), wal.size()};
+    auto snapshot = std::make_shared<StoreSnapshot>();
+    snapshot->slot_count = store.slotCount();
+    snapshot->graph_pending = hnsw_index && !index_dirty;
+
+    checkpoint_done = false;
+    checkpoint_error = nullptr;
+    checkpoint_generation = info->generation;
+    checkpoint_snapshot = snapshot;
+    // The thread reads the index and the store as described above, and the
+    // (constant) file paths; the log does its own locking
+    checkpoint_thread = std::thread([this, info, snapshot]() {
+        try {
+            std::string graph;
+            if (snapshot->graph_pending) {
+                // Searches go on meanwhile, see HNSW::saveIndex()
+                std::exception_ptr error;
+                try {
+                    graph.reserve(hnsw_index->savedSize());
+                    StringSink sink(graph);
+                    std::ostream o(&sink);
+                    hnsw_index->saveIndex(o);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(snapshot->lock);
+                    snapshot->graph_pending = false;
+                }
+                snapshot->graph_saved.notify_all();
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+            // Same order as save(); until the log is cut, load() reads the
+            // new data file and replays the log from log_position
+            std::vector<long long> slot_ids;
+            checkpoint_vectors_offset = writeDataFile(*info, snapshot.get(), slot_ids);
+            if (!graph.empty()) {
+                writeIndexFile(info->generation, checkpoint_vectors_offset, slot_ids, [&](std::ostream& o) {
+                    o.write(graph.data(), graph.size());
+                });
+            } else {
+                std::filesystem::remove(indexFilePath);
+            }
+            wal.checkpoint(info->generation, info->log_position.offset);
+        } catch (...) {
+            checkpoint_error = std::current_exception();
+        }
+        checkpoint_done = true;
+    });
+    return true;
+}
+
+void VectorDB::waitForCheckpoint() {
+    joinCheckpoint();
+}
+
+void VectorDB::setCheckpointBytes(uint64_t bytes) {
+    checkpoint_bytes = bytes;
+    checkpoint_retry_bytes = 0;
+}
+
+void VectorDB::joinCheckpoint() {
+    if (!checkpoint_thread.joinable()) {
+        return;
+    }
+    checkpoint_thread.join();
+    checkpoint_snapshot.reset();
+    if (checkpoint_error) {
+        std::exception_ptr error = checkpoint_error;
+        checkpoint_error = nullptr;
+        std::rethrow_exception(error);
+    }
+    // The files on disk are the checkpoint's now
+    generation = checkpoint_generation;
+    data_vectors_offset = checkpoint_vectors_offset;
+}
+
+std::unique_lock<std::mutex> VectorDB::beginChange(int slot) {
+    if (!checkpoint_snapshot) {
+        return std::unique_lock<std::mutex>();
+    }
+    StoreSnapshot& snapshot = *checkpoint_snapshot;
+    std::unique_lock<std::mutex> lock(snapshot.lock);
+    snapshot.graph_saved.wait(lock, [&] { return !snapshot.graph_pending; });
+    if (slot >= snapshot.written && slot < snapshot.slot_count && !snapshot.saved.count(slot)) {
+        StoreSnapshot::Slot& old = snapshot.saved[slot];
+        old.id = store.idAt(slot);
+        old.metadata = store.metadataAt(slot);
+        old.row.assign(store.row(slot), store.row(slot) + dim);
+        old.norm = store.normAt(slot);
+    }
+    return lock;
+}
+
+void VectorDB::waitForCheckpointGraph() {
+    if (!checkpoint_snapshot) {
+        return;
+    }
+    StoreSnapshot& snapshot = *checkpoint_snapshot;
+    std::unique_lock<std::mutex> lock(snapshot.lock);
+    snapshot.graph_saved.wait(lock, [&] { return !snapshot.graph_pending; });
+}
+
+void VectorDB::finishCheckpoint() {
+    try {
+        joinCheckpoint();
+    } catch (const std::exception& e) {
+        // The log still has every change
+        std::cerr << "Warning: checkpoint failed: " << e.what() << std::endl;
+    }
+}
+
+void VectorDB::maybeCheckpoint() {
+    if (checkpoint_bytes == 0 || !wal.isOpen() ||
+        wal.size() < std::max(checkpoint_bytes, checkpoint_retry_bytes) ||
+        (checkpoint_thread.joinable() && !checkpoint_done)) {
+        return;
+    }
+    try {
+        checkpoint();
+        checkpoint_retry_bytes = 0;
+    } catch (const std::exception& e) {
+        // The change itself is logged; don't fail it. Try again once the
+        // log has grown by as much again.
+        std::cerr << "Warning: checkpoint failed: " << e.what() << std::endl;
+        checkpoint_retry_bytes = wal.size() + checkpoint_bytes;
+    }
+}
+
+void VectorDB::rebuildIndex(int num_threads) {
+    if (mode == OpenMode::ReadOnlyMapped && isIndexMapped()) {
+        throw std::runtime_error("Database is open read-only (mapped index).");
+    }
+    // Renumbers every slot, the checkpoint must be done with them
+    finishCheckpoint();
+    // 1. Close the gaps deletes left, so the vectors are rows 0..n-1 (in
+    // ID order) and the slot of each is its label in the new index
+    hnsw_index.reset();
+    store.compact();
+
+    // 2. Create a new, empty index over the store's rows
+    int count = (int)store.size();
+    int max_elements = std::max(count, 1); // Ensure not zero
+    // M = 16 links per node on the upper layers, twice that on layer 0
+    hnsw_index = std::make_unique<HNSW>(dim, max_elements, 16, 32, 200, metric, store.data());
+    index_dirty = false;
+    rebuildMetadataIndex();
 
     // 3. Add all points to the index
-    if (raw_vector_data.empty()) {
+    if (count == 0) {
         std::cerr << "Warning: Rebuilding index with 0 vectors." << std::endl;
         return; // Nothing to index
     }
 
-    for (int i = 0; i < (int)vectors.size(); ++i) {
-        // Get the pointer to the start of the i-th vector
-        float* p = raw_vector_data.data() + (i * dim);
-        
-        // Use the internal index (0, 1, 2...) as the label
-        hnsw_index->addPoint(p, i);
+    // Inserts run in parallel, so internal ids inside HNSW may come out in
+    // a different order than the labels.
+    std::vector<int> labels(count);
+    for (int i = 0; i < count; ++i) {
+        labels[i] = i;
     }
+    hnsw_index->addPoints(store.data(), labels.data(), labels.size(), num_threads);
 }
 
-std::vector<std::pair<long long, float>> VectorDB::search(const std::vector<float>& query, int k) {
+std::vector<std::pair<long long, float>> VectorDB::search(const std::vector<float>& query, int k, int ef_search,
+                                                          const json& filter) {
     if (!hnsw_index) {
         throw std::runtime_error("Index is not built. Run 'rebuild' first.");
     }
@@ -125,29 +606,84 @@ std::vector<std::pair<long long, float>> VectorDB::search(const std::vector<floa
         throw std::runtime_error("Query vector dimension mismatch.");
     }
 
-    auto result_queue = hnsw_index->searchKnn(query.data(), k);
+    if (ef_search <= 0) {
+        ef_search = this->ef_search;
+    }
 
-    std::vector<std::pair<long long, float>> results;
-    
-    // The HNSW lib gives internal labels (0, 1, 2...)
-    // We need to map them back to our external IDs (1, 10, 105...)
-    // We can rebuild this map easily
-    std::map<int, long long> internal_to_external_id;
-    int i = 0;
-    for (auto const& [id, data] : vectors) {
-        internal_to_external_id[i++] = id;
+    std::priority_queue<std::pair<float, int>> result_queue;
+    if (filter.is_null()) {
+        result_queue = hnsw_index->searchKnn(query.data(), k, ef_search);
+    } else {
+        checkFilter(filter);
+        auto metadataOf = [&](int label) -> const json* {
+            return store.idAt(label) < 0 ? nullptr : &store.metadataAt(label);
+        };
+
+        // Indexed conditions: AND of their postings. The rest is checked
+        // on the metadata of what is left, or of every vector if nothing
+        // was indexed.
+        RoaringBitmap allowed;
+        json residual = json::object();
+        bool indexed = false;
+        for (const auto& [field, condition] : filter.items()) {
+            if (index_dirty || !metadata_index.hasField(field)) {
+                residual[field] = condition;
+            } else if (!indexed) {
+                metadata_index.lookup(field, condition, allowed);
+                indexed = true;
+            } else {
+                RoaringBitmap matching;
+                metadata_index.lookup(field, condition, matching);
+                allowed &= matching;
+            }
+        }
+        if (!indexed) {
+            for (int label = 0; label < store.slotCount(); ++label) {
+                const json* metadata = metadataOf(label);
+                if (metadata && matchesCheckedFilter(*metadata, residual)) {
+                    allowed.add((uint32_t)label);
+                }
+            }
+        } else if (!residual.empty()) {
+            RoaringBitmap kept;
+            allowed.forEach([&](uint32_t label) {
+                const json* metadata = metadataOf((int)label);
+                if (metadata && matchesCheckedFilter(*metadata, residual)) {
+                    kept.add(label);
+                }
+            });
+            allowed = std::move(kept);
+        }
+        size_t matches = allowed.cardinality();
+        if (matches == 0) {
+            return {};
+        }
+        RoaringLabelFilter allowed_filter(allowed);
+        double share = (double)matches / store.size();
+        int ef = std::max(ef_search > 0 ? ef_search : hnsw_index->getEfSearch(), k);
+        if (matches * share <= ef * FILTER_SCAN_FACTOR) {
+            result_queue = hnsw_index->searchKnnBruteForce(query.data(), k, &allowed_filter);
+        } else {
+            result_queue = hnsw_index->searchKnn(query.data(), k, ef_search, &allowed_filter);
+        }
     }
 
+    std::vector<std::pair<long long, float>> results;
+    results.reserve(result_queue.size());
+    
+    // The HNSW lib gives labels (0, 1, 2...), i.e. slots; the store maps
+    // them back to our external IDs (1, 10, 105...)
     while (!result_queue.empty()) {
         auto top = result_queue.top();
         result_queue.pop();
         
-        float dist = top.first;
-        int internal_id = top.second;
+        // The index works with squared L2, report the real euclidean distance.
+        // ip and cosine distances are already meaningful as-is.
+        float dist = (metric == Metric::L2) ? std::sqrt(top.first) : top.first;
+        int label = top.second;
 
-        if (internal_to_external_id.count(internal_id)) {
-            long long external_id = internal_to_external_id[internal_id];
-            results.push_back({external_id, dist});
+        if (label >= 0 && label < store.slotCount() && store.idAt(label) >= 0) {
+            results.push_back({store.idAt(label), dist});
         }
     }
     // The queue gives results in (farthest, ... , nearest) order
@@ -156,68 +692,685 @@ std::vector<std::pair<long long, float>> VectorDB::search(const std::vector<floa
 }
 
 void VectorDB::save() {
+    requireWritable();
+    finishCheckpoint();
+    // Every save gets a new generation, so an index file from an older save
+    // can never be mistaken for this one.
+    this->generation = newGeneration();
+
+    saveDataFile();
+
+    // The index is only worth keeping if it matches what we just wrote
+    if (hnsw_index && !index_dirty) {
+        saveIndexFile();
+    } else {
+        std::filesystem::remove(indexFilePath);
+    }
+
+    // The data file has every logged change now. Until the log is reset,
+    // its old generation keeps load() from replaying it on top.
+    if (wal.isOpen()) {
+        wal.reset(generation);
+    } else {
+        wal.open(walFilePath, generation);
+    }
+}
+
+void VectorDB::load() {
+    finishCheckpoint();
+    // The index reads the store's rows, drop it before they are replaced
+    hnsw_index.reset();
+    unmapDataFile();
+
+    if (std::filesystem::exists(dataFilePath)) {
+        loadDataFile();
+    } else if (std::filesystem::exists(jsonFilePath)) {
+        // Written by an older version; save() converts it
+        loadJsonFile(jsonFilePath);
+    } else {
+        // This is not an error if the file just doesn't exist yet
+        return;
+    }
+    if (isIndexMapped()) {
+        // Only mapped when the log is empty, see loadDataFile()
+        rebuildMetadataIndex();
+        return;
+    }
+
+    // Reuse the saved index if it belongs to this data file,
+    // otherwise rebuild it and save it for next time.
+    if (loadIndexFile()) {
+        rebuildMetadataIndex();
+    } else {
+        rebuildIndex();
+        if (generation != 0 && mode == OpenMode::ReadWrite) {
+            try {
+                saveIndexFile();
+            } catch (const std::exception& e) {
+                // Not fatal, the next load() just rebuilds again
+                std::cerr << "Warning: could not save index: " << e.what() << std::endl;
+            }
+        }
+    }
+
+    // Then the changes made since the data file was written
+    replayLog();
+}
+
+void VectorDB::importJson(const std::string& path) {
+    requireWritable();
+    finishCheckpoint();
+    // The log follows the contents being replaced; save() starts a new one
+    wal.close();
+    hnsw_index.reset();
+    unmapDataFile();
+    loadJsonFile(path);
+    rebuildIndex();
+}
+
+void VectorDB::exportJson(const std::string& path) const {
     json j;
     j["dim"] = this->dim;
+    j["metric"] = metricToString(this->metric);
+    j["efSearch"] = this->ef_search;
+    j["indexedFields"] = metadata_index.fields();
     j["nextId"] = this->nextId;
     json& j_vectors = j["vectors"];
-    
-    for (auto const& [id, data] : vectors) {
+
+    // In ID order, like the files have always been
+    std::vector<std::pair<long long, int>> slots;
+    slots.reserve(store.size());
+    for (int slot = 0; slot < store.slotCount(); ++slot) {
+        if (store.idAt(slot) >= 0) {
+            slots.push_back({store.idAt(slot), slot});
+        }
+    }
+    std::sort(slots.begin(), slots.end());
+    for (auto const& [id, slot] : slots) {
         json j_vec;
-        j_vec["id"] = data.id;
-        j_vec["metadata"] = data.metadata;
-        j_vec["vec"] = data.vec;
+        j_vec["id"] = id;
+        j_vec["metadata"] = store.metadataAt(slot);
+        j_vec["vec"] = vectorAt(slot);
         j_vectors.push_back(j_vec);
     }
 
-    std::ofstream o(dataFilePath);
+    std::ofstream o(path);
     if (!o.is_open()) {
-        throw std::runtime_error("Failed to open database file for writing: " + dataFilePath);
+        throw std::runtime_error("Failed to open file for writing: " + path);
     }
     o << j.dump(2); // pretty print with 2 spaces
     o.close();
+    if (!o) {
+        throw std::runtime_error("Failed to write file: " + path);
+    }
 }
 
-void VectorDB::load() {
-    std::ifstream i(dataFilePath);
+void VectorDB::loadJsonFile(const std::string& path) {
+    std::ifstream i(path);
     if (!i.is_open()) {
-        // This is not an error if the file just doesn't exist yet
-        // std::cerr << "Warning: Database file not found. Starting fresh." << std::endl;
-        return;
+        throw std::runtime_error("Failed to open file: " + path);
     }
 
-    json j;
+    // Streamed: each vector goes into the store as it is parsed, the file
+    // is never held as a whole (see readJsonDatabase())
     try {
-        i >> j;
-    } catch (json::parse_error& e) {
-        i.close();
-        throw std::runtime_error("Failed to parse database file (JSON error): " + std::string(e.what()));
+        json j = readJsonDatabase(i, [&](const json& header) {
+            this->dim = header.at("dim").get<int>();
+            // Files written before metrics existed are l2
+            this->metric = metricFromString(header.value("metric", std::string("l2")));
+            store.reset(dim, metric == Metric::Cosine);
+        }, [&](long long id, const std::vector<float>& vec, json metadata) {
+            if (vec.size() != (size_t)dim) {
+                throw std::runtime_error("Database file is corrupted (vector dimension mismatch).");
+            }
+            store.insert(id, vec.data(), std::move(metadata));
+        });
+
+        this->ef_search = j.value("efSearch", 0);
+        metadata_index = MetadataIndex();
+        for (const auto& field : j.value("indexedFields", std::vector<std::string>())) {
+            metadata_index.addField(field);
+        }
+        this->nextId = j.at("nextId").get<long long>();
+        this->generation = j.value("generation", 0ULL);
+        this->data_vectors_offset = 0;
+        this->log_start = WriteAheadLog::Position();
+    } catch (json::exception& e) {
+        throw std::runtime_error("Database file is corrupted (missing fields): " + std::string(e.what()));
+    }
+}
+
+VectorDB::DataFileInfo VectorDB::dataFileInfo() const {
+    return {dim, metric, ef_search, nextId, generation, metadata_index.fields(), WriteAheadLog::Position()};
+}
+
+void VectorDB::saveDataFile() {
+    std::vector<long long> slot_ids;
+    data_vectors_offset = writeDataFile(dataFileInfo(), nullptr, slot_ids);
+}
+
+uint64_t VectorDB::writeDataFile(const DataFileInfo& info, StoreSnapshot* snapshot,
+                                 std::vector<long long>& slot_ids) const {
+    DataFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, DATA_FILE_MAGIC, sizeof(header.magic));
+    header.version = DATA_FILE_VERSION;
+    header.endian_check = DATA_ENDIAN_CHECK;
+    header.dim = info.dim;
+    header.metric = (int32_t)info.metric;
+    header.ef_search = info.ef_search;
+    header.generation = info.generation;
+    header.next_id = info.next_id;
+    header.log_generation = info.log_position.generation;
+    header.log_offset = info.log_position.offset;
+
+    // Every slot, free ones included, so that row = label for the index
+    size_t count = snapshot ? snapshot->slot_count : store.slotCount();
+    header.count = count;
+
+    // Write to a temp file and rename, so a crash never leaves half a file
+    std::string tmpPath = dataFilePath + ".tmp";
+    std::ofstream o(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!o.is_open()) {
+        throw std::runtime_error("Failed to open database file for writing: " + tmpPath);
+    }
+    uint64_t offset = sizeof(header);
+    auto writeSection = [&](const void* data, size_t bytes, size_t alignment = 8) {
+        std::vector<char> padding((alignment - offset % alignment) % alignment, 0);
+        o.write(padding.data(), padding.size());
+        offset += padding.size();
+        uint64_t start = offset;
+        o.write(reinterpret_cast<const char*>(data), bytes);
+        offset += bytes;
+        return start;
+    };
+    o.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // One pass over the slots, a batch at a time: the rows go to the file
+    // right away, the rest (metadata as MessagePack, with offsets into the
+    // blob) follows them
+    std::vector<int64_t> ids(count);
+    std::vector<float> norms(info.metric == Metric::Cosine ? count : 0);
+    std::vector<uint64_t> metadata_offsets;
+    std::vector<uint8_t> metadata_blob;
+    metadata_offsets.reserve(count + 1);
+    metadata_offsets.push_back(0);
+    std::vector<float> rows(std::min<size_t>(count, 1024) * info.dim);
+    header.offset_vectors = writeSection(nullptr, 0, 64);
+    for (size_t first = 0; first < count; first += 1024) {
+        size_t batch = std::min<size_t>(count - first, 1024);
+        std::unique_lock<std::mutex> lock;
+        if (snapshot) {
+            lock = std::unique_lock<std::mutex>(snapshot->lock);
+        }
+        for (size_t slot = first; slot < first + batch; ++slot) {
+            float* row = rows.data() + (slot - first) * info.dim;
+            const StoreSnapshot::Slot* old = nullptr;
+            if (snapshot && !snapshot->saved.empty()) {
+                auto it = snapshot->saved.find((int)slot);
+                old = it != snapshot->saved.end() ? &it->second : nullptr;
+            }
+            if (old) {
+                // Changed since the checkpoint: what it held then
+                std::copy(old->row.begin(), old->row.end(), row);
+                ids[slot] = old->id;
+                json::to_msgpack(old->metadata, metadata_blob);
+                if (!norms.empty()) {
+                    norms[slot] = old->norm;
+                }
+                snapshot->saved.erase((int)slot);
+            } else {
+                std::copy(store.row(slot), store.row(slot) + info.dim, row);
+                ids[slot] = store.idAt(slot);
+                json::to_msgpack(store.metadataAt(slot), metadata_blob);
+                if (!norms.empty()) {
+                    norms[slot] = store.normAt(slot);
+                }
+            }
+            metadata_offsets.push_back(metadata_blob.size());
+        }
+        if (snapshot) {
+            snapshot->written = first + batch;
+            lock.unlock();
+        }
+        writeSection(rows.data(), batch * info.dim * sizeof(float), 1);
+    }
+    if (!norms.empty()) {
+        header.offset_norms = writeSection(norms.data(), norms.size() * sizeof(float));
+    }
+    std::vector<uint8_t> settings = json::to_msgpack(json{{"indexedFields", info.indexed_fields}});
+    header.settings_size = settings.size();
+    header.offset_ids = writeSection(ids.data(), ids.size() * sizeof(int64_t));
+    header.offset_metadata = writeSection(metadata_offsets.data(), metadata_offsets.size() * sizeof(uint64_t));
+    writeSection(metadata_blob.data(), metadata_blob.size(), 1);
+    header.offset_settings = writeSection(settings.data(), settings.size(), 1);
+    header.total_size = offset;
+
+    o.seekp(0);
+    o.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    o.close();
+    if (!o) {
+        throw std::runtime_error("Failed to write database file: " + tmpPath);
     }
-    i.close();
+    renameDurably(tmpPath, dataFilePath);
+    slot_ids.assign(ids.begin(), ids.end());
+    return header.offset_vectors;
+}
 
+void VectorDB::loadDataFile() {
+    std::ifstream i(dataFilePath, std::ios::binary);
+    if (!i.is_open()) {
+        throw std::runtime_error("Failed to open database file: " + dataFilePath);
+    }
+    DataFileHeader header;
+    i.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!i || std::memcmp(header.magic, DATA_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error("Not a database file: " + dataFilePath);
+    }
+    if (header.version < 1 || header.version > DATA_FILE_VERSION) {
+        throw std::runtime_error("Unsupported database file version " + std::to_string(header.version) + ".");
+    }
+    if (header.endian_check != DATA_ENDIAN_CHECK) {
+        throw std::runtime_error("Database file was written on a machine with a different byte order.");
+    }
+    uint64_t file_size = std::filesystem::file_size(dataFilePath);
+    if (header.dim <= 0 || header.metric < 0 || header.metric > (int32_t)Metric::Cosine || header.total_size > file_size ||
+        header.offset_vectors + header.count * header.dim * sizeof(float) > header.total_size ||
+        (header.offset_norms != 0 && header.offset_norms + header.count * sizeof(float) > header.total_size) ||
+        header.offset_settings + header.settings_size > header.total_size ||
+        header.offset_metadata + (header.count + 1) * sizeof(uint64_t) > header.total_size ||
+        header.offset_ids + header.count * sizeof(int64_t) > header.total_size) {
+        throw std::runtime_error("Database file is corrupted (truncated).");
+    }
+    auto readAt = [&](uint64_t offset, void* out, size_t bytes) {
+        i.seekg(offset);
+        i.read(reinterpret_cast<char*>(out), bytes);
+        if (!i) {
+            throw std::runtime_error("Database file is corrupted (short read).");
+        }
+    };
+
+    this->dim = header.dim;
+    this->metric = (Metric)header.metric;
+    this->ef_search = header.ef_search;
+    this->nextId = header.next_id;
+    this->generation = header.generation;
+    this->log_start = {header.log_generation, header.log_offset};
+    // Version 1 rows are neither in slot order nor normalized
+    this->data_vectors_offset = header.version >= 2 ? header.offset_vectors : 0;
+
+    size_t count = header.count;
+    std::vector<int64_t> ids(count);
+    std::vector<uint64_t> metadata_offsets(count + 1);
+    std::vector<json> metadata(count);
     try {
-        this->dim = j.at("dim").get<int>();
-        this->nextId = j.at("nextId").get<long long>();
-        
-        this->vectors.clear();
-        if (j.contains("vectors")) {
-            for (const auto& j_vec : j["vectors"]) {
-                VectorData data;
-                data.id = j_vec.at("id").get<long long>();
-                data.metadata = j_vec.at("metadata");
-                data.vec = j_vec.at("vec").get<std::vector<float>>();
-                
-                vectors[data.id] = data;
+        std::vector<uint8_t> bytes(header.settings_size);
+        readAt(header.offset_settings, bytes.data(), bytes.size());
+        json settings = json::from_msgpack(bytes);
+        metadata_index = MetadataIndex();
+        for (const auto& field : settings.value("indexedFields", std::vector<std::string>())) {
+            metadata_index.addField(field);
+        }
+
+        readAt(header.offset_ids, ids.data(), count * sizeof(int64_t));
+        readAt(header.offset_metadata, metadata_offsets.data(), metadata_offsets.size() * sizeof(uint64_t));
+        uint64_t blob = header.offset_metadata + metadata_offsets.size() * sizeof(uint64_t);
+        if (metadata_offsets[0] != 0 || blob + metadata_offsets[count] > header.offset_settings) {
+            throw std::runtime_error("Database file is corrupted (metadata offsets).");
+        }
+        // The blob follows the offsets, read it in order one value at a time
+        i.seekg(blob);
+        for (size_t n = 0; n < count; ++n) {
+            if (metadata_offsets[n + 1] < metadata_offsets[n]) {
+                throw std::runtime_error("Database file is corrupted (metadata offsets).");
+            }
+            bytes.resize(metadata_offsets[n + 1] - metadata_offsets[n]);
+            i.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+            if (!i) {
+                throw std::runtime_error("Database file is corrupted (short read).");
             }
+            metadata[n] = json::from_msgpack(bytes);
         }
     } catch (json::exception& e) {
-        throw std::runtime_error("Database file is corrupted (missing fields): " + std::string(e.what()));
+        throw std::runtime_error("Database file is corrupted (metadata): " + std::string(e.what()));
     }
 
-    // After loading data, we MUST rebuild the in-memory index
-    rebuildIndex();
+    // Read-only: if the index file is current, map it and the vectors here
+    // instead of reading them. Not when changes were logged since: the
+    // index doesn't have them.
+    std::vector<long long> slot_ids(ids.begin(), ids.end());
+    bool mapped = mode == OpenMode::ReadOnlyMapped && !WriteAheadLog::hasRecords(walFilePath, generation, log_start) &&
+                  mapIndexFile(slot_ids, data_vectors_offset, header.offset_norms);
+
+    size_t live = std::count_if(ids.begin(), ids.end(), [](int64_t id) { return id >= 0; });
+    store.reset(dim, metric == Metric::Cosine, !mapped);
+    if (mapped) {
+        for (size_t n = 0; n < count; ++n) {
+            if (ids[n] >= 0) {
+                store.insert(ids[n], nullptr, std::move(metadata[n]));
+            }
+        }
+        if (store.size() != live || !store.arrange(slot_ids)) {
+            throw std::runtime_error("Database file is corrupted (duplicate IDs).");
+        }
+        return;
+    }
+
+    std::vector<float> norms;
+    if (header.offset_norms != 0) {
+        norms.resize(count);
+        readAt(header.offset_norms, norms.data(), count * sizeof(float));
+    }
+
+    // The floats, a batch of rows at a time, straight into the store
+    store.grow((int)live);
+    std::vector<float> rows(std::min<size_t>(count, 4096) * dim);
+    i.seekg(header.offset_vectors);
+    for (size_t n = 0; n < count;) {
+        size_t batch = std::min(count - n, rows.size() / dim);
+        i.read(reinterpret_cast<char*>(rows.data()), batch * dim * sizeof(float));
+        if (!i) {
+            throw std::runtime_error("Database file is corrupted (short read).");
+        }
+        for (size_t r = 0; r < batch; ++r, ++n) {
+            if (ids[n] < 0) {
+                continue;
+            }
+            float* row = rows.data() + r * dim;
+            if (!norms.empty()) {
+                for (int d = 0; d < dim; ++d) {
+                    row[d] *= norms[n];
+                }
+            }
+            store.insert(ids[n], row, std::move(metadata[n]));
+        }
+    }
+    if (store.size() != live) {
+        throw std::runtime_error("Database file is corrupted (duplicate IDs).");
+    }
+    // Free slots in the file: take the same slots, so that an index built
+    // now reads the same rows as the file has
+    if (live != count) {
+        store.arrange(slot_ids);
+    }
+}
+
+void VectorDB::saveIndexFile() {
+    writeIndexFile(generation, data_vectors_offset, store.ids(), [&](std::ostream& o) {
+        hnsw_index->saveIndex(o);
+    });
+}
+
+void VectorDB::writeIndexFile(unsigned long long file_generation, uint64_t vectors_offset,
+                              const std::vector<long long>& slot_ids,
+                              const std::function<void(std::ostream&)>& write_graph) const {
+    IndexFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+    header.version = INDEX_FILE_VERSION;
+    header.generation = file_generation;
+    header.label_count = slot_ids.size();
+    header.vectors_offset = vectors_offset;
+    header.hnsw_offset = (sizeof(header) + slot_ids.size() * sizeof(int64_t) + 63) & ~(uint64_t)63;
+
+    // Write to a temp file and rename, so a crash never leaves half an index
+    std::string tmpPath = indexFilePath + ".tmp";
+    std::ofstream o(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!o.is_open()) {
+        throw std::runtime_error("Failed to open index file for writing: " + tmpPath);
+    }
+    o.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    static_assert(sizeof(long long) == sizeof(int64_t), "IDs are stored as int64");
+    o.write(reinterpret_cast<const char*>(slot_ids.data()), slot_ids.size() * sizeof(int64_t));
+    std::vector<char> padding(header.hnsw_offset - sizeof(header) - slot_ids.size() * sizeof(int64_t), 0);
+    o.write(padding.data(), padding.size());
+    write_graph(o);
+    o.close();
+    if (!o) {
+        throw std::runtime_error("Failed to write index file: " + tmpPath);
+    }
+    renameDurably(tmpPath, indexFilePath);
+}
+
+bool VectorDB::loadIndexFile() {
+    if (generation == 0) {
+        return false; // We can't tell which data an old index belongs to
+    }
+    std::ifstream i(indexFilePath, std::ios::binary);
+    if (!i.is_open()) {
+        return false;
+    }
+
+    IndexFileHeader header;
+    i.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!i || std::memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != INDEX_FILE_VERSION || header.generation != generation ||
+        header.label_count < store.size()) {
+        return false; // Stale or foreign: rebuild
+    }
+
+    try {
+        std::vector<long long> labels(header.label_count);
+        i.read(reinterpret_cast<char*>(labels.data()), labels.size() * sizeof(int64_t));
+        i.ignore(header.hnsw_offset - sizeof(header) - labels.size() * sizeof(int64_t));
+        // -1 marks a label freed by a delete. Put every vector in the slot
+        // its label names, so the index can read the rows as they are.
+        hnsw_index.reset();
+        if (!i || !store.arrange(labels)) {
+            return false;
+        }
+        std::unique_ptr<HNSW> index = HNSW::loadIndex(i, store.data());
+        // compact() can leave fewer nodes than labels, but every live node
+        // has a live label
+        if (index->getMetric() != metric || index->getDim() != dim ||
+            index->getCurrentElementCount() - index->getDeletedCount() != (int)store.size()) {
+            return false;
+        }
+        // The labels are rows of the store, dead nodes' too: a search
+        // still computes distances to them
+        for (int node = 0; node < index->getCurrentElementCount(); ++node) {
+            if (index->getLabel(node) >= store.slotCount()) {
+                return false;
+            }
+        }
+        hnsw_index = std::move(index);
+        index_dirty = false;
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Warning: ignoring unreadable index file: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+BatchSearchResults VectorDB::searchBatch(const float* queries, size_t nq, int k, int ef_search, int num_threads) {
+    if (!hnsw_index) {
+        throw std::runtime_error("Index is not built. Run 'rebuild' first.");
+    }
+    if (k <= 0) {
+        throw std::invalid_argument("k must be positive.");
+    }
+    if (ef_search <= 0) {
+        ef_search = this->ef_search;
+    }
+
+    BatchSearchResults results;
+    results.nq = nq;
+    results.k = k;
+    results.ids.resize(nq * k);
+    results.distances.resize(nq * k);
+    std::vector<int> labels(nq * k);
+    std::call_once(search_pool_started, [this] { search_pool = std::make_unique<ThreadPool>(); });
+    hnsw_index->searchKnnBatch(*search_pool, queries, nq, k, results.distances.data(), labels.data(), ef_search,
+                               num_threads);
+
+    // Slots to IDs and distances as in search(), in place: a row only
+    // moves up where a slot has no vector
+    for (size_t q = 0; q < nq; ++q) {
+        size_t end = (q + 1) * k;
+        size_t out = q * k;
+        for (size_t i = q * k; i < end; ++i) {
+            int label = labels[i];
+            if (label >= 0 && label < store.slotCount() && store.idAt(label) >= 0) {
+                float dist = results.distances[i];
+                results.ids[out] = store.idAt(label);
+                results.distances[out++] = (metric == Metric::L2) ? std::sqrt(dist) : dist;
+            }
+        }
+        for (; out < end; ++out) {
+            results.ids[out] = -1;
+            results.distances[out] = std::numeric_limits<float>::infinity();
+        }
+    }
+    return results;
+}
+
+void VectorDB::createFieldIndex(const std::string& field) {
+    requireWritable();
+    if (metadata_index.hasField(field)) {
+        return;
+    }
+    metadata_index.addField(field);
+    rebuildMetadataIndex();
+}
+
+void VectorDB::dropFieldIndex(const std::string& field) {
+    requireWritable();
+    metadata_index.removeField(field);
+}
+
+std::vector<std::string> VectorDB::getIndexedFields() const {
+    return metadata_index.fields();
+}
+
+void VectorDB::rebuildMetadataIndex() {
+    metadata_index.clear();
+    for (int slot = 0; slot < store.slotCount(); ++slot) {
+        if (store.idAt(slot) >= 0) {
+            metadata_index.insert(slot, store.metadataAt(slot));
+        }
+    }
 }
 
 int VectorDB::getDimensions() const {
     return this->dim;
 }
 
+Metric VectorDB::getMetric() const {
+    return this->metric;
+}
+
+void VectorDB::setEfSearch(int ef_search) {
+    if (ef_search < 0) {
+        throw std::invalid_argument("ef_search must not be negative.");
+    }
+    this->ef_search = ef_search;
+}
+
+int VectorDB::getEfSearch() const {
+    return this->ef_search;
+}
+
+double VectorDB::getDeletedRatio() const {
+    return hnsw_index ? hnsw_index->getDeletedRatio() : 0.0;
+}
+
+bool VectorDB::compactIndex(double min_deleted_ratio) {
+    requireWritable();
+    if (!hnsw_index || index_dirty || hnsw_index->getDeletedCount() == 0 ||
+        hnsw_index->getDeletedRatio() < min_deleted_ratio) {
+        return false;
+    }
+    waitForCheckpointGraph();
+    // Labels don't change, so the store's slots stay valid
+    hnsw_index->compact();
+    return true;
+}
+
+bool VectorDB::needsRebuild() const {
+    return index_dirty;
+}
+
+bool VectorDB::isIndexMapped() const {
+    return hnsw_index && hnsw_index->isReadOnly();
+}
+
+void VectorDB::requireWritable() const {
+    if (mode == OpenMode::ReadOnlyMapped) {
+        throw std::runtime_error("Database is open read-only.");
+    }
+}
+
+bool VectorDB::mapIndexFile(const std::vector<long long>& slot_ids, uint64_t vectors_offset, uint64_t norms_offset) {
+    if (generation == 0 || vectors_offset == 0 || !std::filesystem::exists(indexFilePath)) {
+        return false; // No index, or a data file whose rows are not the index's
+    }
+    try {
+        auto file = std::make_shared<MappedFile>(indexFilePath, MappedFile::Advice::Random, prefault);
+        if (file->size() < sizeof(IndexFileHeader)) {
+            return false;
+        }
+        IndexFileHeader header;
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (std::memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != INDEX_FILE_VERSION || header.generation != generation ||
+            header.vectors_offset != vectors_offset || header.label_count != slot_ids.size() ||
+            sizeof(header) + header.label_count * sizeof(int64_t) > file->size()) {
+            return false; // Stale or foreign
+        }
+        // The labels must be the data file's slots, then row = label
+        const int64_t* labels = reinterpret_cast<const int64_t*>(file->data() + sizeof(header));
+        if (!std::equal(slot_ids.begin(), slot_ids.end(), labels)) {
+            return false;
+        }
+
+        // The vectors stay in the data file, the index reads them there
+        auto data = std::make_shared<MappedFile>(dataFilePath, MappedFile::Advice::Random, prefault);
+        if (vectors_offset + slot_ids.size() * dim * sizeof(float) > data->size() ||
+            (norms_offset != 0 && norms_offset + slot_ids.size() * sizeof(float) > data->size())) {
+            return false;
+        }
+        const float* rows = reinterpret_cast<const float*>(data->data() + vectors_offset);
+        std::unique_ptr<HNSW> index = HNSW::openMapped(file, header.hnsw_offset, rows);
+        if (index->getMetric() != metric || index->getDim() != dim) {
+            return false;
+        }
+
+        // Each live row has one live node, and no live node another row.
+        // Dead nodes still need a row, searches read them.
+        std::vector<bool> seen(slot_ids.size(), false);
+        size_t nodes = 0;
+        for (int i = 0; i < index->getCurrentElementCount(); ++i) {
+            int label = index->getLabel(i);
+            if (label >= (int)slot_ids.size()) {
+                return false;
+            }
+            if (index->isMarkedDeleted(i)) {
+                continue;
+            }
+            if (slot_ids[label] < 0 || seen[label]) {
+                return false;
+            }
+            seen[label] = true;
+            ++nodes;
+        }
+        if (nodes != (size_t)std::count_if(slot_ids.begin(), slot_ids.end(), [](long long id) { return id >= 0; })) {
+            return false;
+        }
+        hnsw_index = std::move(index);
+        mapped_data = data;
+        mapped_rows = rows;
+        mapped_norms = norms_offset ? reinterpret_cast<const float*>(data->data() + norms_offset) : nullptr;
+        index_dirty = false;
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Warning: could not map index file: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+void VectorDB::unmapDataFile() {
+    mapped_rows = nullptr;
+    mapped_norms = nullptr;
+    mapped_data.reset();
+}
+
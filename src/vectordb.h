@@ -9,58 +9,315 @@
 #include <stdexcept>
 #include <sstream>
 #include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <exception>
 
 // The HNSW library header
 #include "hnsw.h" 
 // The JSON library header
 #include "json.hpp"
+// Postings for indexed metadata fields
+#include "metadata_index.h"
+// Vectors, IDs and metadata, in columns
+#include "vector_store.h"
+// Log of the changes since the last save()
+#include "write_ahead_log.h"
+// Streaming reader for the JSON data files of older versions
+#include "json_database_reader.h"
 
 // Use the nlohmann::json library
 using json = nlohmann::json;
 
-// Holds our metadata and the raw vector data
+// One vector with its ID and metadata, as getVector() returns it
 struct VectorData {
     long long id;
     std::vector<float> vec;
     json metadata;
 };
 
+// What searchBatch() returns: a matrix of nq rows of k, row-major. Row q
+// holds the results of query q, nearest first, padded with ID -1 (and
+// distance +infinity) if there are fewer than k.
+struct BatchSearchResults {
+    size_t nq = 0;
+    int k = 0;
+    std::vector<long long> ids;
+    std::vector<float> distances;
+
+    long long id(size_t q, int i) const {
+        return ids[q * k + i];
+    }
+    float distance(size_t q, int i) const {
+        return distances[q * k + i];
+    }
+};
+
+// Metadata filter for search(): a JSON object whose keys are metadata
+// fields, all of which must match.
+//   {"tenant": "acme"}                  field equals the value
+//   {"lang": ["en", "de"]}              field equals one of the values
+//   {"price": {"gte": 10, "lt": 20}}    numeric range (gt, gte, lt, lte)
+// Throws std::invalid_argument if the filter is malformed.
+bool matchesFilter(const json& metadata, const json& filter);
+
+// How load() brings the index into memory
+enum class OpenMode {
+    ReadWrite,      // Index is read into (or rebuilt in) heap memory; everything allowed
+    ReadOnlyMapped  // Index and data files are mmap'ed and searched in place; no mutations
+};
+
 class VectorDB {
 public:
-    VectorDB(const std::string& dbPath);
+    // In ReadOnlyMapped mode, processes opening the same database share one
+    // page-cache copy of the index and the vectors. 'prefault' reads the whole mapping in at
+    // load() instead of on first touch. If the index file is missing or stale,
+    // load() falls back to an in-memory index (and still never writes).
+    VectorDB(const std::string& dbPath, OpenMode mode = OpenMode::ReadWrite, bool prefault = false);
     ~VectorDB();
 
-    void init(int dim);
+    void init(int dim, Metric metric = Metric::L2);
+    // Also inserts into the index (growing it as needed), so the vector is
+    // searchable right away, unless the index already needs a rebuild.
     long long addVector(const std::vector<float>& vec, const json& metadata);
     std::pair<VectorData, bool> getVector(long long id);
+    // Also moves the vector in the index and repairs the links around it,
+    // unless the index already needs a rebuild.
     bool updateVector(long long id, const std::vector<float>& vec, const json& metadata);
+    // Removes the vector from search results right away (it is tombstoned in
+    // the index, no rebuild needed), unless the index already needs a rebuild.
     bool deleteVector(long long id);
 
-    void rebuildIndex();
-    std::vector<std::pair<long long, float>> search(const std::vector<float>& query, int k);
+    // Rebuilds the index on num_threads threads (0 = one per core)
+    void rebuildIndex(int num_threads = 0);
+    // Returns (id, distance) pairs, nearest first. The distance depends on
+    // the metric: euclidean distance for l2, 1 - dot for ip, 1 - cos for cosine.
+    // ef_search is the search beam width for this query; 0 uses the
+    // database default (see setEfSearch()).
+    // With a filter (see matchesFilter()), only matching vectors are
+    // returned. The graph search still walks through the others; when only
+    // a small share matches, the matches are scanned exactly instead.
+    // Conditions on indexed fields (see createFieldIndex()) are answered
+    // from postings lists, the rest by reading each candidate's metadata.
+    std::vector<std::pair<long long, float>> search(const std::vector<float>& query, int k, int ef_search = 0,
+                                                    const json& filter = json());
+    // search() without a filter for the nq queries in the rows of 'queries'
+    // (getDimensions() floats each), on at most num_threads (0 = all) of
+    // the database's search threads, one per core. The threads are started
+    // once and shared by concurrent batches, so those never run on more
+    // threads than there are cores. Each thread reuses its visited list and
+    // heaps from one query and one batch to the next, see
+    // HNSW::searchKnnBatch().
+    BatchSearchResults searchBatch(const float* queries, size_t nq, int k, int ef_search = 0, int num_threads = 0);
 
+    // Keeps an inverted index of 'field' for search() filters. The set of
+    // indexed fields is stored in the data file by save() or a checkpoint,
+    // not in the write-ahead log: a change made since is lost in a crash.
+    // The postings are rebuilt from the metadata on load(). Throws
+    // std::runtime_error if the database is open read-only.
+    void createFieldIndex(const std::string& field);
+    void dropFieldIndex(const std::string& field);
+    std::vector<std::string> getIndexedFields() const;
+
+    // Default search beam width, stored in the data file by save().
+    // 0 means the HNSW default (HNSW_DEFAULT_EF_SEARCH).
+    void setEfSearch(int ef_search);
+    int getEfSearch() const;
+
+    // save() writes the data file, plus the index file when the index is in
+    // sync with the data. load() reuses that index file if it belongs to the
+    // data file it just read, and only rebuilds when it is missing or stale.
+    // Between saves, addVector(), updateVector() and deleteVector() append
+    // to a write-ahead log, which load() replays, so a change is on disk
+    // without rewriting the data file; save() empties the log, and so does
+    // a checkpoint() in the background.
+    // The data file is binary (see saveDataFile()); a database that only has
+    // the JSON file of older versions is read from that, and the next save()
+    // converts it.
     void save();
     void load();
 
+    // Replaces the contents with a JSON file in the format exportJson()
+    // writes (that of the old data files) and rebuilds the index. Like the
+    // other changes, it is written by save().
+    void importJson(const std::string& path);
+    void exportJson(const std::string& path) const;
+
+    // With sync (the default), a change is fsynced to the log before the
+    // call returns; concurrent writers share fsyncs. Without, it only
+    // reaches the OS (safe from a process crash, not from power loss) until
+    // flush(), save() or destruction. flush() only touches the log, so it
+    // may run in parallel with the other calls (VectorDBServer does).
+    void setSyncWrites(bool sync);
+    void flush();
+
+    // Writes the contents as a new data and index file and drops the log
+    // records they hold, so load() has less to replay. Nothing is copied in
+    // the calling thread: a background thread serializes the index (changes
+    // wait for that, searches don't), then writes the files while changes
+    // go on (and are logged as usual), then cuts the log. Returns false if
+    // a checkpoint is already running.
+    bool checkpoint();
+    // Waits for a running checkpoint; throws what it failed with
+    void waitForCheckpoint();
+    // A change that grows the log past 'bytes' starts a checkpoint
+    // (default 64 MiB, 0 = never), so load() replays about that much at most
+    void setCheckpointBytes(uint64_t bytes);
+
     // Public getter for the dimension
     int getDimensions() const;
+    // Public getter for the distance metric chosen at init()
+    Metric getMetric() const;
+    // Share of index nodes that are deleted-but-not-yet-removed tombstones
+    double getDeletedRatio() const;
+    // Removes the tombstones from the index (see HNSW::compact()) if their
+    // share is at least min_deleted_ratio. Returns true if it compacted.
+    bool compactIndex(double min_deleted_ratio = 0.0);
+
+    // True when changes since the last rebuild are not in the index yet
+    bool needsRebuild() const;
+    // True if load() is serving searches straight from the mapped index file
+    bool isIndexMapped() const;
 
 private:
     std::string dbPath;
-    std::string dataFilePath;
-    std::string indexFilePath; // We aren't using this yet, but good to have
+    std::string dataFilePath;  // Binary vectors and metadata, see saveDataFile()
+    std::string jsonFilePath;  // Data file of older versions, still read by load()
+    std::string walFilePath;   // Changes since the data file, see WriteAheadLog
+    std::string indexFilePath; // Binary HNSW index, see saveIndexFile()
+    OpenMode mode;
+    bool prefault;
 
     int dim; // Vector dimensionality
+    Metric metric; // Distance metric, fixed at init()
+    int ef_search; // Default search beam width, 0 = HNSW default
     long long nextId;
-    std::map<long long, VectorData> vectors; // Stores all data
+
+    // All vectors. A vector's slot in the store is its HNSW label, and the
+    // index reads the store's rows in place rather than keeping a copy.
+    VectorStore store;
     
     // The HNSW index. We use a unique_ptr to manage its lifecycle
     // because we will be deleting and recreating it on rebuild.
     std::unique_ptr<HNSW> hnsw_index;
 
-    // Helper to store raw pointers for HNSW
-    // This is rebuilt by rebuildIndex()
-    std::vector<float> raw_vector_data;
+    // Workers for searchBatch(), one per core, started by its first call
+    // and shared by the batches of all threads
+    std::unique_ptr<ThreadPool> search_pool;
+    std::once_flag search_pool_started;
+
+    // Postings by slot for the indexed metadata fields. In step with the
+    // store while the index is, i.e. unless index_dirty.
+    MetadataIndex metadata_index;
+
+    // Random tag written into the data file on every save() and copied into
+    // the index file, so load() can tell whether the index belongs to the data.
+    // 0 means "unknown" (e.g. a file from before index files existed).
+    unsigned long long generation;
+    // Where the store's rows start in that data file, which holds them in
+    // slot order; 0 if it doesn't (older file, JSON)
+    uint64_t data_vectors_offset;
+
+    // True when vectors were added/updated/deleted since the last rebuild,
+    // i.e. the index no longer matches the data and must not be saved.
+    bool index_dirty;
+
+    // Open after init(), load() (read-write) or save(); records every change
+    WriteAheadLog wal;
+    bool sync_writes;
+
+    // Where the data file leaves off in the log, if a checkpoint wrote it
+    // but did not get to cut the log (offset 0: the whole log)
+    WriteAheadLog::Position log_start;
+
+    // The running or finished-but-not-joined checkpoint, see checkpoint()
+    std::thread checkpoint_thread;
+    std::atomic<bool> checkpoint_done;
+    std::exception_ptr checkpoint_error;
+    unsigned long long checkpoint_generation; // Of the files it writes
+    uint64_t checkpoint_vectors_offset;       // In the data file it writes
+    uint64_t checkpoint_bytes;
+    uint64_t checkpoint_retry_bytes; // After a failed automatic checkpoint, the log size to try again at
+
+    // The store as of a running checkpoint, without a copy up front: a
+    // change to a slot the checkpoint thread has not written yet saves the
+    // old contents here first. The thread reads the store, and changes
+    // write it, under 'lock'.
+    struct StoreSnapshot {
+        struct Slot {
+            long long id;
+            json metadata;
+            std::vector<float> row; // As the index reads it
+            float norm;
+        };
+        std::mutex lock;
+        std::condition_variable graph_saved;
+        bool graph_pending = false; // Changes wait until the thread has the index serialized
+        int slot_count = 0;         // Slots at the time of the checkpoint
+        int written = 0;            // Slots below this are in the file already
+        std::unordered_map<int, Slot> saved;
+    };
+    std::shared_ptr<StoreSnapshot> checkpoint_snapshot;
+
+    // Read-only mapped mode: the store keeps no vectors, the index and
+    // getVector() read them from the mapped data file (row = slot)
+    std::shared_ptr<MappedFile> mapped_data;
+    const float* mapped_rows;
+    const float* mapped_norms; // Cosine only, see vectorAt()
+
+    // The changes themselves, without logging (replayLog() uses them too)
+    void applyAdd(long long id, const float* vec, const json& metadata);
+    void applyUpdate(int slot, const float* vec, const json& metadata);
+    void applyDelete(int slot);
+    void logWrite(const WriteAheadLog::Record& record);
+    void replayLog();
+    void maybeCheckpoint();
+    // Waits for the checkpoint thread; joinCheckpoint() throws its error,
+    // finishCheckpoint() only reports it
+    void joinCheckpoint();
+    void finishCheckpoint();
+    // Called before a change to the store and index: waits until a running
+    // checkpoint has serialized the index, and saves the slot for it if it
+    // still has to write it. The store changes under the returned lock,
+    // which is empty without a checkpoint.
+    std::unique_lock<std::mutex> beginChange(int slot);
+    // Waits until a running checkpoint has serialized the index, for a
+    // change to the index alone
+    void waitForCheckpointGraph();
+
+    // What the data file holds besides the store's contents
+    struct DataFileInfo {
+        int dim;
+        Metric metric;
+        int ef_search;
+        long long next_id;
+        unsigned long long generation;
+        std::vector<std::string> indexed_fields;
+        WriteAheadLog::Position log_position; // See log_start
+    };
+    DataFileInfo dataFileInfo() const;
+
+    void rebuildMetadataIndex();
+    void saveDataFile();
+    // Writes the store, or a checkpoint's snapshot of it. Fills slot_ids
+    // with the IDs written, returns the offset of the vectors in the file.
+    uint64_t writeDataFile(const DataFileInfo& info, StoreSnapshot* snapshot, std::vector<long long>& slot_ids) const;
+    void loadDataFile();
+    void loadJsonFile(const std::string& path);
+    void saveIndexFile();
+    void writeIndexFile(unsigned long long file_generation, uint64_t vectors_offset,
+                        const std::vector<long long>& slot_ids,
+                        const std::function<void(std::ostream&)>& write_graph) const;
+    bool loadIndexFile();
+    bool mapIndexFile(const std::vector<long long>& slot_ids, uint64_t vectors_offset, uint64_t norms_offset);
+    void unmapDataFile();
+    // The vector in a slot as it was stored, from the store or the mapping
+    std::vector<float> vectorAt(int slot) const;
+    void requireWritable() const;
 };
 
 #endif // VECTORDB_H
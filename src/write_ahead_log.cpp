@@ -0,0 +1,405 @@
+#include "write_ahead_log.h"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+// --- Log file header ---
+// Values are in native byte order; endian_check catches a mismatch.
+struct WalHeader {
+    char magic[8];          // "VDBWAL"
+    uint32_t version;
+    uint32_t endian_check;  // WAL_ENDIAN_CHECK as written by the writing host
+    uint64_t generation;    // Generation of the data file the records follow
+    uint64_t reserved;
+};
+static_assert(sizeof(WalHeader) == 32, "WalHeader must be 32 bytes");
+
+const char WAL_MAGIC[8] = {'V', 'D', 'B', 'W', 'A', 'L', '\0', '\0'};
+const uint32_t WAL_VERSION = 1;
+const uint32_t WAL_ENDIAN_CHECK = 0x01020304;
+
+// Every record is framed as uint32 payload length, uint32 CRC-32 of the
+// payload, then the payload:
+//   uint8 type, int64 id
+//   Add / Update: uint32 dim, dim floats, uint32 n, n bytes of MessagePack metadata
+const size_t FRAME_BYTES = 2 * sizeof(uint32_t);
+// A length above this is garbage, not a record
+const uint32_t MAX_PAYLOAD_BYTES = 1u << 30;
+
+uint32_t crc32(const uint8_t* data, size_t size) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+template <typename T>
+void put(std::vector<uint8_t>& out, const T& value) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), p, p + sizeof(T));
+}
+
+// Reads values off a payload, throwing if it runs out
+struct PayloadReader {
+    const uint8_t* p;
+    const uint8_t* end;
+
+    template <typename T>
+    T get() {
+        T value;
+        bytes(&value, sizeof(T));
+        return value;
+    }
+    void bytes(void* out, size_t n) {
+        if ((size_t)(end - p) < n) {
+            throw std::runtime_error("Write-ahead log record is truncated.");
+        }
+        std::memcpy(out, p, n);
+        p += n;
+    }
+};
+
+bool readHeader(std::istream& in, WalHeader& header) {
+    in.read(reinterpret_cast<char*>(&header), sizeof(header));
+    return in && std::memcmp(header.magic, WAL_MAGIC, sizeof(header.magic)) == 0 &&
+           header.version == WAL_VERSION && header.endian_check == WAL_ENDIAN_CHECK;
+}
+
+void writeAll(int fd, const void* data, size_t size, const std::string& path) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to write to " + path + ": " + std::strerror(errno));
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+void syncFile(int fd, const std::string& path) {
+#ifdef __APPLE__
+    int rc = ::fsync(fd);
+#else
+    int rc = ::fdatasync(fd);
+#endif
+    if (rc != 0) {
+        throw std::runtime_error("Failed to sync " + path + ": " + std::strerror(errno));
+    }
+}
+
+// Makes a rename in the directory of 'path' durable
+void syncDirectory(const std::string& path) {
+    std::string dir = std::filesystem::path(path).parent_path().string();
+    int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open directory of " + path + ": " + std::strerror(errno));
+    }
+    int rc = ::fsync(fd);
+    ::close(fd);
+    if (rc != 0) {
+        throw std::runtime_error("Failed to sync directory of " + path + ": " + std::strerror(errno));
+    }
+}
+
+// Appends bytes [from, to) of 'in' to 'out'
+void copyRange(int in, int out, uint64_t from, uint64_t to, const std::string& path) {
+    std::vector<char> buffer(1 << 20);
+    while (from < to) {
+        ssize_t n = ::pread(in, buffer.data(), std::min<uint64_t>(buffer.size(), to - from), from);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to read " + path + ": " + std::strerror(errno));
+        }
+        writeAll(out, buffer.data(), n, path);
+        from += n;
+    }
+}
+
+// Offset of the first record replay() takes from a log with this header,
+// 0 if it takes none
+uint64_t firstRecord(const WalHeader& header, uint64_t generation, const WriteAheadLog::Position& start) {
+    if (header.generation == generation) {
+        return sizeof(WalHeader);
+    }
+    if (start.offset != 0 && header.generation == start.generation) {
+        return std::max<uint64_t>(start.offset, sizeof(WalHeader));
+    }
+    return 0;
+}
+}
+
+// --- Reading ---
+
+size_t WriteAheadLog::replay(const std::string& path, uint64_t generation,
+                             const std::function<void(const Record&)>& apply, bool truncate,
+                             const Position& start) {
+    std::ifstream in(path, std::ios::binary);
+    WalHeader header;
+    if (!in.is_open() || !readHeader(in, header)) {
+        return 0;
+    }
+    uint64_t good_end = firstRecord(header, generation, start);
+    if (good_end == 0) {
+        return 0;
+    }
+    in.seekg(good_end);
+
+    size_t count = 0;
+    std::vector<uint8_t> payload;
+    while (true) {
+        uint32_t frame[2];
+        in.read(reinterpret_cast<char*>(frame), FRAME_BYTES);
+        if (!in || frame[0] > MAX_PAYLOAD_BYTES) {
+            break;
+        }
+        payload.resize(frame[0]);
+        in.read(reinterpret_cast<char*>(payload.data()), payload.size());
+        if (!in || crc32(payload.data(), payload.size()) != frame[1]) {
+            break; // Torn by a crash mid-append
+        }
+
+        PayloadReader reader{payload.data(), payload.data() + payload.size()};
+        Record record;
+        record.type = (RecordType)reader.get<uint8_t>();
+        record.id = reader.get<int64_t>();
+        if (record.type == RecordType::Add || record.type == RecordType::Update) {
+            record.vec.resize(reader.get<uint32_t>());
+            reader.bytes(record.vec.data(), record.vec.size() * sizeof(float));
+            std::vector<uint8_t> metadata(reader.get<uint32_t>());
+            reader.bytes(metadata.data(), metadata.size());
+            record.metadata = json::from_msgpack(metadata);
+        } else if (record.type != RecordType::Delete) {
+            throw std::runtime_error("Write-ahead log has a record of unknown type " +
+                                     std::to_string((int)record.type) + ".");
+        }
+        apply(record);
+        ++count;
+        good_end += FRAME_BYTES + payload.size();
+    }
+    in.close();
+
+    if (truncate && good_end < std::filesystem::file_size(path)) {
+        std::filesystem::resize_file(path, good_end);
+    }
+    return count;
+}
+
+bool WriteAheadLog::hasRecords(const std::string& path, uint64_t generation, const Position& start) {
+    std::ifstream in(path, std::ios::binary);
+    WalHeader header;
+    if (!in.is_open() || !readHeader(in, header)) {
+        return false;
+    }
+    uint64_t first = firstRecord(header, generation, start);
+    return first != 0 && std::filesystem::file_size(path) > first;
+}
+
+// --- Writing ---
+
+WriteAheadLog::~WriteAheadLog() {
+    try {
+        close();
+    } catch (const std::exception&) {
+        // Nothing to report to in a destructor; the records are in the OS
+    }
+}
+
+void WriteAheadLog::open(const std::string& path, uint64_t generation, const Position& start) {
+    close();
+    path_ = path;
+    uint64_t first = 0;
+    bool current = false;
+    {
+        std::ifstream in(path, std::ios::binary);
+        WalHeader header;
+        if (in.is_open() && readHeader(in, header)) {
+            first = firstRecord(header, generation, start);
+            current = header.generation == generation;
+        }
+    }
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        throw std::runtime_error("Failed to open write-ahead log " + path + ": " + std::strerror(errno));
+    }
+    if (first == 0) {
+        reset(generation);
+        return;
+    }
+    end_ = durable_ = std::filesystem::file_size(path);
+    generation_ = current ? generation : start.generation;
+    if (!current) {
+        // Finish the cut a checkpoint did not get to
+        checkpoint(generation, first);
+    }
+}
+
+void WriteAheadLog::reset(uint64_t generation) {
+    std::unique_lock<std::mutex> lock(lock_);
+    // Let a running sync() finish first, it still uses the old length
+    synced_.wait(lock, [this] { return !syncing_; });
+    if (::ftruncate(fd_, 0) != 0) {
+        throw std::runtime_error("Failed to truncate " + path_ + ": " + std::strerror(errno));
+    }
+    writeHeader(fd_, generation);
+    syncFile(fd_, path_);
+    end_ = durable_ = sizeof(WalHeader);
+    generation_ = generation;
+}
+
+void WriteAheadLog::checkpoint(uint64_t generation, uint64_t offset) {
+    if (fd_ < 0) {
+        throw std::runtime_error("Write-ahead log is not open.");
+    }
+    offset = std::max<uint64_t>(offset, sizeof(WalHeader));
+    if (offset > size()) {
+        throw std::invalid_argument("Checkpoint offset is past the end of the write-ahead log.");
+    }
+
+    std::string tmp_path = path_ + ".tmp";
+    int out = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (out < 0) {
+        throw std::runtime_error("Failed to open " + tmp_path + ": " + std::strerror(errno));
+    }
+    try {
+        writeHeader(out, generation);
+        // Everything appended so far, while appends go on
+        uint64_t copied = size();
+        copyRange(fd_, out, offset, copied, path_);
+        syncFile(out, tmp_path);
+
+        // What came in meanwhile, then swap the files
+        std::unique_lock<std::mutex> lock(lock_);
+        synced_.wait(lock, [this] { return !syncing_; });
+        copyRange(fd_, out, copied, end_, path_);
+        syncFile(out, tmp_path);
+        if (::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+            throw std::runtime_error("Failed to replace " + path_ + ": " + std::strerror(errno));
+        }
+        ::close(fd_);
+        fd_ = out;
+        end_ = durable_ = sizeof(WalHeader) + (end_ - offset);
+        generation_ = generation;
+    } catch (...) {
+        ::close(out);
+        ::unlink(tmp_path.c_str());
+        throw;
+    }
+    // Either file is a valid log for the data file until the rename lands
+    syncDirectory(path_);
+}
+
+void WriteAheadLog::writeHeader(int fd, uint64_t generation) {
+    WalHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, WAL_MAGIC, sizeof(header.magic));
+    header.version = WAL_VERSION;
+    header.endian_check = WAL_ENDIAN_CHECK;
+    header.generation = generation;
+    writeAll(fd, &header, sizeof(header), path_);
+}
+
+void WriteAheadLog::close() {
+    if (fd_ < 0) {
+        return;
+    }
+    flush();
+    ::close(fd_);
+    fd_ = -1;
+}
+
+uint64_t WriteAheadLog::append(const Record& record) {
+    // Encode outside the lock, so concurrent writers only queue for write()
+    std::vector<uint8_t> buffer(FRAME_BYTES);
+    put(buffer, (uint8_t)record.type);
+    put(buffer, (int64_t)record.id);
+    if (record.type != RecordType::Delete) {
+        put(buffer, (uint32_t)record.vec.size());
+        const uint8_t* vec = reinterpret_cast<const uint8_t*>(record.vec.data());
+        buffer.insert(buffer.end(), vec, vec + record.vec.size() * sizeof(float));
+        std::vector<uint8_t> metadata = json::to_msgpack(record.metadata);
+        put(buffer, (uint32_t)metadata.size());
+        buffer.insert(buffer.end(), metadata.begin(), metadata.end());
+    }
+    uint32_t frame[2] = {(uint32_t)(buffer.size() - FRAME_BYTES), 0};
+    frame[1] = crc32(buffer.data() + FRAME_BYTES, frame[0]);
+    std::memcpy(buffer.data(), frame, FRAME_BYTES);
+
+    std::lock_guard<std::mutex> lock(lock_);
+    if (fd_ < 0) {
+        throw std::runtime_error("Write-ahead log is not open.");
+    }
+    writeAll(fd_, buffer.data(), buffer.size(), path_);
+    end_ += buffer.size();
+    return end_;
+}
+
+void WriteAheadLog::sync(uint64_t lsn) {
+    std::unique_lock<std::mutex> lock(lock_);
+    // An LSN from before a reset() is past end_; its record is in the data file
+    while (durable_ < std::min(lsn, end_) && fd_ >= 0) {
+        if (syncing_) {
+            // Someone else's fdatasync may cover us; check again when it ends
+            synced_.wait(lock);
+            continue;
+        }
+        syncing_ = true;
+        uint64_t target = end_;
+        lock.unlock();
+        try {
+            syncFile(fd_, path_);
+        } catch (...) {
+            lock.lock();
+            syncing_ = false;
+            synced_.notify_all();
+            throw;
+        }
+        lock.lock();
+        syncing_ = false;
+        durable_ = std::max(durable_, target);
+        synced_.notify_all();
+    }
+}
+
+void WriteAheadLog::flush() {
+    uint64_t end;
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        end = end_;
+    }
+    sync(end);
+}
+
+uint64_t WriteAheadLog::size() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return end_;
+}
+
+uint64_t WriteAheadLog::generation() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return generation_;
+}
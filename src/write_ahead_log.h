@@ -0,0 +1,108 @@
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdint>
+
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+/*
+Append-only log of the adds, updates and deletes made since the data file
+was written.
+
+The log starts with a header naming the generation of the data file it
+continues; save() writes a new data file and then resets the log to that
+generation, so a log left from before the last save is recognized as stale
+and ignored. Each record is framed as length, CRC-32, payload, so a record
+torn by a crash is detected and cut off when the log is replayed.
+
+A checkpoint (see checkpoint()) writes the data file while appends go on,
+so the new data file holds the log up to some offset. It records that
+position, and the log is accepted from there until the checkpoint cuts it.
+
+append() hands a record to the OS and returns its log sequence number (the
+end offset); sync() returns once everything up to an LSN is on disk.
+Concurrent sync() calls share fsyncs (group commit): one caller syncs while
+the others wait, and the one sync covers all records appended before it.
+*/
+class WriteAheadLog {
+public:
+    enum class RecordType : uint8_t { Add = 1, Update = 2, Delete = 3 };
+
+    struct Record {
+        RecordType type;
+        long long id;
+        std::vector<float> vec; // Add and Update
+        json metadata;          // Add and Update
+    };
+
+    // A point in the log of a generation. Offset 0 (as in Position()) means none.
+    struct Position {
+        uint64_t generation;
+        uint64_t offset;
+    };
+
+    WriteAheadLog() = default;
+    ~WriteAheadLog();
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Calls apply() on every record of the log at 'path' in order, if the
+    // log continues 'generation'. Stops at a torn or corrupt record; with
+    // truncate, the file is cut there so appends go after the last good
+    // record. Returns the number of records applied.
+    // A log that still continues start.generation is replayed too, from
+    // start.offset on (a checkpoint wrote the data file up to there, but
+    // did not get to cut the log).
+    static size_t replay(const std::string& path, uint64_t generation, const std::function<void(const Record&)>& apply,
+                         bool truncate, const Position& start = Position());
+    // True if replay() would find records
+    static bool hasRecords(const std::string& path, uint64_t generation, const Position& start = Position());
+
+    // Opens the log for appending, creating it or resetting it to
+    // 'generation' if it continues another one. A log at 'start' is cut
+    // there instead, see checkpoint(). Call replay() first.
+    void open(const std::string& path, uint64_t generation, const Position& start = Position());
+    // Empties the log and makes it continue 'generation'
+    void reset(uint64_t generation);
+    // Drops the records before 'offset' (they are in a new data file) and
+    // makes the log continue 'generation'. The records after it are copied
+    // into a new file, most of them while appends go on; appends only wait
+    // for the last few and the rename.
+    void checkpoint(uint64_t generation, uint64_t offset);
+    // Syncs what is pending and closes the file
+    void close();
+    bool isOpen() const {
+        return fd_ >= 0;
+    }
+
+    uint64_t append(const Record& record);
+    void sync(uint64_t lsn);
+    // sync() everything appended so far
+    void flush();
+    // Bytes in the log, header included
+    uint64_t size();
+    // The generation the log continues
+    uint64_t generation();
+
+private:
+    std::atomic<int> fd_{-1}; // checkpoint() swaps it while isOpen() may look
+    std::string path_;
+    std::mutex lock_;
+    std::condition_variable synced_;
+    uint64_t end_ = 0;       // Bytes written
+    uint64_t durable_ = 0;   // Bytes known to be on disk
+    uint64_t generation_ = 0;
+    bool syncing_ = false;   // One sync() is in fdatasync, the others wait for it
+
+    void writeHeader(int fd, uint64_t generation);
+};
+
+#endif // WRITE_AHEAD_LOG_H